@@ -0,0 +1,405 @@
+//
+// Barnes-Hut quadtree for long-range particle forces.
+//
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include "ThreadPool.hpp"
+#include "ParticleStore.hpp"
+#include "SimdKernels.hpp"
+
+// Every object carries a charge of polarity * radius^2 (polarity is a charge
+// per unit area, mass being radius^2 in the collision solver) and feels
+//     a_i = strength * polarity_i * sum_j q_j * (p_i - p_j) / (|p_i - p_j|^2 + softening^2)^1.5
+// so with a positive strength like polarities repel and opposite ones
+// attract, a negative strength makes like polarities attract. Objects with
+// a polarity of 0 neither feel nor cause the force.
+//
+// The tree is a linear quadtree over Morton keys. The first top_depth
+// levels are complete, the keys are bucketed by their top bits with a
+// counting sort and each bucket's subtree is sorted and built as its own
+// task. Every node keeps separate monopoles for its positive and negative
+// charges, a single net charge would cancel out in neutral regions.
+struct BarnesHut {
+    static constexpr uint32_t top_depth = 3;
+    static constexpr uint32_t bucket_count = 1u << (2 * top_depth);
+    static constexpr uint32_t top_nodes = (bucket_count - 1) / 3;
+    static constexpr uint32_t max_depth = 16;
+    static constexpr uint32_t leaf_size = 32;
+    static constexpr uint32_t none = 0;
+
+    struct Node {
+        Vector2f center;
+        float half = 0.0f;
+        // Children are first_child .. first_child + 3, none for a leaf
+        uint32_t first_child = none;
+        // Range of the node in the sorted arrays
+        uint32_t begin = 0, end = 0;
+        float q_pos = 0.0f, q_neg = 0.0f;
+        Vector2f c_pos, c_neg;
+    };
+
+    // A node is replaced by its monopoles when its size over its distance is below this
+    float opening_angle = 0.5f;
+    float strength = 0.0f;
+    float softening = 0.5f;
+    // AVX2 sums 8 interactions at a time with a refined rsqrt, close to but not
+    // bit-identical with the scalar loop
+    KernelMode kernel_mode = KernelMode::Scalar;
+
+    std::vector<Node> nodes;
+    // Acceleration of every object from the last compute, by slot
+    std::vector<Vector2f> field;
+
+    // Builds the tree over the objects inside [0, world_size] and evaluates the field
+    void compute(ThreadPool& pool, const ParticleStore& objects, Vector2f world_size){
+        const auto count = static_cast<uint32_t>(objects.size());
+        field.assign(count, {});
+        build(pool, objects, world_size);
+        leaves.clear();
+        for(uint32_t n{0}; n < nodes.size(); n++){
+            if(nodes[n].first_child == none && nodes[n].begin != nodes[n].end) leaves.push_back(n);
+        }
+        pool.dispatch(static_cast<uint32_t>(leaves.size()), [this](uint32_t start, uint32_t end){
+            Interactions list;
+            for(uint32_t l{start}; l < end; l++) evaluateLeaf(leaves[l], list);
+        });
+    }
+
+    [[nodiscard]]
+    uint32_t chargedCount() const {
+        return charged;
+    }
+
+private:
+    uint32_t charged = 0;
+    float key_scale = 1.0f;
+    // (morton << 32 | slot) per charged object, bucketed then sorted
+    std::vector<uint64_t> keys;
+    std::vector<uint64_t> bucketed;
+    std::vector<uint32_t> object_bucket;
+    std::vector<std::vector<uint32_t>> histograms;
+    std::vector<uint32_t> bucket_start;
+    std::vector<uint32_t> sorted_index;
+    std::vector<Vector2f> sorted_pos;
+    std::vector<float> sorted_charge;
+    std::vector<float> sorted_polarity;
+    std::vector<std::vector<Node>> subtrees;
+    std::vector<uint32_t> leaves;
+
+    // Point charges acting on a whole leaf, as flat arrays for the inner loop
+    struct Interactions {
+        std::vector<float> x, y, q;
+
+        void clear(){
+            x.clear();
+            y.clear();
+            q.clear();
+        }
+
+        void add(Vector2f p, float charge){
+            x.push_back(p.x);
+            y.push_back(p.y);
+            q.push_back(charge);
+        }
+    };
+
+    static uint32_t spreadBits(uint32_t v){
+        v &= 0x0000FFFF;
+        v = (v | (v << 8)) & 0x00FF00FF;
+        v = (v | (v << 4)) & 0x0F0F0F0F;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    }
+
+    // x bits above y bits, so digit >> 1 is the x half and digit & 1 the y half
+    [[nodiscard]]
+    uint32_t mortonOf(Vector2f p) const {
+        const auto quantize = [this](float v){
+            const float q = v * key_scale;
+            return q > 0.0f ? static_cast<uint32_t>(std::min(q, 65535.0f)) : 0u;
+        };
+        return (spreadBits(quantize(p.x)) << 1) | spreadBits(quantize(p.y));
+    }
+
+    static Vector2f childCenter(const Node& parent, uint32_t digit){
+        const float h = parent.half * 0.5f;
+        return {parent.center.x + ((digit >> 1) ? h : -h), parent.center.y + ((digit & 1) ? h : -h)};
+    }
+
+    void build(ThreadPool& pool, const ParticleStore& objects, Vector2f world_size){
+        const auto count = static_cast<uint32_t>(objects.size());
+        const float side = std::max(world_size.x, world_size.y);
+        key_scale = 65536.0f / side;
+        const uint32_t chunk_count = pool.thread_count;
+        histograms.resize(chunk_count);
+        object_bucket.resize(count);
+        keys.resize(count);
+
+        // Counting sort of the charged objects into the top level buckets,
+        // in slot order inside a bucket whatever the chunking
+        pool.dispatchIndexed(count, [&](uint32_t chunk, uint32_t start, uint32_t end){
+            std::vector<uint32_t>& histogram = histograms[chunk];
+            histogram.assign(bucket_count, 0);
+            for(uint32_t i{start}; i < end; i++){
+                if(!objects.polarity[i]){
+                    object_bucket[i] = bucket_count;
+                    continue;
+                }
+                const uint32_t morton = mortonOf(objects.pos[i]);
+                keys[i] = static_cast<uint64_t>(morton) << 32 | i;
+                object_bucket[i] = morton >> (32 - 2 * top_depth);
+                histogram[object_bucket[i]]++;
+            }
+        });
+        bucket_start.assign(bucket_count + 1, 0);
+        uint32_t running = 0;
+        for(uint32_t b{0}; b < bucket_count; b++){
+            bucket_start[b] = running;
+            for(std::vector<uint32_t>& histogram : histograms){
+                const uint32_t n = histogram[b];
+                histogram[b] = running;
+                running += n;
+            }
+        }
+        bucket_start[bucket_count] = running;
+        charged = running;
+        bucketed.resize(charged);
+        pool.dispatchIndexed(count, [&](uint32_t chunk, uint32_t start, uint32_t end){
+            std::vector<uint32_t>& cursors = histograms[chunk];
+            for(uint32_t i{start}; i < end; i++){
+                if(object_bucket[i] < bucket_count) bucketed[cursors[object_bucket[i]]++] = keys[i];
+            }
+        });
+
+        sorted_index.resize(charged);
+        sorted_pos.resize(charged);
+        sorted_charge.resize(charged);
+        sorted_polarity.resize(charged);
+        nodes.assign(top_nodes, Node{});
+        nodes[0].center = {side * 0.5f, side * 0.5f};
+        nodes[0].half = side * 0.5f;
+        for(uint32_t n{0}; n < top_nodes; n++){
+            nodes[n].first_child = 4 * n + 1;
+        }
+        nodes.resize(top_nodes + bucket_count);
+        for(uint32_t n{0}; n < top_nodes; n++){
+            for(uint32_t digit{0}; digit < 4; digit++){
+                Node& child = nodes[4 * n + 1 + digit];
+                child.center = childCenter(nodes[n], digit);
+                child.half = nodes[n].half * 0.5f;
+            }
+        }
+
+        subtrees.resize(bucket_count);
+        for(uint32_t b{0}; b < bucket_count; b++){
+            pool.addTask([this, &objects, b]{
+                buildBucket(objects, b);
+            });
+        }
+        pool.waitForCompletion();
+
+        // Stitch the subtrees behind the complete top levels, their roots are
+        // the last top level and the other nodes are appended in bucket order
+        std::vector<uint32_t> base(bucket_count);
+        auto total = static_cast<uint32_t>(nodes.size());
+        for(uint32_t b{0}; b < bucket_count; b++){
+            base[b] = total;
+            total += static_cast<uint32_t>(subtrees[b].size()) - 1;
+        }
+        nodes.resize(total);
+        pool.dispatch(bucket_count, [&](uint32_t start, uint32_t end){
+            for(uint32_t b{start}; b < end; b++){
+                const std::vector<Node>& subtree = subtrees[b];
+                const uint32_t offset = base[b] - 1;
+                for(uint32_t n{0}; n < subtree.size(); n++){
+                    Node node = subtree[n];
+                    if(node.first_child != none) node.first_child += offset;
+                    nodes[n ? offset + n : top_nodes + b] = node;
+                }
+            }
+        });
+
+        for(uint32_t n{top_nodes}; n--;){
+            nodes[n].begin = nodes[4 * n + 1].begin;
+            nodes[n].end = nodes[4 * n + 4].end;
+            gatherChildren(nodes, n);
+        }
+    }
+
+    void buildBucket(const ParticleStore& objects, uint32_t b){
+        const uint32_t begin = bucket_start[b];
+        const uint32_t end = bucket_start[b + 1];
+        std::sort(bucketed.begin() + begin, bucketed.begin() + end);
+        for(uint32_t k{begin}; k < end; k++){
+            const auto i = static_cast<uint32_t>(bucketed[k]);
+            const float r = objects.radius[i];
+            sorted_index[k] = i;
+            sorted_pos[k] = objects.pos[i];
+            sorted_polarity[k] = static_cast<float>(objects.polarity[i]);
+            sorted_charge[k] = sorted_polarity[k] * r * r;
+        }
+        std::vector<Node>& subtree = subtrees[b];
+        subtree.assign(1, nodes[top_nodes + b]);
+        buildNode(subtree, 0, begin, end, top_depth);
+    }
+
+    void buildNode(std::vector<Node>& tree, uint32_t n, uint32_t begin, uint32_t end, uint32_t depth){
+        tree[n].begin = begin;
+        tree[n].end = end;
+        if(end - begin <= leaf_size || depth == max_depth){
+            Node& leaf = tree[n];
+            leaf.first_child = none;
+            leaf.q_pos = leaf.q_neg = 0.0f;
+            leaf.c_pos = leaf.c_neg = {};
+            for(uint32_t k{begin}; k < end; k++){
+                const float q = sorted_charge[k];
+                if(q > 0.0f){
+                    leaf.q_pos += q;
+                    leaf.c_pos += q * sorted_pos[k];
+                }else{
+                    leaf.q_neg += q;
+                    leaf.c_neg += q * sorted_pos[k];
+                }
+            }
+            if(leaf.q_pos != 0.0f) leaf.c_pos /= leaf.q_pos;
+            if(leaf.q_neg != 0.0f) leaf.c_neg /= leaf.q_neg;
+            return;
+        }
+
+        const auto first = static_cast<uint32_t>(tree.size());
+        tree[n].first_child = first;
+        tree.resize(first + 4);
+        const uint32_t shift = 2 * (max_depth - 1 - depth) + 32;
+        uint32_t split = begin;
+        for(uint32_t digit{0}; digit < 4; digit++){
+            const uint32_t child_begin = split;
+            while(split < end && ((bucketed[split] >> shift) & 3) == digit) split++;
+            tree[first + digit].center = childCenter(tree[n], digit);
+            tree[first + digit].half = tree[n].half * 0.5f;
+            buildNode(tree, first + digit, child_begin, split, depth + 1);
+        }
+        gatherChildren(tree, n);
+    }
+
+    static void gatherChildren(std::vector<Node>& tree, uint32_t n){
+        Node& node = tree[n];
+        node.q_pos = node.q_neg = 0.0f;
+        node.c_pos = node.c_neg = {};
+        for(uint32_t c{node.first_child}; c < node.first_child + 4; c++){
+            const Node& child = tree[c];
+            node.q_pos += child.q_pos;
+            node.c_pos += child.q_pos * child.c_pos;
+            node.q_neg += child.q_neg;
+            node.c_neg += child.q_neg * child.c_neg;
+        }
+        if(node.q_pos != 0.0f) node.c_pos /= node.q_pos;
+        if(node.q_neg != 0.0f) node.c_neg /= node.q_neg;
+    }
+
+    // The walk is done once per leaf: a node is used as monopoles when it
+    // is far enough from the whole leaf, otherwise its objects are taken one
+    // by one. Every object of the leaf then sums the same list.
+    void evaluateLeaf(uint32_t l, Interactions& list){
+        const Node& leaf = nodes[l];
+        const float leaf_radius = leaf.half * std::sqrt(2.0f);
+        const float theta2 = opening_angle * opening_angle;
+        list.clear();
+        uint32_t stack[4 * max_depth];
+        uint32_t top = 0;
+        stack[top++] = 0;
+        while(top){
+            const uint32_t n = stack[--top];
+            const Node& node = nodes[n];
+            if(node.begin == node.end || n == l) continue;
+            const Vector2f d = leaf.center - node.center;
+            const float gap = std::sqrt(d.x * d.x + d.y * d.y) - leaf_radius;
+            const float size = 2.0f * node.half;
+            // Far enough from every point of the leaf and not containing it
+            if(gap > 0.0f && size * size < theta2 * gap * gap && d.x * d.x + d.y * d.y > 2.0f * node.half * node.half){
+                if(node.q_pos != 0.0f) list.add(node.c_pos, node.q_pos);
+                if(node.q_neg != 0.0f) list.add(node.c_neg, node.q_neg);
+            }else if(node.first_child == none){
+                for(uint32_t j{node.begin}; j < node.end; j++) list.add(sorted_pos[j], sorted_charge[j]);
+            }else{
+                for(uint32_t c{node.first_child + 4}; c-- > node.first_child;) stack[top++] = c;
+            }
+        }
+
+        const float soft2 = softening * softening;
+        const auto count = static_cast<uint32_t>(list.q.size());
+#ifdef PHYSICS_SIMD_X86
+        const bool avx2 = kernel_mode == KernelMode::AVX2;
+#endif
+        for(uint32_t k{leaf.begin}; k < leaf.end; k++){
+            const Vector2f p = sorted_pos[k];
+            Vector2f sum;
+#ifdef PHYSICS_SIMD_X86
+            if(avx2){
+                sum = sumAVX2(p, list.x.data(), list.y.data(), list.q.data(), count, soft2);
+            }else
+#endif
+            {
+                sum = sumScalar(p, list.x.data(), list.y.data(), list.q.data(), count, soft2);
+            }
+            for(uint32_t j{leaf.begin}; j < leaf.end; j++){
+                if(j == k) continue;
+                sum += sumScalar(p, &sorted_pos[j].x, &sorted_pos[j].y, &sorted_charge[j], 1, soft2);
+            }
+            field[sorted_index[k]] = sum * (strength * sorted_polarity[k]);
+        }
+    }
+
+    static Vector2f sumScalar(Vector2f p, const float* xs, const float* ys, const float* qs, uint32_t count, float soft2){
+        float ax = 0.0f, ay = 0.0f;
+        for(uint32_t m{0}; m < count; m++){
+            const float dx = p.x - xs[m];
+            const float dy = p.y - ys[m];
+            const float dist2 = dx * dx + dy * dy + soft2;
+            const float f = qs[m] / (dist2 * std::sqrt(dist2));
+            ax += f * dx;
+            ay += f * dy;
+        }
+        return {ax, ay};
+    }
+
+#ifdef PHYSICS_SIMD_X86
+    PHYSICS_TARGET_AVX2
+    static Vector2f sumAVX2(Vector2f p, const float* xs, const float* ys, const float* qs, uint32_t count, float soft2){
+        const __m256 px = _mm256_set1_ps(p.x);
+        const __m256 py = _mm256_set1_ps(p.y);
+        const __m256 vsoft2 = _mm256_set1_ps(soft2);
+        const __m256 half = _mm256_set1_ps(0.5f);
+        const __m256 three_halves = _mm256_set1_ps(1.5f);
+        __m256 ax = _mm256_setzero_ps();
+        __m256 ay = _mm256_setzero_ps();
+        uint32_t m{0};
+        for(; m + 8 <= count; m += 8){
+            const __m256 dx = _mm256_sub_ps(px, _mm256_loadu_ps(xs + m));
+            const __m256 dy = _mm256_sub_ps(py, _mm256_loadu_ps(ys + m));
+            const __m256 dist2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), vsoft2);
+            // 1 / dist^3 from the rsqrt estimate refined by one Newton step
+            __m256 inv = _mm256_rsqrt_ps(dist2);
+            inv = _mm256_mul_ps(inv, _mm256_sub_ps(three_halves, _mm256_mul_ps(_mm256_mul_ps(half, dist2), _mm256_mul_ps(inv, inv))));
+            const __m256 f = _mm256_mul_ps(_mm256_loadu_ps(qs + m), _mm256_mul_ps(inv, _mm256_mul_ps(inv, inv)));
+            ax = _mm256_add_ps(ax, _mm256_mul_ps(f, dx));
+            ay = _mm256_add_ps(ay, _mm256_mul_ps(f, dy));
+        }
+        alignas(32) float lanes_x[8];
+        alignas(32) float lanes_y[8];
+        _mm256_store_ps(lanes_x, ax);
+        _mm256_store_ps(lanes_y, ay);
+        Vector2f sum = sumScalar(p, xs + m, ys + m, qs + m, count - m, soft2);
+        for(uint32_t lane{0}; lane < 8; lane++){
+            sum.x += lanes_x[lane];
+            sum.y += lanes_y[lane];
+        }
+        return sum;
+    }
+#endif
+};
@@ -4,51 +4,636 @@
 
 #pragma once
 
-#include "Grid.hpp"
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <cmath>
+#include <algorithm>
+#include "ThreadPool.hpp"
 
+// Read-only view of the objects binned into one grid cell
 struct Cell {
-    static constexpr uint32_t capacity = 4;
-    static constexpr uint32_t max_cell_xid = capacity -1;
-
+    const uint32_t* objects = nullptr;
     uint32_t objects_count = 0;
-    uint32_t objects[capacity] = {};
+};
+
+// Dense grids keep a cell_start entry for every cell of the world. Sparse
+// grids only keep the occupied cells, sorted by id, plus the first of them in
+// every column, so their memory and build cost follow the object count
+// instead of the world area.
+enum class GridStorage {
+    Dense,
+    Sparse
+};
+
+// Compile-time layout of the collision walk: the storage, so no cell lookup
+// branches on it, and the 3x3 neighborhood order, so the solver can unroll
+// it. Cells are visited column by column, the center column first, then
+// the next and the previous one, each from the row above to the row below.
+template<GridStorage Storage>
+struct GridConfig {
+    static constexpr GridStorage storage = Storage;
+    static constexpr uint32_t neighborhood = 9;
+
+    // Offset of the k-th neighborhood cell from the center, in columns and rows
+    static constexpr int32_t column(uint32_t k){
+        return k < 3 ? 0 : k < 6 ? 1 : -1;
+    }
+
+    static constexpr int32_t row(uint32_t k){
+        return static_cast<int32_t>(k % 3) - 1;
+    }
+};
+
+using DenseGridConfig = GridConfig<GridStorage::Dense>;
+using SparseGridConfig = GridConfig<GridStorage::Sparse>;
+
+// Grid rebuilt from scratch every substep with a parallel counting sort:
+// every chunk of objects counts into its own histogram, a prefix sum over
+// (cell, chunk) turns the counts into write cursors and each chunk scatters
+// its objects into one flat index array. Cells have no capacity limit and
+// the result does not depend on thread timing, objects inside a cell are
+// always in increasing index order.
+// Sparse grids get the same object array from a stable radix sort of the
+// binned objects by cell id, and cell_start then only covers the occupied
+// cells, listed in cell_ids. Cells are found by a binary search inside their
+// column, neighborhoods of a column walk by cursors that only move forward.
+// The grid has a one cell border around the world that stays empty, so the
+// 3x3 neighborhood of any filled cell is always in range.
+struct CollisionGrid {
+    static constexpr uint32_t invalid_cell = 0xFFFFFFFF;
+    // Object is binned in another grid and is not counted as out of bounds
+    static constexpr uint32_t skip_cell = 0xFFFFFFFE;
+    // Occupancy the old fixed-size cells could hold, kept for the overflow statistic
+    static constexpr uint32_t nominal_capacity = 4;
+    // Cell id bits sorted per radix pass of a sparse build
+    static constexpr uint32_t radix_bits = 11;
+    static constexpr uint32_t radix_size = 1u << radix_bits;
 
-    Cell() = default;
+    GridStorage storage = GridStorage::Dense;
+    int32_t width = 0, height = 0;
+    float cell_size = 1.0f;
+    float inv_cell_size = 1.0f;
+    // Dense: cell_start[id] .. cell_start[id + 1] is the range of a cell in objects.
+    // Sparse: the same for the occupied cell cell_ids[slot], indexed by slot
+    std::vector<uint32_t> cell_start;
+    std::vector<uint32_t> objects;
+    // Sparse only, ids of the occupied cells in increasing order
+    std::vector<uint32_t> cell_ids;
+    // Objects landing in a cell already holding nominal_capacity objects
+    uint32_t overflow_count = 0;
+    // Objects outside the insertable area of the grid
+    uint32_t out_of_bounds_count = 0;
 
-    void add(uint32_t id){
-        objects [objects_count] = id;
-        objects_count += objects_count < max_cell_xid;
+    CollisionGrid() = default;
+
+    CollisionGrid(float world_width, float world_height, float cell_size_, GridStorage storage_ = GridStorage::Dense):
+    storage{storage_},
+    cell_size{fittedCellSize(world_width, world_height, cell_size_)},
+    inv_cell_size{1.0f / cell_size}{
+        width = static_cast<int32_t>(std::ceil(world_width / cell_size)) + 2;
+        height = static_cast<int32_t>(std::ceil(world_height / cell_size)) + 2;
+        if(storage == GridStorage::Dense){
+            cell_start.assign(cellCount() + 1, 0);
+        }else{
+            cell_start.assign(1, 0);
+            column_slot.assign(width + 1, 0);
+        }
     }
 
-    void clear(){
-        objects_count = 0;
+    // Cell ids are 32 bit below skip_cell. A world that would need more
+    // cells, or more columns or rows than an int32_t holds, gets cells
+    // doubled in size until it fits: bigger cells still find every contact.
+    [[nodiscard]]
+    static float fittedCellSize(float world_width, float world_height, float size){
+        const auto side = [](float world, float s){ return std::ceil(static_cast<double>(world) / s) + 2.0; };
+        while(side(world_width, size) * side(world_height, size) >= static_cast<double>(skip_cell)
+              || std::max(side(world_width, size), side(world_height, size)) > static_cast<double>(INT32_MAX)){
+            size *= 2.0f;
+        }
+        return size;
     }
 
-    void remove(uint32_t id){
-        for(uint32_t i = 0; i < objects_count; i++){
-            if(objects[i] == id){
-                objects[i] = objects[objects_count-1];
-                objects_count--;
-                return;
+    // Cells of the whole grid, occupied or not
+    [[nodiscard]]
+    uint32_t cellCount() const {
+        return static_cast<uint32_t>(width) * height;
+    }
+
+    [[nodiscard]]
+    Cell getCell(uint32_t id) const {
+        return storage == GridStorage::Dense ? getCell<GridStorage::Dense>(id) : getCell<GridStorage::Sparse>(id);
+    }
+
+    // Lookup for a grid known to use Storage
+    template<GridStorage Storage>
+    [[nodiscard]]
+    Cell getCell(uint32_t id) const {
+        if constexpr(Storage == GridStorage::Dense){
+            return {objects.data() + cell_start[id], cell_start[id + 1] - cell_start[id]};
+        }else{
+            const uint32_t x = id / static_cast<uint32_t>(height);
+            const uint32_t slot = lowerSlot(x, id);
+            return slot < column_slot[x + 1] && cell_ids[slot] == id ? slotCell(slot) : Cell{};
+        }
+    }
+
+    // The 3x3 block around cell id in Config order
+    template<typename Config>
+    void getNeighborhood(uint32_t id, Cell* cells) const {
+        getNeighborhood<Config>(id, cells, std::make_integer_sequence<uint32_t, Config::neighborhood>{});
+    }
+
+    // Rows y_begin..y_end of column x, grid coordinates with the border,
+    // are one contiguous run of objects
+    [[nodiscard]]
+    Cell columnRun(uint32_t x, uint32_t y_begin, uint32_t y_end) const {
+        const uint32_t base = x * static_cast<uint32_t>(height);
+        uint32_t begin, end;
+        if(storage == GridStorage::Dense){
+            begin = cell_start[base + y_begin];
+            end = cell_start[base + y_end];
+        }else{
+            begin = cell_start[lowerSlot(x, base + y_begin)];
+            end = cell_start[lowerSlot(x, base + y_end)];
+        }
+        return {objects.data() + begin, end - begin};
+    }
+
+    // Calls visit(x, y, id, cell) on every non-empty cell of columns
+    // x_begin..x_end and rows y_begin..y_end, column by column. Dense grids
+    // look at every cell, sparse ones only at the occupied ones.
+    template<typename Visit>
+    void forEachCell(uint32_t x_begin, uint32_t x_end, uint32_t y_begin, uint32_t y_end, Visit&& visit) const {
+        const auto h = static_cast<uint32_t>(height);
+        for(uint32_t x{x_begin}; x < x_end; x++){
+            const uint32_t base = x * h;
+            if(storage == GridStorage::Dense){
+                for(uint32_t y{y_begin}; y < y_end; y++){
+                    const Cell cell = getCell<GridStorage::Dense>(base + y);
+                    if(cell.objects_count) visit(x, y, base + y, cell);
+                }
+                continue;
+            }
+            const uint32_t end = lowerSlot(x, base + y_end);
+            for(uint32_t slot{lowerSlot(x, base + y_begin)}; slot < end; slot++){
+                const uint32_t id = cell_ids[slot];
+                visit(x, id - base, id, slotCell(slot));
             }
         }
     }
+
+    // forEachCell that also passes the getNeighborhood block of every cell
+    template<typename Config, typename Visit>
+    void forEachNeighborhood(uint32_t x_begin, uint32_t x_end, uint32_t y_begin, uint32_t y_end, Visit&& visit) const {
+        Cell cells[Config::neighborhood];
+        const auto h = static_cast<uint32_t>(height);
+        if constexpr(Config::storage == GridStorage::Dense){
+            for(uint32_t x{x_begin}; x < x_end; x++){
+                for(uint32_t y{y_begin}; y < y_end; y++){
+                    const uint32_t id = x * h + y;
+                    const Cell cell = getCell<GridStorage::Dense>(id);
+                    if(!cell.objects_count) continue;
+                    getNeighborhood<Config>(id, cells);
+                    visit(x, y, id, cell, cells);
+                }
+            }
+        }else{
+            for(uint32_t x{x_begin}; x < x_end; x++){
+                const uint32_t base = x * h;
+                uint32_t slot = lowerSlot(x, base + y_begin);
+                const uint32_t end = lowerSlot(x, base + y_end);
+                if(slot == end) continue;
+                uint32_t center = lowerSlot(x, base + y_begin - 1);
+                uint32_t next = lowerSlot(x + 1, base + h + y_begin - 1);
+                uint32_t previous = lowerSlot(x - 1, base - h + y_begin - 1);
+                for(; slot < end; slot++){
+                    const uint32_t id = cell_ids[slot];
+                    gatherColumn(center, column_slot[x + 1], id - 1, cells);
+                    gatherColumn(next, column_slot[x + 2], id + h - 1, cells + 3);
+                    gatherColumn(previous, column_slot[x], id - h - 1, cells + 6);
+                    visit(x, id - base, id, slotCell(slot), cells);
+                }
+            }
+        }
+    }
+
+    template<typename Vec2Type>
+    [[nodiscard]]
+    uint32_t cellOf(const Vec2Type& p) const {
+        const float x = p.x * inv_cell_size;
+        const float y = p.y * inv_cell_size;
+        if(x >= 0.0f && x < static_cast<float>(width - 2) && y >= 0.0f && y < static_cast<float>(height - 2)){
+            return (static_cast<uint32_t>(x) + 1) * height + static_cast<uint32_t>(y) + 1;
+        }
+        return invalid_cell;
+    }
+
+    template<typename Vec2Type>
+    void build(ThreadPool& pool, const Vec2Type* pos, uint32_t count){
+        prepare(count, pool.thread_count);
+        pool.dispatchIndexed(count, [&](uint32_t chunk, uint32_t start, uint32_t end){
+            countChunk(chunk, pos, start, end);
+        });
+        computeOffsets(pool);
+        pool.dispatchIndexed(count, [&](uint32_t chunk, uint32_t start, uint32_t end){
+            scatterChunk(chunk, start, end);
+        });
+    }
+
+    // The passes below are public so the solver can fuse the counting pass
+    // into its own per-particle sweep. countChunk may be called several times
+    // per chunk on consecutive sub-ranges, but the chunk ranges must match
+    // between counting and scatterChunk.
+    void prepare(uint32_t count, uint32_t chunk_count){
+        objects.resize(count);
+        object_cell.resize(count);
+        if(storage == GridStorage::Dense && histograms.size() != chunk_count){
+            histograms.assign(chunk_count, std::vector<uint32_t>(cellCount(), 0));
+        }
+        if(storage == GridStorage::Sparse){
+            radix_counts.resize(static_cast<size_t>(chunk_count) * radix_size);
+            sorted_objects.resize(count);
+        }
+        range_totals.assign(chunk_count, 0);
+        range_overflow.assign(chunk_count, 0);
+        chunk_out_of_bounds.assign(chunk_count, 0);
+        chunk_binned.assign(chunk_count, 0);
+    }
+
+    template<typename Vec2Type>
+    void countChunk(uint32_t chunk, const Vec2Type* pos, uint32_t start, uint32_t end){
+        countChunkWith(chunk, start, end, [this, pos](uint32_t i){ return cellOf(pos[i]); });
+    }
+
+    // cell_of(i) returns the cell of object i, invalid_cell or skip_cell
+    template<typename CellOf>
+    void countChunkWith(uint32_t chunk, uint32_t start, uint32_t end, CellOf&& cell_of){
+        // Sparse grids only need the number of binned objects per chunk
+        uint32_t* histogram = storage == GridStorage::Dense ? histograms[chunk].data() : nullptr;
+        uint32_t out_of_bounds = 0;
+        uint32_t binned = 0;
+        for(uint32_t i{start}; i < end; i++){
+            const uint32_t cell = cell_of(i);
+            object_cell[i] = cell;
+            if(cell < skip_cell){
+                if(histogram) histogram[cell]++;
+                binned++;
+            }else{
+                out_of_bounds += cell == invalid_cell;
+            }
+        }
+        chunk_out_of_bounds[chunk] += out_of_bounds;
+        chunk_binned[chunk] += binned;
+    }
+
+    // Sparse grids are completely built here, scatterChunk has nothing left to do for them
+    void computeOffsets(ThreadPool& pool){
+        if(storage == GridStorage::Sparse){
+            sortSparse(pool);
+            sumStatistics();
+            return;
+        }
+        const uint32_t cells = cellCount();
+        const auto chunk_count = static_cast<uint32_t>(histograms.size());
+        pool.dispatchIndexed(cells, [&](uint32_t range, uint32_t start, uint32_t end){
+            uint32_t total = 0;
+            for(uint32_t cell{start}; cell < end; cell++){
+                for(uint32_t c{0}; c < chunk_count; c++) total += histograms[c][cell];
+            }
+            range_totals[range] = total;
+        });
+
+        uint32_t running = 0;
+        for(uint32_t& total : range_totals){
+            const uint32_t t = total;
+            total = running;
+            running += t;
+        }
+        cell_start[cells] = running;
+
+        pool.dispatchIndexed(cells, [&](uint32_t range, uint32_t start, uint32_t end){
+            uint32_t cursor = range_totals[range];
+            uint32_t overflow = 0;
+            for(uint32_t cell{start}; cell < end; cell++){
+                cell_start[cell] = cursor;
+                for(uint32_t c{0}; c < chunk_count; c++){
+                    const uint32_t n = histograms[c][cell];
+                    // Untouched cells keep a zero so scatterChunk only has to reset touched ones
+                    if(n){
+                        histograms[c][cell] = cursor;
+                        cursor += n;
+                    }
+                }
+                const uint32_t occupancy = cursor - cell_start[cell];
+                overflow += occupancy > nominal_capacity ? occupancy - nominal_capacity : 0;
+            }
+            range_overflow[range] = overflow;
+        });
+        sumStatistics();
+    }
+
+    void scatterChunk(uint32_t chunk, uint32_t start, uint32_t end){
+        if(storage == GridStorage::Sparse) return;
+        std::vector<uint32_t>& cursors = histograms[chunk];
+        for(uint32_t i{start}; i < end; i++){
+            const uint32_t cell = object_cell[i];
+            if(cell < skip_cell){
+                objects[cursors[cell]++] = i;
+            }
+        }
+        for(uint32_t i{start}; i < end; i++){
+            const uint32_t cell = object_cell[i];
+            if(cell < skip_cell){
+                cursors[cell] = 0;
+            }
+        }
+    }
+
+    [[nodiscard]]
+    uint32_t objectCount() const {
+        return cell_start.back();
+    }
+
+    [[nodiscard]]
+    bool isOutOfBounds(uint32_t object) const {
+        return object_cell[object] == invalid_cell;
+    }
+
+private:
+    template<typename Config, uint32_t... K>
+    void getNeighborhood(uint32_t id, Cell* cells, std::integer_sequence<uint32_t, K...>) const {
+        const auto h = static_cast<uint32_t>(height);
+        ((cells[K] = getCell<Config::storage>(id + static_cast<uint32_t>(Config::column(K)) * h + static_cast<uint32_t>(Config::row(K)))), ...);
+    }
+
+    std::vector<uint32_t> object_cell;
+    std::vector<std::vector<uint32_t>> histograms;
+    std::vector<uint32_t> chunk_out_of_bounds;
+    std::vector<uint32_t> chunk_binned;
+    std::vector<uint32_t> range_totals;
+    std::vector<uint32_t> range_overflow;
+    // Sparse only: sort buffers, digit histograms per chunk and the first
+    // slot of every column, width + 1 entries
+    std::vector<uint32_t> sort_ids;
+    std::vector<uint32_t> sorted_ids;
+    std::vector<uint32_t> sorted_objects;
+    std::vector<uint32_t> radix_counts;
+    std::vector<uint32_t> column_slot;
+
+    void sumStatistics(){
+        overflow_count = 0;
+        out_of_bounds_count = 0;
+        for(uint32_t c{0}; c < range_overflow.size(); c++){
+            overflow_count += range_overflow[c];
+            out_of_bounds_count += chunk_out_of_bounds[c];
+        }
+    }
+
+    [[nodiscard]]
+    Cell slotCell(uint32_t slot) const {
+        return {objects.data() + cell_start[slot], cell_start[slot + 1] - cell_start[slot]};
+    }
+
+    // First slot of column x whose id is at least id
+    [[nodiscard]]
+    uint32_t lowerSlot(uint32_t x, uint32_t id) const {
+        return static_cast<uint32_t>(std::lower_bound(cell_ids.begin() + column_slot[x], cell_ids.begin() + column_slot[x + 1], id) - cell_ids.begin());
+    }
+
+    // Cells first .. first + 2 of a column ending at slot end, the cursor
+    // is left on the first of them and never moves back
+    void gatherColumn(uint32_t& cursor, uint32_t end, uint32_t first, Cell* cells) const {
+        while(cursor < end && cell_ids[cursor] < first) cursor++;
+        cells[0] = cells[1] = cells[2] = Cell{};
+        for(uint32_t slot{cursor}; slot < end && cell_ids[slot] <= first + 2; slot++){
+            cells[cell_ids[slot] - first] = slotCell(slot);
+        }
+    }
+
+    void sortSparse(ThreadPool& pool){
+        const auto count = static_cast<uint32_t>(object_cell.size());
+        const auto chunk_count = static_cast<uint32_t>(chunk_binned.size());
+        uint32_t binned = 0;
+        for(uint32_t& n : chunk_binned){
+            const uint32_t t = n;
+            n = binned;
+            binned += t;
+        }
+
+        // Binned objects and their cell ids in index order, the stable radix
+        // passes then keep every cell in increasing index order
+        sort_ids.resize(binned);
+        sorted_ids.resize(binned);
+        pool.dispatchIndexed(count, [&](uint32_t chunk, uint32_t start, uint32_t end){
+            uint32_t cursor = chunk_binned[chunk];
+            for(uint32_t i{start}; i < end; i++){
+                const uint32_t cell = object_cell[i];
+                if(cell < skip_cell){
+                    sort_ids[cursor] = cell;
+                    objects[cursor] = i;
+                    cursor++;
+                }
+            }
+        });
+        const uint32_t max_id = cellCount() - 1;
+        for(uint32_t shift{0}; shift < 32 && (max_id >> shift); shift += radix_bits){
+            radixPass(pool, shift, binned, chunk_count);
+        }
+
+        // Slots of the occupied cells
+        pool.dispatchIndexed(binned, [&](uint32_t chunk, uint32_t start, uint32_t end){
+            uint32_t cells = 0;
+            for(uint32_t i{start}; i < end; i++) cells += i == 0 || sort_ids[i] != sort_ids[i - 1];
+            range_totals[chunk] = cells;
+        });
+        uint32_t occupied = 0;
+        for(uint32_t& total : range_totals){
+            const uint32_t t = total;
+            total = occupied;
+            occupied += t;
+        }
+        cell_ids.resize(occupied);
+        cell_start.resize(occupied + 1);
+        cell_start[occupied] = binned;
+        pool.dispatchIndexed(binned, [&](uint32_t chunk, uint32_t start, uint32_t end){
+            uint32_t slot = range_totals[chunk];
+            for(uint32_t i{start}; i < end; i++){
+                if(i == 0 || sort_ids[i] != sort_ids[i - 1]){
+                    cell_ids[slot] = sort_ids[i];
+                    cell_start[slot] = i;
+                    slot++;
+                }
+            }
+        });
+
+        // Every slot fills the column directory from the column after its
+        // predecessor's up to its own
+        const auto h = static_cast<uint32_t>(height);
+        pool.dispatchIndexed(occupied, [&](uint32_t chunk, uint32_t start, uint32_t end){
+            uint32_t overflow = 0;
+            for(uint32_t slot{start}; slot < end; slot++){
+                const uint32_t id = cell_ids[slot];
+                const uint32_t x = id / h;
+                for(uint32_t column{slot ? cell_ids[slot - 1] / h + 1 : 0}; column <= x; column++) column_slot[column] = slot;
+                const uint32_t occupancy = cell_start[slot + 1] - cell_start[slot];
+                overflow += occupancy > nominal_capacity ? occupancy - nominal_capacity : 0;
+            }
+            range_overflow[chunk] = overflow;
+        });
+        const uint32_t first_after = occupied ? cell_ids[occupied - 1] / h + 1 : 0;
+        std::fill(column_slot.begin() + first_after, column_slot.end(), occupied);
+    }
+
+    // One stable counting pass on the digit at shift, chunks of equal digits
+    // are written in chunk order
+    void radixPass(ThreadPool& pool, uint32_t shift, uint32_t binned, uint32_t chunk_count){
+        constexpr uint32_t mask = radix_size - 1;
+        pool.dispatchIndexed(binned, [&](uint32_t chunk, uint32_t start, uint32_t end){
+            uint32_t* counts = radix_counts.data() + static_cast<size_t>(chunk) * radix_size;
+            std::fill(counts, counts + radix_size, 0);
+            for(uint32_t i{start}; i < end; i++) counts[(sort_ids[i] >> shift) & mask]++;
+        });
+        uint32_t running = 0;
+        for(uint32_t digit{0}; digit < radix_size; digit++){
+            for(uint32_t c{0}; c < chunk_count; c++){
+                uint32_t& n = radix_counts[static_cast<size_t>(c) * radix_size + digit];
+                const uint32_t t = n;
+                n = running;
+                running += t;
+            }
+        }
+        pool.dispatchIndexed(binned, [&](uint32_t chunk, uint32_t start, uint32_t end){
+            uint32_t* cursors = radix_counts.data() + static_cast<size_t>(chunk) * radix_size;
+            for(uint32_t i{start}; i < end; i++){
+                const uint32_t id = sort_ids[i];
+                const uint32_t to = cursors[(id >> shift) & mask]++;
+                sorted_ids[to] = id;
+                sorted_objects[to] = objects[i];
+            }
+        });
+        sort_ids.swap(sorted_ids);
+        objects.swap(sorted_objects);
+    }
 };
 
-struct CollisionGrid : public Grid<Cell>{
-    CollisionGrid():
-    Grid<Cell>(){}
+// Stack of grids with cell sizes base, 2 * base, 4 * base... Every object is
+// binned in the finest level whose cells are at least as wide as its
+// diameter, so a few big objects do not force a coarse cell size on all the
+// small ones. Any contact between an object and a bigger one is found by
+// looking at the 3x3 neighborhood of the small object's cell in the coarser
+// level.
+struct HierarchicalGrid {
+    std::vector<CollisionGrid> levels;
+    GridStorage storage = GridStorage::Dense;
+    float world_width = 0.0f, world_height = 0.0f;
+    float base_cell_size = 1.0f;
+    uint32_t overflow_count = 0;
+    uint32_t out_of_bounds_count = 0;
+
+    HierarchicalGrid() = default;
+
+    HierarchicalGrid(float world_width_, float world_height_, float base_cell_size_, GridStorage storage_ = GridStorage::Dense):
+    storage{storage_},
+    world_width{world_width_},
+    world_height{world_height_},
+    base_cell_size{base_cell_size_}{
+        setLevelCount(1);
+    }
+
+    void setLevelCount(uint32_t count){
+        count = std::min(count, max_levels);
+        while(levels.size() < count){
+            const float cell_size = base_cell_size * static_cast<float>(1u << levels.size());
+            levels.emplace_back(world_width, world_height, cell_size, storage);
+        }
+        levels.resize(count);
+    }
+
+    [[nodiscard]]
+    uint32_t levelCount() const {
+        return static_cast<uint32_t>(levels.size());
+    }
+
+    // Cell sizes double per level, so 1u << level has to stay below 32 bits
+    static constexpr uint32_t max_levels = 31;
+
+    // Number of levels needed so an object of this radius has a level, the
+    // last level takes anything bigger
+    [[nodiscard]]
+    uint32_t levelsFor(float radius) const {
+        uint32_t level = 0;
+        while(level + 1 < max_levels && 2.0f * radius > base_cell_size * static_cast<float>(1u << level)) level++;
+        return level + 1;
+    }
+
+    [[nodiscard]]
+    uint32_t levelOf(float radius) const {
+        const float diameter = 2.0f * radius;
+        const auto last = static_cast<uint32_t>(levels.size() - 1);
+        for(uint32_t level{0}; level < last; level++){
+            if(diameter <= levels[level].cell_size) return level;
+        }
+        return last;
+    }
 
-    CollisionGrid(int32_t width_, int32_t height_):
-    Grid<Cell>(width_, height_){}
+    template<typename Vec2Type>
+    void build(ThreadPool& pool, const Vec2Type* pos, const float* radius, uint32_t count){
+        prepare(count, pool.thread_count);
+        pool.dispatchIndexed(count, [&](uint32_t chunk, uint32_t start, uint32_t end){
+            countChunk(chunk, pos, radius, start, end);
+        });
+        finish(pool, count);
+    }
 
-    bool add(uint32_t x, uint32_t y, uint32_t object){
-        const uint32_t id = x * height + y;
-        data[id].add(object);
-        return true;
+    void prepare(uint32_t count, uint32_t chunk_count){
+        for(CollisionGrid& level : levels) level.prepare(count, chunk_count);
     }
 
-    void clear(){
-        for(auto& c : data) c.objects_count = 0;
+    template<typename Vec2Type>
+    void countChunk(uint32_t chunk, const Vec2Type* pos, const float* radius, uint32_t start, uint32_t end){
+        if(levels.size() == 1){
+            levels[0].countChunk(chunk, pos, start, end);
+            return;
+        }
+        for(uint32_t l{0}; l < levels.size(); l++){
+            CollisionGrid& level = levels[l];
+            level.countChunkWith(chunk, start, end, [&](uint32_t i){
+                return levelOf(radius[i]) == l ? level.cellOf(pos[i]) : CollisionGrid::skip_cell;
+            });
+        }
     }
-};
\ No newline at end of file
+
+    // Prefix sums and scatter once every chunk has been counted
+    void finish(ThreadPool& pool, uint32_t count){
+        overflow_count = 0;
+        out_of_bounds_count = 0;
+        for(CollisionGrid& level : levels){
+            level.computeOffsets(pool);
+            overflow_count += level.overflow_count;
+            out_of_bounds_count += level.out_of_bounds_count;
+        }
+        pool.dispatchIndexed(count, [this](uint32_t chunk, uint32_t start, uint32_t end){
+            for(CollisionGrid& level : levels) level.scatterChunk(chunk, start, end);
+        });
+    }
+
+    // Objects of the last build level by level in cell order, followed by
+    // the ones left out of the grid in index order
+    void sortedOrder(std::vector<uint32_t>& order, uint32_t count) const {
+        order.resize(count);
+        uint32_t next = 0;
+        for(const CollisionGrid& level : levels){
+            std::copy(level.objects.begin(), level.objects.begin() + level.objectCount(), order.begin() + next);
+            next += level.objectCount();
+        }
+        for(uint32_t i{0}; i < count; i++){
+            for(const CollisionGrid& level : levels){
+                if(level.isOutOfBounds(i)){
+                    order[next++] = i;
+                    break;
+                }
+            }
+        }
+    }
+};
@@ -0,0 +1,135 @@
+//
+// Per-object colors sampled from an image at the end of a run, replayed by
+// object id on the next run.
+//
+
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "SFML/Graphics.hpp"
+#include "MappedFile.hpp"
+#include "ThreadPool.hpp"
+#include "Solver.hpp"
+
+// Layout: ColorMapHeader, then count sf::Color (RGBA bytes) at data_offset.
+// Colors are indexed by object id. Ids are the spawn order until objects are
+// removed: a freed id goes to a later object, so the map only keeps the
+// colors of ids still held by their first object (generation 0).
+struct ColorMapHeader {
+    static constexpr char magic_value[8] = {'P', 'H', 'Y', 'S', 'C', 'M', 'A', 'P'};
+    static constexpr uint32_t current_version = 1;
+    static constexpr uint32_t byte_order_value = 0x01020304;
+    static constexpr uint64_t data_offset = 64;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t count;
+    uint32_t image_width;
+    uint32_t image_height;
+    float world_width;
+    float world_height;
+};
+static_assert(sizeof(ColorMapHeader) <= ColorMapHeader::data_offset, "color map header overlaps the colors");
+
+struct ColorMap {
+    bool open(const std::string& path){
+        close();
+        if(!file.open(path) || file.size() < ColorMapHeader::data_offset) return false;
+        std::memcpy(&header, file.data(), sizeof(header));
+        if(std::memcmp(header.magic, ColorMapHeader::magic_value, sizeof(header.magic)) != 0
+           || header.version != ColorMapHeader::current_version
+           || header.byte_order != ColorMapHeader::byte_order_value
+           || header.count > (file.size() - ColorMapHeader::data_offset) / sizeof(sf::Color)){
+            close();
+            return false;
+        }
+        colors = reinterpret_cast<const sf::Color*>(file.data() + ColorMapHeader::data_offset);
+        count = static_cast<uint32_t>(header.count);
+        return true;
+    }
+
+    void close(){
+        file.close();
+        colors = nullptr;
+        count = 0;
+    }
+
+    // A map written for another image or world would put colors in the wrong places
+    [[nodiscard]]
+    bool matches(sf::Vector2u image_size, Vector2f world_size) const {
+        return colors && header.image_width == image_size.x && header.image_height == image_size.y
+               && header.world_width == world_size.x && header.world_height == world_size.y;
+    }
+
+    [[nodiscard]]
+    uint32_t size() const {
+        return count;
+    }
+
+    [[nodiscard]]
+    sf::Color colorOf(uint32_t id, sf::Color fallback) const {
+        return id < count ? colors[id] : fallback;
+    }
+
+    // Colors objects [first_id, first_id + object_count) straight from the
+    // mapping, reused ids keep their color
+    void apply(Solver& solver, uint32_t first_id, uint32_t object_count) const {
+        const uint32_t end = std::min(first_id + object_count, count);
+        for(uint32_t id{first_id}; id < end; id++){
+            if(solver.isAlive(id) && solver.getHandle(id).generation == 0) solver.getObject(id).color = colors[id];
+        }
+    }
+
+    // Samples the image under every object on the pool and writes the map,
+    // the image is stretched over the whole world
+    static bool write(const std::string& path, ThreadPool& pool, const Solver& solver, const sf::Image& image){
+        // Removed and reused ids keep the default color
+        const uint32_t object_count = solver.getIdCount();
+        const sf::Vector2u image_size = image.getSize();
+        if(!image_size.x || !image_size.y) return false;
+        const float scale_x = static_cast<float>(image_size.x) / solver.worldSize.x;
+        const float scale_y = static_cast<float>(image_size.y) / solver.worldSize.y;
+
+        std::vector<sf::Color> sampled(object_count);
+        pool.dispatch(object_count, [&](uint32_t start, uint32_t end){
+            for(uint32_t id{start}; id < end; id++){
+                if(!solver.isAlive(id) || solver.getHandle(id).generation != 0) continue;
+                const Vector2f pos = solver.getObject(id).pos;
+                const auto x = static_cast<uint32_t>(std::clamp(pos.x * scale_x, 0.0f, static_cast<float>(image_size.x - 1)));
+                const auto y = static_cast<uint32_t>(std::clamp(pos.y * scale_y, 0.0f, static_cast<float>(image_size.y - 1)));
+                sampled[id] = image.getPixel(x, y);
+            }
+        });
+
+        ColorMapHeader header{};
+        std::memcpy(header.magic, ColorMapHeader::magic_value, sizeof(header.magic));
+        header.version = ColorMapHeader::current_version;
+        header.byte_order = ColorMapHeader::byte_order_value;
+        header.count = object_count;
+        header.image_width = image_size.x;
+        header.image_height = image_size.y;
+        header.world_width = solver.worldSize.x;
+        header.world_height = solver.worldSize.y;
+
+        std::FILE* out = std::fopen(path.c_str(), "wb");
+        if(!out) return false;
+        static const char padding[ColorMapHeader::data_offset] = {};
+        bool ok = std::fwrite(&header, sizeof(header), 1, out) == 1
+                  && std::fwrite(padding, 1, ColorMapHeader::data_offset - sizeof(header), out) == ColorMapHeader::data_offset - sizeof(header)
+                  && (sampled.empty() || std::fwrite(sampled.data(), sizeof(sf::Color), sampled.size(), out) == sampled.size());
+        ok = std::fclose(out) == 0 && ok;
+        return ok;
+    }
+
+private:
+    MappedFile file;
+    ColorMapHeader header{};
+    const sf::Color* colors = nullptr;
+    uint32_t count = 0;
+};
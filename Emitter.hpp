@@ -0,0 +1,131 @@
+//
+// Particle sources the solver runs at the start of every substep, and sinks
+// it empties at the start of every frame.
+//
+
+#pragma once
+#include "SFML/Graphics.hpp"
+#include <cmath>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+using sf::Vector2f;
+
+// Spout: `lanes` particles side by side across a nozzle at position, firing along velocity.
+// Line: particles spread from position to position + extent.
+// Area: a lattice filling the rectangle from position to position + extent.
+enum class EmitterShape{
+    Spout,
+    Line,
+    Area
+};
+
+// Every shape has a fixed set of slots one diameter apart and fills them in
+// order, wrapping around, at `rate` particles per second. Nothing checks a
+// slot is free: a spout of n lanes at speed v stays clear of its last
+// particles below n * v / (2 * radius) per second.
+struct Emitter{
+    EmitterShape shape = EmitterShape::Spout;
+    Vector2f position;
+    Vector2f extent;
+    uint32_t lanes = 1;
+    // Units per second
+    Vector2f velocity;
+    float radius = 0.5f;
+    sf::Color color = sf::Color::Blue;
+    float rate = 0.0f;
+    // Particles left to emit, the emitter stops at 0
+    uint32_t remaining = UINT32_MAX;
+    bool enabled = true;
+
+    // Appends the positions of the particles due over dt and returns their count
+    uint32_t emit(float dt, std::vector<Vector2f>& positions){
+        if(!enabled || rate <= 0.0f || !remaining) return 0;
+        owed += rate * dt;
+        const auto count = static_cast<uint32_t>(std::min(std::floor(owed), static_cast<float>(remaining)));
+        owed -= static_cast<float>(count);
+        remaining -= count;
+        const uint32_t slots = slotCount();
+        for(uint32_t i{0}; i < count; i++){
+            positions.push_back(slot(next_slot));
+            next_slot = next_slot + 1 < slots ? next_slot + 1 : 0;
+        }
+        return count;
+    }
+
+    [[nodiscard]]
+    uint32_t slotCount() const{
+        const float spacing = 2.0f * radius;
+        switch(shape){
+            case EmitterShape::Spout:
+                return std::max(lanes, 1u);
+            case EmitterShape::Line:
+                return static_cast<uint32_t>(std::hypot(extent.x, extent.y) / spacing) + 1;
+            case EmitterShape::Area:
+            default:
+                return columns() * (static_cast<uint32_t>(std::abs(extent.y) / spacing) + 1);
+        }
+    }
+
+    [[nodiscard]]
+    Vector2f slot(uint32_t k) const{
+        const float spacing = 2.0f * radius;
+        switch(shape){
+            case EmitterShape::Spout:{
+                // Lanes run across velocity, centered on position
+                const float speed = std::hypot(velocity.x, velocity.y);
+                const Vector2f across = speed > 0.0f ? Vector2f{-velocity.y / speed, velocity.x / speed} : Vector2f{0.0f, 1.0f};
+                const float offset = (static_cast<float>(k) - 0.5f * static_cast<float>(std::max(lanes, 1u) - 1)) * spacing;
+                return position + across * offset;
+            }
+            case EmitterShape::Line:{
+                const uint32_t slots = slotCount();
+                const float t = slots > 1 ? static_cast<float>(k) / static_cast<float>(slots - 1) : 0.0f;
+                return position + extent * t;
+            }
+            case EmitterShape::Area:
+            default:{
+                const uint32_t c = columns();
+                return position + Vector2f{std::copysign(spacing * static_cast<float>(k % c), extent.x),
+                                           std::copysign(spacing * static_cast<float>(k / c), extent.y)};
+            }
+        }
+    }
+
+private:
+    // Fraction of a particle carried over to the next substep
+    float owed = 0.0f;
+    uint32_t next_slot = 0;
+
+    [[nodiscard]]
+    uint32_t columns() const{
+        return static_cast<uint32_t>(std::abs(extent.x) / (2.0f * radius)) + 1;
+    }
+};
+
+// Area: removes objects whose center is in the rectangle from position to position + extent.
+// Drain: removes objects whose center is within radius of position.
+enum class SinkShape{
+    Area,
+    Drain
+};
+
+struct Sink{
+    SinkShape shape = SinkShape::Area;
+    Vector2f position;
+    Vector2f extent;
+    float radius = 1.0f;
+    bool enabled = true;
+
+    [[nodiscard]]
+    bool contains(Vector2f p) const{
+        if(shape == SinkShape::Drain){
+            const Vector2f d = p - position;
+            return d.x * d.x + d.y * d.y < radius * radius;
+        }
+        const Vector2f lo{std::min(position.x, position.x + extent.x), std::min(position.y, position.y + extent.y)};
+        const Vector2f hi{std::max(position.x, position.x + extent.x), std::max(position.y, position.y + extent.y)};
+        return p.x >= lo.x && p.x < hi.x && p.y >= lo.y && p.y < hi.y;
+    }
+};
@@ -0,0 +1,167 @@
+//
+// Distance constraints between pairs of objects, colored so that the links
+// of one color share no object and can be solved in parallel.
+//
+
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include "ThreadPool.hpp"
+#include "ParticleStore.hpp"
+
+// Keeps two objects rest_length apart. Stiffness is the share of the error
+// corrected per substep. A link stretched or squashed by more than
+// break_strain times its rest length breaks, 0 never breaks.
+struct Link{
+    ObjectHandle a;
+    ObjectHandle b;
+    float rest_length = 1.0f;
+    float stiffness = 1.0f;
+    float break_strain = 0.0f;
+};
+
+// A link in solve order with its objects' slots for the current frame
+struct BoundLink{
+    uint32_t slot_a;
+    uint32_t slot_b;
+    float rest_length;
+    float stiffness;
+    float break_strain;
+    // Index in links, set by bind
+    uint32_t link;
+    // Set by the solve, the link is dropped at the next bind
+    uint8_t broken;
+};
+
+struct LinkStore{
+    // Colors tracked per object, links an object of higher degree still
+    // touches go to a last batch solved on one thread
+    static constexpr uint32_t max_colors = 64;
+
+    std::vector<Link> links;
+    // Sorted by color, color c is [color_start[c], color_start[c + 1]) and
+    // the serial batch runs from color_start.back() to the end
+    std::vector<BoundLink> bound;
+    std::vector<uint32_t> color_start{0};
+
+    void add(const Link& link){
+        links.push_back(link);
+        colored = false;
+    }
+
+    void clear(){
+        links.clear();
+        bound.clear();
+        color_start.assign(1, 0);
+        colored = true;
+    }
+
+    [[nodiscard]]
+    size_t size() const{
+        return links.size();
+    }
+
+    [[nodiscard]]
+    bool empty() const{
+        return links.empty();
+    }
+
+    // Links minus the ones the last solve broke, which the next bind drops
+    void unbroken(std::vector<Link>& out) const{
+        out = links;
+        if(std::none_of(bound.begin(), bound.end(), [](const BoundLink& l){return l.broken != 0;})) return;
+        std::vector<uint8_t> dropped(links.size(), 0);
+        for(const BoundLink& l : bound) dropped[l.link] = l.broken;
+        uint32_t kept = 0;
+        for(uint32_t i{0}; i < links.size(); i++){
+            if(!dropped[i]) out[kept++] = links[i];
+        }
+        out.resize(kept);
+    }
+
+    [[nodiscard]]
+    uint32_t colorCount() const{
+        return static_cast<uint32_t>(color_start.size() - 1);
+    }
+
+    // Drops broken links and, when objects were removed since the last
+    // call, links to removed objects, recolors after any change and looks up
+    // the slots of every link. Called once per frame, after anything that
+    // moves objects between slots.
+    void bind(ThreadPool& pool, const uint32_t* id_to_slot, const uint32_t* generations, uint32_t id_count, bool removals){
+        const auto alive = [&](ObjectHandle h){
+            return h.id < id_count && id_to_slot[h.id] != UINT32_MAX && generations[h.id] == h.generation;
+        };
+        bool dropped = false;
+        for(const BoundLink& l : bound) dropped = dropped || l.broken;
+        if(removals){
+            for(const Link& l : links) dropped = dropped || !alive(l.a) || !alive(l.b);
+        }
+        if(dropped) drop(alive);
+        if(!colored) color();
+
+        pool.dispatch(static_cast<uint32_t>(bound.size()), [&](uint32_t start, uint32_t end){
+            for(uint32_t k{start}; k < end; k++){
+                const Link& l = links[bound[k].link];
+                bound[k].slot_a = id_to_slot[l.a.id];
+                bound[k].slot_b = id_to_slot[l.b.id];
+            }
+        });
+    }
+
+private:
+    bool colored = true;
+    std::vector<uint8_t> broken;
+    std::vector<uint64_t> used_colors;
+    std::vector<uint32_t> link_color;
+
+    // Recolors after any drop, so the solve order only depends on links and
+    // a restored snapshot solves in the same order as the run that saved it
+    template<typename Alive>
+    void drop(Alive&& alive){
+        broken.assign(links.size(), 0);
+        for(const BoundLink& l : bound) broken[l.link] = l.broken;
+        uint32_t kept = 0;
+        for(uint32_t i{0}; i < links.size(); i++){
+            if(broken[i] || !alive(links[i].a) || !alive(links[i].b)) continue;
+            links[kept++] = links[i];
+        }
+        links.resize(kept);
+        colored = false;
+    }
+
+    // Greedy: every link takes the lowest color neither of its objects has
+    // yet, so the colors in use are always 0 to colorCount() - 1
+    void color(){
+        uint32_t id_count = 0;
+        for(const Link& l : links) id_count = std::max({id_count, l.a.id + 1, l.b.id + 1});
+        used_colors.assign(id_count, 0);
+        link_color.resize(links.size());
+        std::vector<uint32_t> counts(max_colors + 1, 0);
+        for(uint32_t i{0}; i < links.size(); i++){
+            const uint64_t used = used_colors[links[i].a.id] | used_colors[links[i].b.id];
+            uint32_t c = 0;
+            while(c < max_colors && (used >> c & 1)) c++;
+            if(c < max_colors){
+                used_colors[links[i].a.id] |= uint64_t{1} << c;
+                used_colors[links[i].b.id] |= uint64_t{1} << c;
+            }
+            link_color[i] = c;
+            counts[c]++;
+        }
+        uint32_t colors = 0;
+        while(colors < max_colors && counts[colors]) colors++;
+
+        // The serial batch (color max_colors) starts where the last color ends
+        std::vector<uint32_t> next(max_colors + 1, 0);
+        for(uint32_t c{0}; c < max_colors; c++) next[c + 1] = next[c] + counts[c];
+        color_start.assign(next.begin(), next.begin() + colors + 1);
+        bound.resize(links.size());
+        for(uint32_t i{0}; i < links.size(); i++){
+            const Link& l = links[i];
+            bound[next[link_color[i]]++] = {0, 0, l.rest_length, l.stiffness, l.break_strain, i, 0};
+        }
+        colored = true;
+    }
+};
@@ -0,0 +1,73 @@
+//
+// Read-only memory mapped file.
+//
+
+#pragma once
+
+#include <string>
+#include <cstddef>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct MappedFile {
+    MappedFile() = default;
+
+    explicit MappedFile(const std::string& path){
+        open(path);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile(){
+        close();
+    }
+
+    bool open(const std::string& path){
+        close();
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0) return false;
+        struct stat info{};
+        if(fstat(fd, &info) != 0 || info.st_size <= 0){
+            ::close(fd);
+            return false;
+        }
+        void* mapped = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        // The mapping stays valid once the descriptor is closed
+        ::close(fd);
+        if(mapped == MAP_FAILED) return false;
+        bytes = static_cast<const unsigned char*>(mapped);
+        length = static_cast<size_t>(info.st_size);
+        // Everything is read front to back right away
+        madvise(mapped, length, MADV_SEQUENTIAL);
+        madvise(mapped, length, MADV_WILLNEED);
+        return true;
+    }
+
+    void close(){
+        if(bytes) munmap(const_cast<unsigned char*>(bytes), length);
+        bytes = nullptr;
+        length = 0;
+    }
+
+    [[nodiscard]]
+    bool isOpen() const {
+        return bytes != nullptr;
+    }
+
+    [[nodiscard]]
+    const unsigned char* data() const {
+        return bytes;
+    }
+
+    [[nodiscard]]
+    size_t size() const {
+        return length;
+    }
+
+private:
+    const unsigned char* bytes = nullptr;
+    size_t length = 0;
+};
@@ -0,0 +1,239 @@
+//
+// Headless CPU rasterizer: draws the particles as anti-aliased discs into an
+// RGBA buffer on the thread pool, no window or GPU needed.
+//
+
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "SFML/Graphics.hpp"
+#include "ParticleStore.hpp"
+#include "ThreadPool.hpp"
+#include "viewport_handler.hpp"
+#include "ViewCulling.hpp"
+
+// The image is cut into square tiles and every disc is binned into the tiles
+// its bounding box touches with the same counting sort as CollisionGrid, so
+// each tile gets its discs in the order they were collected. The scatter copies the
+// screen space disc and its color into the tile list, drawing a tile then
+// streams through one array instead of gathering from the particle arrays.
+// Tiles are drawn independently, a pixel is only ever written by the task
+// owning its tile.
+struct OffscreenRenderer {
+    static constexpr uint32_t tile_size = 32;
+    // Tile rows per task, small enough for work stealing to even out dense rows
+    static constexpr uint32_t rows_per_task = 1;
+
+    sf::Color background{50, 50, 50};
+
+    OffscreenRenderer(uint32_t width_, uint32_t height_):
+    width{width_},
+    height{height_},
+    tiles_x{(width_ + tile_size - 1) / tile_size},
+    tiles_y{(height_ + tile_size - 1) / tile_size},
+    pixels(static_cast<size_t>(width_) * height_),
+    tile_start(static_cast<size_t>(tiles_x) * tiles_y + 1, 0){}
+
+    // Draws objects as seen through viewport, a ViewportHandler of the output
+    // size frames the camera exactly like the window does. With the solver's
+    // grid only the objects in cells under the view are binned.
+    void render(ThreadPool& pool, const ParticleStore& objects, const ViewportHandler& viewport, const HierarchicalGrid* grid = nullptr){
+        const sf::Transform& transform = viewport.getTransform();
+        const float zoom = viewport.state.zoom;
+        if(grid){
+            const sf::FloatRect view = transform.getInverse().transformRect({0.0f, 0.0f, static_cast<float>(width), static_cast<float>(height)});
+            visible.collect(pool, *grid, view, static_cast<uint32_t>(objects.size()));
+        }else{
+            visible.all(static_cast<uint32_t>(objects.size()));
+        }
+        const uint32_t count = visible.size();
+        const uint32_t* slots = visible.slots.data();
+        const uint32_t tile_count = tiles_x * tiles_y;
+        screen.resize(count);
+        if(histograms.size() != pool.thread_count){
+            histograms.assign(pool.thread_count, std::vector<uint32_t>(tile_count, 0));
+        }
+
+        pool.dispatchIndexed(count, [&](uint32_t chunk, uint32_t start, uint32_t end){
+            std::vector<uint32_t>& histogram = histograms[chunk];
+            std::fill(histogram.begin(), histogram.end(), 0);
+            for(uint32_t k{start}; k < end; k++){
+                const uint32_t i = slots[k];
+                const Vector2f p = transform.transformPoint(objects.pos[i]);
+                Disc& disc = screen[k];
+                disc = {p.x, p.y, objects.radius[i] * zoom, 0, 0, 0, 0};
+                if(!tileRange(disc)) continue;
+                for(uint32_t ty{disc.tile_y0}; ty <= disc.tile_y1; ty++){
+                    for(uint32_t tx{disc.tile_x0}; tx <= disc.tile_x1; tx++){
+                        histogram[ty * tiles_x + tx]++;
+                    }
+                }
+            }
+        });
+
+        // Tile-major, chunk-minor cursors keep every tile list in collection order
+        uint32_t running = 0;
+        for(uint32_t tile{0}; tile < tile_count; tile++){
+            tile_start[tile] = running;
+            for(std::vector<uint32_t>& histogram : histograms){
+                const uint32_t n = histogram[tile];
+                histogram[tile] = running;
+                running += n;
+            }
+        }
+        tile_start[tile_count] = running;
+        tile_discs.resize(running);
+
+        pool.dispatchIndexed(count, [&](uint32_t chunk, uint32_t start, uint32_t end){
+            std::vector<uint32_t>& cursors = histograms[chunk];
+            for(uint32_t k{start}; k < end; k++){
+                const Disc& disc = screen[k];
+                if(disc.radius <= 0.0f) continue;
+                const TileDisc tile_disc{disc.x, disc.y, disc.radius, objects.color[slots[k]]};
+                for(uint32_t ty{disc.tile_y0}; ty <= disc.tile_y1; ty++){
+                    for(uint32_t tx{disc.tile_x0}; tx <= disc.tile_x1; tx++){
+                        tile_discs[cursors[ty * tiles_x + tx]++] = tile_disc;
+                    }
+                }
+            }
+        });
+
+        for(uint32_t row{0}; row < tiles_y; row += rows_per_task){
+            pool.addTask([this, row]{
+                const uint32_t row_end = std::min(row + rows_per_task, tiles_y);
+                for(uint32_t ty{row}; ty < row_end; ty++){
+                    for(uint32_t tx{0}; tx < tiles_x; tx++){
+                        drawTile(tx, ty);
+                    }
+                }
+            });
+        }
+        pool.waitForCompletion();
+    }
+
+    [[nodiscard]]
+    uint32_t getWidth() const {
+        return width;
+    }
+
+    [[nodiscard]]
+    uint32_t getHeight() const {
+        return height;
+    }
+
+    // Row-major RGBA, top row first
+    [[nodiscard]]
+    const sf::Color* data() const {
+        return pixels.data();
+    }
+
+    bool writePng(const std::string& path) const {
+        sf::Image image;
+        image.create(width, height, reinterpret_cast<const sf::Uint8*>(pixels.data()));
+        return image.saveToFile(path);
+    }
+
+    // Raw RGBA frame, frames written back to back can be piped into an encoder:
+    // ffmpeg -f rawvideo -pix_fmt rgba -s WIDTHxHEIGHT -r 60 -i - out.mp4
+    bool writeRaw(std::FILE* out) const {
+        return std::fwrite(pixels.data(), sizeof(sf::Color), pixels.size(), out) == pixels.size();
+    }
+
+private:
+    struct Disc {
+        float x, y;
+        // In pixels, 0 once the disc is culled
+        float radius;
+        uint32_t tile_x0, tile_y0, tile_x1, tile_y1;
+    };
+
+    struct TileDisc {
+        float x, y;
+        float radius;
+        sf::Color color;
+    };
+
+    uint32_t width, height;
+    uint32_t tiles_x, tiles_y;
+    std::vector<sf::Color> pixels;
+    VisibleObjects visible;
+    // Indexed like visible.slots
+    std::vector<Disc> screen;
+    std::vector<std::vector<uint32_t>> histograms;
+    // tile_start[tile] .. tile_start[tile + 1] is the range of a tile in tile_discs
+    std::vector<uint32_t> tile_start;
+    std::vector<TileDisc> tile_discs;
+
+    // Clips the disc's bounding box to the image, culls it if nothing is left
+    bool tileRange(Disc& disc) const {
+        const float reach = std::max(disc.radius, 0.5f) + 0.5f;
+        const float x0 = std::max(disc.x - reach, 0.0f);
+        const float y0 = std::max(disc.y - reach, 0.0f);
+        const float x1 = std::min(disc.x + reach, static_cast<float>(width) - 1.0f);
+        const float y1 = std::min(disc.y + reach, static_cast<float>(height) - 1.0f);
+        // Also rejects NaN positions
+        if(!(x0 <= x1 && y0 <= y1 && disc.radius > 0.0f)){
+            disc.radius = 0.0f;
+            return false;
+        }
+        disc.tile_x0 = static_cast<uint32_t>(x0) / tile_size;
+        disc.tile_y0 = static_cast<uint32_t>(y0) / tile_size;
+        disc.tile_x1 = static_cast<uint32_t>(x1) / tile_size;
+        disc.tile_y1 = static_cast<uint32_t>(y1) / tile_size;
+        return true;
+    }
+
+    void drawTile(uint32_t tx, uint32_t ty){
+        const int32_t px0 = static_cast<int32_t>(tx * tile_size);
+        const int32_t py0 = static_cast<int32_t>(ty * tile_size);
+        const int32_t px1 = static_cast<int32_t>(std::min((tx + 1) * tile_size, width));
+        const int32_t py1 = static_cast<int32_t>(std::min((ty + 1) * tile_size, height));
+        for(int32_t y{py0}; y < py1; y++){
+            std::fill_n(pixels.data() + static_cast<size_t>(y) * width + px0, px1 - px0, background);
+        }
+
+        const uint32_t tile = ty * tiles_x + tx;
+        for(uint32_t k{tile_start[tile]}; k < tile_start[tile + 1]; k++){
+            const TileDisc& disc = tile_discs[k];
+            const sf::Color color = disc.color;
+            // Discs under a pixel wide are drawn half a pixel wide with their
+            // coverage scaled down to the area they would have had
+            const float radius = std::max(disc.radius, 0.5f);
+            const float area_scale = disc.radius < 0.5f ? 4.0f * disc.radius * disc.radius : 1.0f;
+            const float opacity = area_scale * static_cast<float>(color.a) * (256.0f / 255.0f);
+            const float inner = std::max(radius - 0.5f, 0.0f);
+            const float inner_sq = inner * inner;
+            const float outer_sq = (radius + 0.5f) * (radius + 0.5f);
+
+            const int32_t x0 = std::max(px0, static_cast<int32_t>(std::floor(disc.x - radius - 0.5f)));
+            const int32_t y0 = std::max(py0, static_cast<int32_t>(std::floor(disc.y - radius - 0.5f)));
+            const int32_t x1 = std::min(px1, static_cast<int32_t>(std::ceil(disc.x + radius + 0.5f)));
+            const int32_t y1 = std::min(py1, static_cast<int32_t>(std::ceil(disc.y + radius + 0.5f)));
+            for(int32_t y{y0}; y < y1; y++){
+                const float dy = static_cast<float>(y) + 0.5f - disc.y;
+                sf::Color* row = pixels.data() + static_cast<size_t>(y) * width;
+                for(int32_t x{x0}; x < x1; x++){
+                    const float dx = static_cast<float>(x) + 0.5f - disc.x;
+                    const float d_sq = dx * dx + dy * dy;
+                    if(d_sq >= outer_sq) continue;
+                    // Coverage falls off linearly over the pixel straddling the edge
+                    const float coverage = d_sq <= inner_sq ? 1.0f : std::min(radius + 0.5f - std::sqrt(d_sq), 1.0f);
+                    blend(row[x], color, static_cast<int32_t>(coverage * opacity));
+                }
+            }
+        }
+    }
+
+    // Source over with alpha in 0..256
+    static void blend(sf::Color& dst, sf::Color src, int32_t alpha){
+        dst.r = static_cast<sf::Uint8>(dst.r + (((src.r - dst.r) * alpha) >> 8));
+        dst.g = static_cast<sf::Uint8>(dst.g + (((src.g - dst.g) * alpha) >> 8));
+        dst.b = static_cast<sf::Uint8>(dst.b + (((src.b - dst.b) * alpha) >> 8));
+        dst.a = 255;
+    }
+};
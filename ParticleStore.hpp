@@ -0,0 +1,216 @@
+//
+// Created by Cameron Day on 3/19/23.
+//
+
+#pragma once
+#include "SFML/Graphics.hpp"
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+using sf::Vector2f;
+
+struct VerletObject{
+
+    Vector2f pos;
+    Vector2f pos_prev;
+    Vector2f acc;
+    float radius;
+    sf::Color color;
+    int polarity{};
+
+
+    VerletObject() = default;
+    VerletObject(Vector2f pos_, float radius_):
+    pos{pos_},
+    radius{radius_},
+    pos_prev{pos_},
+    acc{0.0f, 0.0f},
+    color{sf::Color::Blue},
+    polarity{1}
+    {}
+
+    VerletObject(Vector2f pos_, float radius_, sf::Color color_):
+    pos{pos_},
+    radius{radius_},
+    pos_prev{pos_},
+    acc{0.0f, 0.0f},
+    color{color_},
+    polarity{1}
+    {}
+
+    VerletObject(Vector2f pos_, float radius_, int polarity_):
+    pos{pos_},
+    radius{radius_},
+    pos_prev{pos_},
+    acc{0.0f, 0.0f},
+    color{},
+    polarity{polarity_}
+    {if(polarity_ > 0)
+        color = sf::Color::Blue;
+    else
+        color = sf::Color::Red;
+    }
+
+};
+
+// Id of an object plus the generation of the id when the handle was taken.
+// Ids of removed objects are reused, the handle of a removed object stays
+// invalid even after its id holds another one.
+struct ObjectHandle{
+    uint32_t id = 0;
+    uint32_t generation = 0;
+};
+
+// Objects added together by Solver::addObjects. Every array holds count
+// entries, or is null and the default value is used for all of them.
+struct ParticleBatch{
+    const Vector2f* pos = nullptr;
+    // Units per second
+    const Vector2f* velocity = nullptr;
+    const float* radius = nullptr;
+    const sf::Color* color = nullptr;
+    uint32_t count = 0;
+    Vector2f default_velocity{0.0f, 0.0f};
+    float default_radius = 0.5f;
+    sf::Color default_color = sf::Color::Blue;
+};
+
+// Mutable view of one particle spread over the ParticleStore arrays
+struct ParticleRef{
+    Vector2f& pos;
+    Vector2f& pos_prev;
+    Vector2f& acc;
+    // Read only, Solver::setRadius keeps the pipeline and the grid in step
+    const float& radius;
+    sf::Color& color;
+    int& polarity;
+    uint8_t& rest;
+
+    // An outside push wakes a sleeping particle
+    void accelerate(Vector2f a){
+        acc += a;
+        rest = 0;
+    }
+};
+
+struct ConstParticleRef{
+    const Vector2f& pos;
+    const Vector2f& pos_prev;
+    const Vector2f& acc;
+    const float& radius;
+    const sf::Color& color;
+    const int& polarity;
+    const uint8_t& rest;
+};
+
+// Structure-of-arrays particle storage. The solver passes only stream
+// pos/pos_prev/acc; color and polarity live in separate cold arrays.
+struct ParticleStore{
+    // Hot
+    std::vector<Vector2f> pos;
+    std::vector<Vector2f> pos_prev;
+    std::vector<Vector2f> acc;
+    // Cold
+    std::vector<float> radius;
+    std::vector<sf::Color> color;
+    std::vector<int> polarity;
+    // Substeps spent nearly still, the solver's asleep value once the particle sleeps
+    std::vector<uint8_t> rest;
+
+    [[nodiscard]]
+    size_t size() const{
+        return pos.size();
+    }
+
+    [[nodiscard]]
+    bool empty() const{
+        return pos.empty();
+    }
+
+    void reserve(size_t count){
+        pos.reserve(count);
+        pos_prev.reserve(count);
+        acc.reserve(count);
+        radius.reserve(count);
+        color.reserve(count);
+        polarity.reserve(count);
+        rest.reserve(count);
+    }
+
+    void resize(size_t count){
+        pos.resize(count);
+        pos_prev.resize(count);
+        acc.resize(count);
+        radius.resize(count);
+        color.resize(count);
+        polarity.resize(count);
+        rest.resize(count);
+    }
+
+    // this[i] = source[order[i]] for i in [start, end), sized beforehand
+    void gather(const ParticleStore& source, const uint32_t* order, uint32_t start, uint32_t end){
+        for(uint32_t i{start}; i < end; i++){
+            const uint32_t from = order[i];
+            pos[i] = source.pos[from];
+            pos_prev[i] = source.pos_prev[from];
+            acc[i] = source.acc[from];
+            radius[i] = source.radius[from];
+            color[i] = source.color[from];
+            polarity[i] = source.polarity[from];
+            rest[i] = source.rest[from];
+        }
+    }
+
+    // this[i] = source[i] for i in [start, end), sized beforehand
+    void copy(const ParticleStore& source, uint32_t start, uint32_t end){
+        std::copy(source.pos.begin() + start, source.pos.begin() + end, pos.begin() + start);
+        std::copy(source.pos_prev.begin() + start, source.pos_prev.begin() + end, pos_prev.begin() + start);
+        std::copy(source.acc.begin() + start, source.acc.begin() + end, acc.begin() + start);
+        std::copy(source.radius.begin() + start, source.radius.begin() + end, radius.begin() + start);
+        std::copy(source.color.begin() + start, source.color.begin() + end, color.begin() + start);
+        std::copy(source.polarity.begin() + start, source.polarity.begin() + end, polarity.begin() + start);
+        std::copy(source.rest.begin() + start, source.rest.begin() + end, rest.begin() + start);
+    }
+
+    void clear(){
+        pos.clear();
+        pos_prev.clear();
+        acc.clear();
+        radius.clear();
+        color.clear();
+        polarity.clear();
+        rest.clear();
+    }
+
+    uint32_t push_back(const VerletObject& v){
+        pos.push_back(v.pos);
+        pos_prev.push_back(v.pos_prev);
+        acc.push_back(v.acc);
+        radius.push_back(v.radius);
+        color.push_back(v.color);
+        polarity.push_back(v.polarity);
+        rest.push_back(0);
+        return static_cast<uint32_t>(pos.size() - 1);
+    }
+
+    ParticleRef operator[](size_t i){
+        return {pos[i], pos_prev[i], acc[i], radius[i], color[i], polarity[i], rest[i]};
+    }
+
+    ConstParticleRef operator[](size_t i) const{
+        return {pos[i], pos_prev[i], acc[i], radius[i], color[i], polarity[i], rest[i]};
+    }
+
+    [[nodiscard]]
+    VerletObject get(size_t i) const{
+        VerletObject v;
+        v.pos = pos[i];
+        v.pos_prev = pos_prev[i];
+        v.acc = acc[i];
+        v.radius = radius[i];
+        v.color = color[i];
+        v.polarity = polarity[i];
+        return v;
+    }
+};
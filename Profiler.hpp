@@ -0,0 +1,441 @@
+//
+// Hot-path instrumentation: per-thread counters, scoped timers, a rolling
+// per-frame history and a Chrome trace-event dump (chrome://tracing or
+// ui.perfetto.dev). The PHYSICS_PROFILE_* macros and the Profile* helpers
+// compile to nothing unless PHYSICS_ENABLE_PROFILING is defined, the
+// Profiler itself is cold code and then simply records nothing.
+//
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+enum class ProfileCounter : uint32_t {
+    // Object pairs whose distance was checked, and the ones that touched
+    PairTests,
+    Contacts,
+    // Objects over CollisionGrid::nominal_capacity in their cell, summed over substeps
+    GridOverflow,
+    TasksRun,
+    TasksStolen,
+    // Idle pool workers, first spinning for a task then parked
+    WorkerSpinNs,
+    WorkerParkedNs,
+    // Threads inside waitForCompletion with nothing left to run
+    BarrierWaitNs,
+    Count
+};
+
+inline const char* profileCounterName(ProfileCounter counter){
+    static const char* const names[] = {
+        "pair tests", "contacts", "grid overflow", "tasks run", "tasks stolen",
+        "worker spin ns", "worker parked ns", "barrier wait ns"
+    };
+    return names[static_cast<uint32_t>(counter)];
+}
+
+// Everything recorded during one Solver::update
+struct FrameProfile {
+    static constexpr uint32_t max_scopes = 24;
+
+    struct Scope {
+        const char* name = nullptr;
+        uint64_t ns = 0;
+        uint64_t calls = 0;
+    };
+
+    uint64_t frame = 0;
+    uint32_t substeps = 0;
+    std::array<uint64_t, static_cast<size_t>(ProfileCounter::Count)> counters{};
+    // Scope totals summed over every thread, so scopes running on the pool report CPU time
+    std::array<Scope, max_scopes> scopes{};
+    uint32_t scope_count = 0;
+    // Slowest task over the mean task of the same parallel batch, worst batch of the frame
+    float worst_imbalance = 0.0f;
+
+    [[nodiscard]]
+    uint64_t counter(ProfileCounter c) const {
+        return counters[static_cast<size_t>(c)];
+    }
+
+    void addScope(const char* name, uint64_t ns, uint64_t calls){
+        for(uint32_t s{0}; s < scope_count; s++){
+            if(scopes[s].name == name || std::strcmp(scopes[s].name, name) == 0){
+                scopes[s].ns += ns;
+                scopes[s].calls += calls;
+                return;
+            }
+        }
+        if(scope_count < max_scopes) scopes[scope_count++] = {name, ns, calls};
+    }
+};
+
+// Owned by one thread, written only by it. The frame thread swaps the totals
+// out at the end of every update.
+struct ThreadProfile {
+    static constexpr uint32_t max_scopes = FrameProfile::max_scopes;
+
+    struct Event {
+        const char* name;
+        uint64_t start_ns;
+        uint64_t duration_ns;
+    };
+
+    struct ScopeTotal {
+        std::atomic<const char*> name{nullptr};
+        std::atomic<uint64_t> ns{0};
+        std::atomic<uint64_t> calls{0};
+    };
+
+    uint32_t index = 0;
+    std::string name;
+    std::array<std::atomic<uint64_t>, static_cast<size_t>(ProfileCounter::Count)> counters{};
+    std::array<ScopeTotal, max_scopes> scopes;
+    // Reserved up front when a trace starts, full buffers drop events instead of growing
+    std::vector<Event> events;
+
+    // Plain load and store, only this thread writes
+    void add(ProfileCounter counter, uint64_t n){
+        std::atomic<uint64_t>& c = counters[static_cast<size_t>(counter)];
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    void addScope(const char* scope_name, uint64_t ns){
+        for(ScopeTotal& scope : scopes){
+            const char* current = scope.name.load(std::memory_order_relaxed);
+            if(!current){
+                scope.name.store(scope_name, std::memory_order_release);
+                current = scope_name;
+            }
+            if(current == scope_name){
+                scope.ns.store(scope.ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+                scope.calls.store(scope.calls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                return;
+            }
+        }
+    }
+};
+
+class Profiler {
+public:
+#ifdef PHYSICS_ENABLE_PROFILING
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+    // Frames kept for the rolling averages
+    static constexpr uint32_t history_size = 240;
+
+    static Profiler& instance(){
+        static Profiler profiler;
+        return profiler;
+    }
+
+    // Profile of the calling thread, registered on first use
+    ThreadProfile& thread(){
+        if(!current){
+            std::lock_guard<std::mutex> lock{mutex};
+            threads.push_back(std::make_unique<ThreadProfile>());
+            current = threads.back().get();
+            current->index = static_cast<uint32_t>(threads.size() - 1);
+            current->name = "thread " + std::to_string(current->index);
+            if(tracing) current->events.reserve(trace_capacity);
+        }
+        return *current;
+    }
+
+    void nameThread(const std::string& name){
+        ThreadProfile& profile = thread();
+        std::lock_guard<std::mutex> lock{mutex};
+        profile.name = name + " " + std::to_string(profile.index);
+    }
+
+    [[nodiscard]]
+    uint64_t now() const {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count());
+    }
+
+    void recordScope(const char* name, uint64_t start_ns, uint64_t duration_ns){
+        ThreadProfile& profile = thread();
+        profile.addScope(name, duration_ns);
+        if(tracing_flag.load(std::memory_order_relaxed) && profile.events.size() < profile.events.capacity()){
+            profile.events.push_back({name, start_ns, duration_ns});
+        }
+    }
+
+    // Counting only touches a plain thread-local tally, so it is cheap enough for
+    // the narrow phase. flush() hands the tally to the thread's profile, pool
+    // threads do so after every task and the frame thread in endFrame().
+    static void count(ProfileCounter counter, uint64_t n){
+        tally[static_cast<size_t>(counter)] += n;
+    }
+
+    void flush(){
+        ThreadProfile& profile = thread();
+        for(size_t c{0}; c < tally.size(); c++){
+            if(!tally[c]) continue;
+            profile.add(static_cast<ProfileCounter>(c), tally[c]);
+            tally[c] = 0;
+        }
+    }
+
+    // Called by the thread that waited for the batch
+    void recordImbalance(float imbalance){
+        if(imbalance > frame_imbalance.load(std::memory_order_relaxed)) frame_imbalance.store(imbalance, std::memory_order_relaxed);
+    }
+
+    // Sums and resets every thread's totals into the history, call from the
+    // thread running the solver once an update has finished
+    void endFrame(uint64_t frame, uint32_t substeps){
+        flush();
+        std::lock_guard<std::mutex> lock{mutex};
+        FrameProfile profile;
+        profile.frame = frame;
+        profile.substeps = substeps;
+        for(const std::unique_ptr<ThreadProfile>& thread_profile : threads){
+            for(size_t c{0}; c < profile.counters.size(); c++){
+                profile.counters[c] += thread_profile->counters[c].exchange(0, std::memory_order_relaxed);
+            }
+            for(ThreadProfile::ScopeTotal& scope : thread_profile->scopes){
+                const char* name = scope.name.load(std::memory_order_acquire);
+                if(!name) break;
+                const uint64_t calls = scope.calls.exchange(0, std::memory_order_relaxed);
+                if(calls) profile.addScope(name, scope.ns.exchange(0, std::memory_order_relaxed), calls);
+            }
+        }
+        profile.worst_imbalance = frame_imbalance.exchange(0.0f, std::memory_order_relaxed);
+        history.push_back(profile);
+        if(history.size() > history_size) history.pop_front();
+    }
+
+    // Mean of the last frames, every counter and scope divided by the frame count
+    [[nodiscard]]
+    FrameProfile average(uint32_t frames) const {
+        std::lock_guard<std::mutex> lock{mutex};
+        FrameProfile mean;
+        const auto count = static_cast<uint32_t>(std::min<size_t>(frames, history.size()));
+        if(!count) return mean;
+        for(auto it = history.end() - count; it != history.end(); ++it){
+            mean.frame = it->frame;
+            mean.substeps += it->substeps;
+            for(size_t c{0}; c < mean.counters.size(); c++) mean.counters[c] += it->counters[c];
+            for(uint32_t s{0}; s < it->scope_count; s++) mean.addScope(it->scopes[s].name, it->scopes[s].ns, it->scopes[s].calls);
+            mean.worst_imbalance = std::max(mean.worst_imbalance, it->worst_imbalance);
+        }
+        mean.substeps /= count;
+        for(uint64_t& c : mean.counters) c /= count;
+        for(uint32_t s{0}; s < mean.scope_count; s++){
+            mean.scopes[s].ns /= count;
+            mean.scopes[s].calls /= count;
+        }
+        return mean;
+    }
+
+    // Multi-line summary of the last frames for the HUD or a log
+    [[nodiscard]]
+    std::string report(uint32_t frames) const {
+        const FrameProfile mean = average(frames);
+        std::string text;
+        char line[128];
+        const double substeps = std::max(mean.substeps, 1u);
+        for(uint32_t s{0}; s < mean.scope_count; s++){
+            std::snprintf(line, sizeof(line), "%-14s %8.3f ms/substep  %6.0f calls\n", mean.scopes[s].name,
+                          static_cast<double>(mean.scopes[s].ns) / 1e6 / substeps, static_cast<double>(mean.scopes[s].calls));
+            text += line;
+        }
+        const uint64_t tests = mean.counter(ProfileCounter::PairTests);
+        const uint64_t contacts = mean.counter(ProfileCounter::Contacts);
+        std::snprintf(line, sizeof(line), "pairs %llu tested, %llu touching (%.1f%%)\n",
+                      static_cast<unsigned long long>(tests), static_cast<unsigned long long>(contacts),
+                      tests ? 100.0 * static_cast<double>(contacts) / static_cast<double>(tests) : 0.0);
+        text += line;
+        std::snprintf(line, sizeof(line), "grid overflow %llu, tasks %llu (%llu stolen)\n",
+                      static_cast<unsigned long long>(mean.counter(ProfileCounter::GridOverflow)),
+                      static_cast<unsigned long long>(mean.counter(ProfileCounter::TasksRun)),
+                      static_cast<unsigned long long>(mean.counter(ProfileCounter::TasksStolen)));
+        text += line;
+        std::snprintf(line, sizeof(line), "workers spin %.3f ms, parked %.3f ms, barrier wait %.3f ms\n",
+                      static_cast<double>(mean.counter(ProfileCounter::WorkerSpinNs)) / 1e6,
+                      static_cast<double>(mean.counter(ProfileCounter::WorkerParkedNs)) / 1e6,
+                      static_cast<double>(mean.counter(ProfileCounter::BarrierWaitNs)) / 1e6);
+        text += line;
+        std::snprintf(line, sizeof(line), "collision imbalance %.2fx (slowest tile / mean tile)\n", static_cast<double>(mean.worst_imbalance));
+        text += line;
+        return text;
+    }
+
+    // Starts keeping scope events, at most events_per_thread per thread.
+    // Call between updates.
+    void beginTrace(size_t events_per_thread = 1u << 18){
+        std::lock_guard<std::mutex> lock{mutex};
+        trace_capacity = events_per_thread;
+        for(const std::unique_ptr<ThreadProfile>& thread_profile : threads){
+            thread_profile->events.clear();
+            thread_profile->events.reserve(trace_capacity);
+        }
+        tracing = true;
+        tracing_flag.store(true, std::memory_order_relaxed);
+    }
+
+    // Stops recording and writes the events as Chrome trace-event JSON.
+    // Call between updates, while no instrumented code runs.
+    bool endTrace(const std::string& path){
+        std::lock_guard<std::mutex> lock{mutex};
+        tracing = false;
+        tracing_flag.store(false, std::memory_order_relaxed);
+        std::FILE* out = std::fopen(path.c_str(), "w");
+        if(!out) return false;
+        bool first = true;
+        const auto separator = [&]{
+            const char* s = first ? "\n" : ",\n";
+            first = false;
+            return s;
+        };
+        std::fputs("{\"traceEvents\":[", out);
+        for(const std::unique_ptr<ThreadProfile>& thread_profile : threads){
+            std::fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                         separator(), thread_profile->index, thread_profile->name.c_str());
+            for(const ThreadProfile::Event& event : thread_profile->events){
+                std::fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                             separator(), event.name, thread_profile->index,
+                             static_cast<double>(event.start_ns) / 1e3, static_cast<double>(event.duration_ns) / 1e3);
+            }
+            thread_profile->events.clear();
+            thread_profile->events.shrink_to_fit();
+        }
+        std::fputs("\n],\"displayTimeUnit\":\"ms\"}\n", out);
+        return std::fclose(out) == 0;
+    }
+
+    [[nodiscard]]
+    bool isTracing() const {
+        return tracing_flag.load(std::memory_order_relaxed);
+    }
+
+private:
+    // Constant-initialized so the hot path reads it without a TLS init check
+    static inline thread_local ThreadProfile* current = nullptr;
+    static inline thread_local std::array<uint64_t, static_cast<size_t>(ProfileCounter::Count)> tally{};
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadProfile>> threads;
+    std::deque<FrameProfile> history;
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    std::atomic<float> frame_imbalance{0.0f};
+    std::atomic<bool> tracing_flag{false};
+    bool tracing = false;
+    size_t trace_capacity = 0;
+};
+
+#ifdef PHYSICS_ENABLE_PROFILING
+
+// Times the enclosing block into the thread's scope totals and the trace
+struct ProfileScope {
+    const char* name;
+    uint64_t start;
+
+    explicit ProfileScope(const char* name_):
+    name{name_},
+    start{Profiler::instance().now()}{}
+
+    ~ProfileScope(){
+        Profiler::instance().recordScope(name, start, Profiler::instance().now() - start);
+    }
+};
+
+// Durations of the tasks of one parallel batch, each task writes its own slot
+struct ProfileSpread {
+    std::vector<uint64_t> durations;
+
+    struct Timer {
+        uint64_t& slot;
+        uint64_t start;
+
+        explicit Timer(uint64_t& slot_):
+        slot{slot_},
+        start{Profiler::instance().now()}{}
+
+        ~Timer(){
+            slot = Profiler::instance().now() - start;
+        }
+    };
+
+    void reset(size_t count){
+        durations.assign(count, 0);
+    }
+
+    Timer time(size_t task){
+        return Timer{durations[task]};
+    }
+
+    // Reports slowest over mean once every task has finished
+    void report(){
+        if(durations.size() < 2) return;
+        uint64_t total = 0, slowest = 0;
+        for(uint64_t d : durations){
+            total += d;
+            slowest = std::max(slowest, d);
+        }
+        if(total) Profiler::instance().recordImbalance(static_cast<float>(slowest) * static_cast<float>(durations.size()) / static_cast<float>(total));
+    }
+};
+
+// Time between an idle thread's first failed look for work and the next task
+struct ProfileIdle {
+    uint64_t start = 0;
+    bool idle = false;
+
+    void begin(){
+        if(!idle){
+            idle = true;
+            start = Profiler::instance().now();
+        }
+    }
+
+    void end(ProfileCounter counter){
+        if(idle){
+            idle = false;
+            Profiler::count(counter, Profiler::instance().now() - start);
+        }
+    }
+};
+
+#define PHYSICS_PROFILE_CONCAT_(a, b) a##b
+#define PHYSICS_PROFILE_CONCAT(a, b) PHYSICS_PROFILE_CONCAT_(a, b)
+#define PHYSICS_PROFILE_SCOPE(name) ProfileScope PHYSICS_PROFILE_CONCAT(profile_scope_, __LINE__){name}
+#define PHYSICS_PROFILE_COUNT(counter, n) Profiler::count(ProfileCounter::counter, n)
+#define PHYSICS_PROFILE_FLUSH() Profiler::instance().flush()
+#define PHYSICS_PROFILE_THREAD(name) Profiler::instance().nameThread(name)
+#define PHYSICS_PROFILE_FRAME(frame, substeps) Profiler::instance().endFrame(frame, substeps)
+
+#else
+
+struct ProfileSpread {
+    struct Timer {};
+    void reset(size_t){}
+    Timer time(size_t){ return {}; }
+    void report(){}
+};
+
+struct ProfileIdle {
+    void begin(){}
+    void end(ProfileCounter){}
+};
+
+#define PHYSICS_PROFILE_SCOPE(name) ((void)0)
+#define PHYSICS_PROFILE_COUNT(counter, n) ((void)0)
+#define PHYSICS_PROFILE_FLUSH() ((void)0)
+#define PHYSICS_PROFILE_THREAD(name) ((void)0)
+#define PHYSICS_PROFILE_FRAME(frame, substeps) ((void)0)
+
+#endif
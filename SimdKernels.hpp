@@ -0,0 +1,225 @@
+//
+// Vectorized per-particle kernels for the solver streaming passes.
+//
+
+#pragma once
+#include "SFML/Graphics.hpp"
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#define PHYSICS_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(PHYSICS_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+#define PHYSICS_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define PHYSICS_TARGET_AVX2
+#endif
+
+using sf::Vector2f;
+
+enum class KernelMode{
+    Auto,
+    Scalar,
+    SSE,
+    AVX2
+};
+
+// Particle arrays are interleaved Vector2f, so every kernel works on a flat
+// stream of 2 * count floats. The SIMD versions perform exactly the same IEEE
+// operations in the same order as the scalar ones (no FMA, same min/max
+// selection on NaN) so all paths produce bit-identical positions.
+struct VerletKernels{
+    using Integrate = void(*)(Vector2f* pos, Vector2f* pos_prev, Vector2f* acc, uint32_t count, float dt2);
+    using Accelerate = void(*)(Vector2f* acc, uint32_t count, Vector2f a);
+    using Constrain = void(*)(Vector2f* pos, uint32_t count, Vector2f min, Vector2f max);
+
+    Integrate integrate = integrateScalar;
+    Accelerate accelerate = accelerateScalar;
+    Constrain constrain = constrainScalar;
+    KernelMode mode = KernelMode::Scalar;
+
+    static bool supported(KernelMode m){
+        switch(m){
+            case KernelMode::Auto:
+            case KernelMode::Scalar:
+                return true;
+#ifdef PHYSICS_SIMD_X86
+            case KernelMode::SSE:
+                return true;
+            case KernelMode::AVX2:
+#if defined(__GNUC__) || defined(__clang__)
+                return __builtin_cpu_supports("avx2");
+#else
+                return false;
+#endif
+#endif
+            default:
+                return false;
+        }
+    }
+
+    // Falls back to the best supported set when the requested one is unavailable
+    static VerletKernels select(KernelMode requested){
+        if(requested == KernelMode::Auto || !supported(requested)){
+            requested = supported(KernelMode::AVX2) ? KernelMode::AVX2
+                      : supported(KernelMode::SSE) ? KernelMode::SSE
+                      : KernelMode::Scalar;
+        }
+        VerletKernels k;
+        k.mode = requested;
+#ifdef PHYSICS_SIMD_X86
+        if(requested == KernelMode::SSE){
+            k.integrate = integrateSSE;
+            k.accelerate = accelerateSSE;
+            k.constrain = constrainSSE;
+        }else if(requested == KernelMode::AVX2){
+            k.integrate = integrateAVX2;
+            k.accelerate = accelerateAVX2;
+            k.constrain = constrainAVX2;
+        }
+#endif
+        return k;
+    }
+
+    static const char* name(KernelMode m){
+        switch(m){
+            case KernelMode::Auto: return "auto";
+            case KernelMode::Scalar: return "scalar";
+            case KernelMode::SSE: return "sse";
+            case KernelMode::AVX2: return "avx2";
+        }
+        return "unknown";
+    }
+
+    static void integrateScalar(Vector2f* pos, Vector2f* pos_prev, Vector2f* acc, uint32_t count, float dt2){
+        for(uint32_t i{0}; i < count; i++){
+            const Vector2f dis = pos[i] - pos_prev[i];
+            pos_prev[i] = pos[i];
+            pos[i] += dis + acc[i] * dt2;
+            acc[i] = {};
+        }
+    }
+
+    static void accelerateScalar(Vector2f* acc, uint32_t count, Vector2f a){
+        for(uint32_t i{0}; i < count; i++){
+            acc[i] += a;
+        }
+    }
+
+    static void constrainScalar(Vector2f* pos, uint32_t count, Vector2f min, Vector2f max){
+        for(uint32_t i{0}; i < count; i++){
+            Vector2f& p = pos[i];
+            if(p.x > max.x)
+                p.x = max.x;
+            else if(p.x < min.x)
+                p.x = min.x;
+            if(p.y > max.y)
+                p.y = max.y;
+            else if(p.y < min.y)
+                p.y = min.y;
+        }
+    }
+
+#ifdef PHYSICS_SIMD_X86
+    // 2 particles per register
+    static void integrateSSE(Vector2f* pos, Vector2f* pos_prev, Vector2f* acc, uint32_t count, float dt2){
+        float* p = &pos[0].x;
+        float* pp = &pos_prev[0].x;
+        float* a = &acc[0].x;
+        const __m128 vdt2 = _mm_set1_ps(dt2);
+        const __m128 zero = _mm_setzero_ps();
+        const uint32_t floats = count * 2;
+        uint32_t i{0};
+        for(; i + 4 <= floats; i += 4){
+            const __m128 vp = _mm_loadu_ps(p + i);
+            const __m128 dis = _mm_sub_ps(vp, _mm_loadu_ps(pp + i));
+            const __m128 step = _mm_add_ps(dis, _mm_mul_ps(_mm_loadu_ps(a + i), vdt2));
+            _mm_storeu_ps(pp + i, vp);
+            _mm_storeu_ps(p + i, _mm_add_ps(vp, step));
+            _mm_storeu_ps(a + i, zero);
+        }
+        integrateScalar(pos + i / 2, pos_prev + i / 2, acc + i / 2, count - i / 2, dt2);
+    }
+
+    static void accelerateSSE(Vector2f* acc, uint32_t count, Vector2f g){
+        float* a = &acc[0].x;
+        const __m128 vg = _mm_setr_ps(g.x, g.y, g.x, g.y);
+        const uint32_t floats = count * 2;
+        uint32_t i{0};
+        for(; i + 4 <= floats; i += 4){
+            _mm_storeu_ps(a + i, _mm_add_ps(_mm_loadu_ps(a + i), vg));
+        }
+        accelerateScalar(acc + i / 2, count - i / 2, g);
+    }
+
+    static void constrainSSE(Vector2f* pos, uint32_t count, Vector2f min, Vector2f max){
+        float* p = &pos[0].x;
+        const __m128 lo = _mm_setr_ps(min.x, min.y, min.x, min.y);
+        const __m128 hi = _mm_setr_ps(max.x, max.y, max.x, max.y);
+        const uint32_t floats = count * 2;
+        uint32_t i{0};
+        for(; i + 4 <= floats; i += 4){
+            // Operand order keeps NaN positions untouched like the scalar branches
+            const __m128 clamped = _mm_min_ps(hi, _mm_max_ps(lo, _mm_loadu_ps(p + i)));
+            _mm_storeu_ps(p + i, clamped);
+        }
+        constrainScalar(pos + i / 2, count - i / 2, min, max);
+    }
+
+    // 4 particles per register, 8 per iteration
+    PHYSICS_TARGET_AVX2
+    static void integrateAVX2(Vector2f* pos, Vector2f* pos_prev, Vector2f* acc, uint32_t count, float dt2){
+        float* p = &pos[0].x;
+        float* pp = &pos_prev[0].x;
+        float* a = &acc[0].x;
+        const __m256 vdt2 = _mm256_set1_ps(dt2);
+        const __m256 zero = _mm256_setzero_ps();
+        const uint32_t floats = count * 2;
+        uint32_t i{0};
+        for(; i + 16 <= floats; i += 16){
+            const __m256 vp0 = _mm256_loadu_ps(p + i);
+            const __m256 vp1 = _mm256_loadu_ps(p + i + 8);
+            const __m256 dis0 = _mm256_sub_ps(vp0, _mm256_loadu_ps(pp + i));
+            const __m256 dis1 = _mm256_sub_ps(vp1, _mm256_loadu_ps(pp + i + 8));
+            const __m256 step0 = _mm256_add_ps(dis0, _mm256_mul_ps(_mm256_loadu_ps(a + i), vdt2));
+            const __m256 step1 = _mm256_add_ps(dis1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8), vdt2));
+            _mm256_storeu_ps(pp + i, vp0);
+            _mm256_storeu_ps(pp + i + 8, vp1);
+            _mm256_storeu_ps(p + i, _mm256_add_ps(vp0, step0));
+            _mm256_storeu_ps(p + i + 8, _mm256_add_ps(vp1, step1));
+            _mm256_storeu_ps(a + i, zero);
+            _mm256_storeu_ps(a + i + 8, zero);
+        }
+        integrateScalar(pos + i / 2, pos_prev + i / 2, acc + i / 2, count - i / 2, dt2);
+    }
+
+    PHYSICS_TARGET_AVX2
+    static void accelerateAVX2(Vector2f* acc, uint32_t count, Vector2f g){
+        float* a = &acc[0].x;
+        const __m256 vg = _mm256_setr_ps(g.x, g.y, g.x, g.y, g.x, g.y, g.x, g.y);
+        const uint32_t floats = count * 2;
+        uint32_t i{0};
+        for(; i + 16 <= floats; i += 16){
+            _mm256_storeu_ps(a + i, _mm256_add_ps(_mm256_loadu_ps(a + i), vg));
+            _mm256_storeu_ps(a + i + 8, _mm256_add_ps(_mm256_loadu_ps(a + i + 8), vg));
+        }
+        accelerateScalar(acc + i / 2, count - i / 2, g);
+    }
+
+    PHYSICS_TARGET_AVX2
+    static void constrainAVX2(Vector2f* pos, uint32_t count, Vector2f min, Vector2f max){
+        float* p = &pos[0].x;
+        const __m256 lo = _mm256_setr_ps(min.x, min.y, min.x, min.y, min.x, min.y, min.x, min.y);
+        const __m256 hi = _mm256_setr_ps(max.x, max.y, max.x, max.y, max.x, max.y, max.x, max.y);
+        const uint32_t floats = count * 2;
+        uint32_t i{0};
+        for(; i + 16 <= floats; i += 16){
+            _mm256_storeu_ps(p + i, _mm256_min_ps(hi, _mm256_max_ps(lo, _mm256_loadu_ps(p + i))));
+            _mm256_storeu_ps(p + i + 8, _mm256_min_ps(hi, _mm256_max_ps(lo, _mm256_loadu_ps(p + i + 8))));
+        }
+        constrainScalar(pos + i / 2, count - i / 2, min, max);
+    }
+#endif
+};
@@ -0,0 +1,333 @@
+//
+// Versioned binary snapshot of the full solver state.
+//
+
+#pragma once
+
+#include <cstdio>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include "ParticleStore.hpp"
+#include "LinkStore.hpp"
+#include "MappedFile.hpp"
+
+// Layout: SnapshotHeader, then every array at a 64 byte aligned offset in
+// the order of SnapshotHeader::offsets, stored exactly as in memory so a
+// restore is one copy per array. Files are native endian, a byte order
+// marker rejects files from a machine of the other endianness.
+static_assert(sizeof(Vector2f) == 8, "snapshot stores Vector2f as 2 floats");
+static_assert(sizeof(sf::Color) == 4, "snapshot stores sf::Color as 4 bytes");
+static_assert(sizeof(int) == 4, "snapshot stores polarity as 32 bit");
+static_assert(sizeof(Link) == 28, "snapshot stores a Link as 2 handles and 3 floats");
+
+struct SnapshotSettings {
+    Vector2f world_size;
+    Vector2f gravity;
+    float step = 0.0f;
+    float friction = 0.0f;
+    uint32_t substep = 0;
+    uint32_t reorder_interval = 0;
+    uint64_t frame_count = 0;
+    // Sleep settings the saved rest counters were taken with
+    float sleep_threshold = 0.0f;
+    uint32_t sleep_substeps = 1;
+};
+
+enum SnapshotArray : uint32_t {
+    SnapshotPos,
+    SnapshotPosPrev,
+    SnapshotAcc,
+    SnapshotRadius,
+    SnapshotColor,
+    SnapshotPolarity,
+    SnapshotIdToSlot,
+    SnapshotSlotToId,
+    SnapshotRest,
+    SnapshotGenerations,
+    SnapshotLinks,
+    SnapshotArrayCount
+};
+
+struct SnapshotHeader {
+    static constexpr char magic_value[8] = {'P', 'H', 'Y', 'S', 'S', 'N', 'A', 'P'};
+    static constexpr uint32_t current_version = 4;
+    static constexpr uint32_t byte_order_value = 0x01020304;
+    static constexpr uint64_t alignment = 64;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t object_count;
+    uint64_t id_count;
+    uint64_t link_count;
+    uint64_t file_size;
+    SnapshotSettings settings;
+    uint64_t offsets[SnapshotArrayCount];
+};
+
+// Solver state copied out between two updates, written by SnapshotWriter
+struct Snapshot {
+    SnapshotSettings settings;
+    ParticleStore objects;
+    std::vector<uint32_t> id_to_slot;
+    std::vector<uint32_t> slot_to_id;
+    std::vector<uint32_t> generations;
+    // Unbroken links, see LinkStore::unbroken
+    std::vector<Link> links;
+};
+
+// Pointers into a mapped snapshot file, valid while the file stays mapped
+struct SnapshotView {
+    SnapshotSettings settings;
+    uint64_t object_count = 0;
+    uint64_t id_count = 0;
+    uint64_t link_count = 0;
+    const Vector2f* pos = nullptr;
+    const Vector2f* pos_prev = nullptr;
+    const Vector2f* acc = nullptr;
+    const float* radius = nullptr;
+    const sf::Color* color = nullptr;
+    const int* polarity = nullptr;
+    const uint32_t* id_to_slot = nullptr;
+    const uint32_t* slot_to_id = nullptr;
+    const uint8_t* rest = nullptr;
+    const uint32_t* generations = nullptr;
+    const Link* links = nullptr;
+};
+
+inline uint64_t snapshotArrayBytes(uint32_t array, uint64_t object_count, uint64_t id_count, uint64_t link_count){
+    switch(array){
+        case SnapshotPos:
+        case SnapshotPosPrev:
+        case SnapshotAcc:
+            return object_count * sizeof(Vector2f);
+        case SnapshotRadius:
+            return object_count * sizeof(float);
+        case SnapshotColor:
+            return object_count * sizeof(sf::Color);
+        case SnapshotPolarity:
+            return object_count * sizeof(int);
+        case SnapshotIdToSlot:
+        case SnapshotGenerations:
+            return id_count * sizeof(uint32_t);
+        case SnapshotSlotToId:
+            return object_count * sizeof(uint32_t);
+        case SnapshotRest:
+            return object_count * sizeof(uint8_t);
+        case SnapshotLinks:
+            return link_count * sizeof(Link);
+        default:
+            return 0;
+    }
+}
+
+inline SnapshotHeader makeSnapshotHeader(const Snapshot& snapshot){
+    SnapshotHeader header{};
+    std::memcpy(header.magic, SnapshotHeader::magic_value, sizeof(header.magic));
+    header.version = SnapshotHeader::current_version;
+    header.byte_order = SnapshotHeader::byte_order_value;
+    header.object_count = snapshot.objects.size();
+    header.id_count = snapshot.id_to_slot.size();
+    header.link_count = snapshot.links.size();
+    header.settings = snapshot.settings;
+    const auto align = [](uint64_t offset){
+        return (offset + SnapshotHeader::alignment - 1) / SnapshotHeader::alignment * SnapshotHeader::alignment;
+    };
+    uint64_t offset = align(sizeof(SnapshotHeader));
+    for(uint32_t a{0}; a < SnapshotArrayCount; a++){
+        header.offsets[a] = offset;
+        offset = align(offset + snapshotArrayBytes(a, header.object_count, header.id_count, header.link_count));
+    }
+    header.file_size = offset;
+    return header;
+}
+
+// Settings a solver can run with: setStep divides by substep, the grid is
+// sized from world_size and rest counters only go up to 254
+inline bool validSnapshotSettings(const SnapshotSettings& settings){
+    return settings.substep >= 1 && settings.step > 0.0f && std::isfinite(settings.step)
+           && std::isfinite(settings.world_size.x) && std::isfinite(settings.world_size.y)
+           && settings.world_size.x > 0.0f && settings.world_size.y > 0.0f
+           && settings.sleep_threshold >= 0.0f && std::isfinite(settings.sleep_threshold)
+           && settings.sleep_substeps >= 1 && settings.sleep_substeps < 255;
+}
+
+// The solver indexes its arrays with these without checks, so every live
+// id has to map to a slot below object_count and back. Dead entries are
+// UINT32_MAX on both sides.
+inline bool validSnapshotIds(const uint32_t* id_to_slot, const uint32_t* slot_to_id, uint64_t object_count, uint64_t id_count){
+    for(uint64_t id{0}; id < id_count; id++){
+        const uint32_t slot = id_to_slot[id];
+        if(slot != UINT32_MAX && (slot >= object_count || slot_to_id[slot] != id)) return false;
+    }
+    for(uint64_t slot{0}; slot < object_count; slot++){
+        const uint32_t id = slot_to_id[slot];
+        if(id != UINT32_MAX && (id >= id_count || id_to_slot[id] != slot)) return false;
+    }
+    return true;
+}
+
+// Positions are finite and radii finite and positive, anything else sends
+// the grid sizing and the contact math off the rails. Removed objects
+// (slot_to_id UINT32_MAX) are never read again and may hold anything.
+inline bool validSnapshotObjects(const Vector2f* pos, const Vector2f* pos_prev, const float* radius, const uint32_t* slot_to_id, uint64_t object_count){
+    for(uint64_t i{0}; i < object_count; i++){
+        if(slot_to_id[i] != UINT32_MAX && (!std::isfinite(pos[i].x) || !std::isfinite(pos[i].y) || !std::isfinite(pos_prev[i].x) || !std::isfinite(pos_prev[i].y)
+           || !(radius[i] > 0.0f) || !std::isfinite(radius[i]))){
+            return false;
+        }
+    }
+    return true;
+}
+
+// Links may name ids removed since the last update, those are dropped on
+// restore, but never ids past the table
+inline bool validSnapshotLinks(const Link* links, uint64_t link_count, uint64_t id_count){
+    for(uint64_t k{0}; k < link_count; k++){
+        const Link& l = links[k];
+        if(l.a.id >= id_count || l.b.id >= id_count
+           || !(l.rest_length >= 0.0f) || !std::isfinite(l.rest_length)
+           || !std::isfinite(l.stiffness) || !(l.break_strain >= 0.0f) || !std::isfinite(l.break_strain)){
+            return false;
+        }
+    }
+    return true;
+}
+
+// Validates the header, every array range, the objects, the id tables and
+// the links, fills view on success
+inline bool readSnapshot(const MappedFile& file, SnapshotView& view){
+    if(!file.isOpen() || file.size() < sizeof(SnapshotHeader)) return false;
+    SnapshotHeader header{};
+    std::memcpy(&header, file.data(), sizeof(SnapshotHeader));
+    if(std::memcmp(header.magic, SnapshotHeader::magic_value, sizeof(header.magic)) != 0
+       || header.version != SnapshotHeader::current_version
+       || header.byte_order != SnapshotHeader::byte_order_value
+       || header.file_size > file.size()
+       || header.object_count > header.id_count
+       || header.id_count >= UINT32_MAX
+       || header.link_count > header.file_size / sizeof(Link)
+       || !validSnapshotSettings(header.settings)){
+        return false;
+    }
+    for(uint32_t a{0}; a < SnapshotArrayCount; a++){
+        const uint64_t bytes = snapshotArrayBytes(a, header.object_count, header.id_count, header.link_count);
+        if(header.offsets[a] % SnapshotHeader::alignment != 0 || header.offsets[a] > header.file_size
+           || bytes > header.file_size - header.offsets[a]){
+            return false;
+        }
+    }
+
+    const auto at = [&](uint32_t array){
+        return static_cast<const void*>(file.data() + header.offsets[array]);
+    };
+    const auto* id_to_slot = static_cast<const uint32_t*>(at(SnapshotIdToSlot));
+    const auto* slot_to_id = static_cast<const uint32_t*>(at(SnapshotSlotToId));
+    const auto* links = static_cast<const Link*>(at(SnapshotLinks));
+    if(!validSnapshotObjects(static_cast<const Vector2f*>(at(SnapshotPos)), static_cast<const Vector2f*>(at(SnapshotPosPrev)),
+                             static_cast<const float*>(at(SnapshotRadius)), slot_to_id, header.object_count)
+       || !validSnapshotIds(id_to_slot, slot_to_id, header.object_count, header.id_count)
+       || !validSnapshotLinks(links, header.link_count, header.id_count)){
+        return false;
+    }
+    view.settings = header.settings;
+    view.object_count = header.object_count;
+    view.id_count = header.id_count;
+    view.link_count = header.link_count;
+    view.pos = static_cast<const Vector2f*>(at(SnapshotPos));
+    view.pos_prev = static_cast<const Vector2f*>(at(SnapshotPosPrev));
+    view.acc = static_cast<const Vector2f*>(at(SnapshotAcc));
+    view.radius = static_cast<const float*>(at(SnapshotRadius));
+    view.color = static_cast<const sf::Color*>(at(SnapshotColor));
+    view.polarity = static_cast<const int*>(at(SnapshotPolarity));
+    view.id_to_slot = id_to_slot;
+    view.slot_to_id = slot_to_id;
+    view.rest = static_cast<const uint8_t*>(at(SnapshotRest));
+    view.generations = static_cast<const uint32_t*>(at(SnapshotGenerations));
+    view.links = links;
+    return true;
+}
+
+// Writes to path.tmp and renames it over path once complete, so a crash
+// mid-save never leaves a truncated snapshot behind
+inline bool writeSnapshot(const std::string& path, const Snapshot& snapshot){
+    const SnapshotHeader header = makeSnapshotHeader(snapshot);
+    const void* arrays[SnapshotArrayCount] = {
+        snapshot.objects.pos.data(), snapshot.objects.pos_prev.data(), snapshot.objects.acc.data(),
+        snapshot.objects.radius.data(), snapshot.objects.color.data(), snapshot.objects.polarity.data(),
+        snapshot.id_to_slot.data(), snapshot.slot_to_id.data(), snapshot.objects.rest.data(),
+        snapshot.generations.data(), snapshot.links.data()
+    };
+    const std::string tmp = path + ".tmp";
+    std::FILE* file = std::fopen(tmp.c_str(), "wb");
+    if(!file) return false;
+
+    static const char padding[SnapshotHeader::alignment] = {};
+    uint64_t written = 0;
+    const auto put = [&](const void* data, uint64_t bytes){
+        written += bytes;
+        return !bytes || std::fwrite(data, 1, bytes, file) == bytes;
+    };
+    bool ok = put(&header, sizeof(header));
+    for(uint32_t a{0}; ok && a < SnapshotArrayCount; a++){
+        ok = put(padding, header.offsets[a] - written)
+             && put(arrays[a], snapshotArrayBytes(a, header.object_count, header.id_count, header.link_count));
+    }
+    ok = ok && put(padding, header.file_size - written);
+    ok = std::fclose(file) == 0 && ok;
+    if(ok) ok = std::rename(tmp.c_str(), path.c_str()) == 0;
+    if(!ok) std::remove(tmp.c_str());
+    return ok;
+}
+
+// Owns the buffer a save is copied into and writes it on a background
+// thread, the solver only stops for the copy. A new save waits for the
+// previous write to finish before reusing the buffer.
+struct SnapshotWriter {
+    SnapshotWriter() = default;
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    ~SnapshotWriter(){
+        wait();
+    }
+
+    Snapshot& beginCapture(){
+        wait();
+        return buffer;
+    }
+
+    void write(const std::string& path){
+        writing = true;
+        thread = std::thread([this, path]{
+            succeeded = writeSnapshot(path, buffer);
+            writing = false;
+        });
+    }
+
+    void wait(){
+        if(thread.joinable()) thread.join();
+    }
+
+    [[nodiscard]]
+    bool busy() const {
+        return writing;
+    }
+
+    // Result of the last completed write
+    [[nodiscard]]
+    bool lastWriteSucceeded() const {
+        return succeeded;
+    }
+
+private:
+    Snapshot buffer;
+    std::thread thread;
+    std::atomic<bool> writing{false};
+    std::atomic<bool> succeeded{false};
+};
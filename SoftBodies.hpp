@@ -0,0 +1,99 @@
+//
+// Builders for ropes, cloth and blobs made of objects held together by
+// links. Neighbors are at least one diameter apart so contacts and links
+// never fight over the rest shape.
+//
+
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include "Solver.hpp"
+
+struct SoftBodyStyle{
+    float radius = 0.5f;
+    float stiffness = 1.0f;
+    // See Link, 0 never breaks
+    float break_strain = 0.0f;
+    sf::Color color = sf::Color::Blue;
+};
+
+// Adds one object of the style per position and returns their ids
+inline std::vector<uint32_t> addSoftBodyObjects(Solver& solver, const std::vector<Vector2f>& positions, const SoftBodyStyle& style){
+    std::vector<uint32_t> ids(positions.size());
+    ParticleBatch batch;
+    batch.pos = positions.data();
+    batch.count = static_cast<uint32_t>(positions.size());
+    batch.default_radius = style.radius;
+    batch.default_color = style.color;
+    solver.addObjects(batch, ids.data());
+    return ids;
+}
+
+// `count` objects in a line from start along direction, each linked to the
+// next. Returns their ids in order.
+inline std::vector<uint32_t> addRope(Solver& solver, Vector2f start, Vector2f direction, uint32_t count, const SoftBodyStyle& style = {}){
+    const float length = std::hypot(direction.x, direction.y);
+    const Vector2f step = length > 0.0f ? direction * (2.0f * style.radius / length) : Vector2f{2.0f * style.radius, 0.0f};
+    std::vector<Vector2f> positions(count);
+    for(uint32_t i{0}; i < count; i++) positions[i] = start + step * static_cast<float>(i);
+    std::vector<uint32_t> ids = addSoftBodyObjects(solver, positions, style);
+    for(uint32_t i{1}; i < count; i++) solver.addLink(ids[i - 1], ids[i], style.stiffness, style.break_strain);
+    return ids;
+}
+
+// A columns x rows sheet from corner, linked to the objects right and below
+// and across both diagonals so it keeps its shape under shear. Ids are row
+// by row.
+inline std::vector<uint32_t> addCloth(Solver& solver, Vector2f corner, uint32_t columns, uint32_t rows, const SoftBodyStyle& style = {}){
+    const float spacing = 2.0f * style.radius;
+    std::vector<Vector2f> positions(columns * rows);
+    for(uint32_t y{0}; y < rows; y++){
+        for(uint32_t x{0}; x < columns; x++){
+            positions[y * columns + x] = corner + Vector2f{spacing * static_cast<float>(x), spacing * static_cast<float>(y)};
+        }
+    }
+    std::vector<uint32_t> ids = addSoftBodyObjects(solver, positions, style);
+    const auto at = [&](uint32_t x, uint32_t y){return ids[y * columns + x];};
+    for(uint32_t y{0}; y < rows; y++){
+        for(uint32_t x{0}; x < columns; x++){
+            if(x + 1 < columns) solver.addLink(at(x, y), at(x + 1, y), style.stiffness, style.break_strain);
+            if(y + 1 < rows) solver.addLink(at(x, y), at(x, y + 1), style.stiffness, style.break_strain);
+            if(x + 1 < columns && y + 1 < rows){
+                solver.addLink(at(x, y), at(x + 1, y + 1), style.stiffness, style.break_strain);
+                solver.addLink(at(x + 1, y), at(x, y + 1), style.stiffness, style.break_strain);
+            }
+        }
+    }
+    return ids;
+}
+
+// A ring of `segments` objects around a center object, linked around the
+// ring, to the center and to the ring object two along. With three segments
+// those are already ring neighbors and with four each diagonal is linked
+// once. The ring is widened until neighbors are a diameter apart. Returns the
+// center id first.
+inline std::vector<uint32_t> addBlob(Solver& solver, Vector2f center, float ring_radius, uint32_t segments = 12, const SoftBodyStyle& style = {}){
+    segments = std::max(segments, 3u);
+    const float pi = 3.14159265f;
+    const float angle = 2.0f * pi / static_cast<float>(segments);
+    ring_radius = std::max(ring_radius, style.radius / std::sin(0.5f * angle));
+    std::vector<Vector2f> positions(segments + 1);
+    positions[0] = center;
+    for(uint32_t i{0}; i < segments; i++){
+        const float a = angle * static_cast<float>(i);
+        positions[i + 1] = center + Vector2f{std::cos(a), std::sin(a)} * ring_radius;
+    }
+    std::vector<uint32_t> ids = addSoftBodyObjects(solver, positions, style);
+    for(uint32_t i{0}; i < segments; i++){
+        const uint32_t ring = ids[i + 1];
+        solver.addLink(ids[0], ring, style.stiffness, style.break_strain);
+        solver.addLink(ring, ids[(i + 1) % segments + 1], style.stiffness, style.break_strain);
+        if(segments > 4 || (segments == 4 && i < 2)){
+            solver.addLink(ring, ids[(i + 2) % segments + 1], style.stiffness, style.break_strain);
+        }
+    }
+    return ids;
+}
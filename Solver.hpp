@@ -2,97 +2,356 @@
 // Created by Cameron Day on 3/19/23.
 //
 
+#pragma once
 #include "SFML/Graphics.hpp"
 #include <cmath>
 #include <thread>
+#include <chrono>
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <functional>
 #include "ThreadPool.hpp"
 #include "CollisionGrid.hpp"
+#include "TileScheduler.hpp"
+#include "BarnesHut.hpp"
+#include "ParticleStore.hpp"
+#include "SimdKernels.hpp"
+#include "Snapshot.hpp"
+#include "TrajectoryRecorder.hpp"
+#include "Profiler.hpp"
+#include "SolverPolicy.hpp"
+#include "Emitter.hpp"
+#include "LinkStore.hpp"
 
-using sf::Vector2f;
-
-struct VerletObject{
-
-    Vector2f pos;
-    Vector2f pos_prev;
-    Vector2f acc;
-    float radius;
-    sf::Color color;
-    int polarity{};
-
-
-    VerletObject() = default;
-    VerletObject(Vector2f pos_, float radius_):
-    pos{pos_},
-    radius{radius_},
-    pos_prev{pos_},
-    acc{0.0f, 0.0f},
-    color{sf::Color::Blue},
-    polarity{1}
-    {}
-
-    VerletObject(Vector2f pos_, float radius_, sf::Color color_):
-    pos{pos_},
-    radius{radius_},
-    pos_prev{pos_},
-    acc{0.0f, 0.0f},
-    color{color_},
-    polarity{1}
-    {}
-
-    VerletObject(Vector2f pos_, float radius_, int polarity_):
-    pos{pos_},
-    radius{radius_},
-    pos_prev{pos_},
-    acc{0.0f, 0.0f},
-    color{},
-    polarity{polarity_}
-    {if(polarity_ > 0)
-        color = sf::Color::Blue;
-    else
-        color = sf::Color::Red;
-    }
-
+// Phased runs every per-particle stage as its own dispatch over all objects.
+// Fused runs integrate/gravity/constraints/grid insertion back to back on
+// each thread's chunk, leaving one barrier before the collision solve.
+enum class UpdateMode{
+    Phased,
+    Fused
+};
 
-    void update(float dt){
-        Vector2f dis = pos-pos_prev;
-        pos_prev = pos;
-        pos += dis + acc * (dt * dt);
-        acc = {};
-    }
+struct PhaseTimings{
+    uint64_t fused{0};
+    uint64_t gravity{0};
+    uint64_t constraints{0};
+    uint64_t grid_build{0};
+    uint64_t collisions{0};
+    uint64_t integration{0};
+    uint64_t reorder{0};
+    uint64_t long_range{0};
+    uint64_t record{0};
+    uint64_t sleep{0};
+    uint64_t emit{0};
+    uint64_t removal{0};
+    uint64_t links{0};
+    uint64_t substeps{0};
 
-    void accelerate(Vector2f a){
-        acc += a;
+    void reset(){
+        *this = {};
     }
-
 };
 
 class Solver{
 public:
 
     Vector2f worldSize;
-    std::vector<VerletObject> objects;
+    ParticleStore objects;
 
     Solver() = delete;
     explicit Solver(Vector2f size, ThreadPool& threadPool_):
-    grid{static_cast<int32_t>(size.x), static_cast<int32_t>(size.y)},
+    grid{size.x, size.y, 1.0f, size.x * size.y > sparse_grid_area ? GridStorage::Sparse : GridStorage::Dense},
     worldSize{size.x, size.y},
     threadPool{threadPool_}{
-        grid.clear();
+        long_range.kernel_mode = kernels.mode;
     }
 
 
     uint32_t addObject(Vector2f pos, float radius){
-        objects.emplace_back(pos, radius);
-        applySingleConstraint(objects.back());
-        objects.back().pos_prev = objects.back().pos;
-        return objects.size()-1;
+        return addObject(VerletObject{pos, radius});
     }
 
     uint32_t addObject(Vector2f pos, float radius, sf::Color color){
-        objects.emplace_back(pos, radius, color);
-        applySingleConstraint(objects.back());
-        objects.back().pos_prev = objects.back().pos;
-        return objects.size()-1;
+        return addObject(VerletObject{pos, radius, color});
+    }
+
+    // Returns a stable id, use getObject(id) to reach the object later since
+    // reordering moves objects around in the arrays. Ids of removed objects
+    // are handed out again, see ObjectHandle.
+    uint32_t addObject(VerletObject v){
+        v.radius = admitRadius(v.radius);
+        applySingleConstraint(v.pos);
+        v.pos_prev = v.pos;
+        const uint32_t slot = objects.push_back(v);
+        slot_to_id.push_back(0);
+        return bindId(slot);
+    }
+
+    // Adds batch.count objects, writing their ids to ids unless it is null.
+    // The arrays grow once and are filled on the pool. Positions are kept
+    // inside the walls like addObject does, velocities become pos_prev one
+    // substep back.
+    void addObjects(const ParticleBatch& batch, uint32_t* ids = nullptr){
+        const auto first_slot = static_cast<uint32_t>(objects.size());
+        if(!batch.count) return;
+        if(batch.radius){
+            for(uint32_t i{0}; i < batch.count; i++) admitRadius(batch.radius[i]);
+        }
+        const float default_radius = admitRadius(batch.default_radius);
+        objects.resize(first_slot + batch.count);
+        slot_to_id.resize(first_slot + batch.count);
+        // Free ids go first, the rest are new and filled in below
+        const auto reused = static_cast<uint32_t>(std::min<size_t>(free_ids.size(), batch.count));
+        for(uint32_t i{0}; i < reused; i++) bindId(first_slot + i);
+        const auto first_id = static_cast<uint32_t>(id_to_slot.size());
+        id_to_slot.resize(first_id + batch.count - reused);
+        generations.resize(id_to_slot.size(), 0);
+        threadPool.dispatch(batch.count, [&](uint32_t start, uint32_t end){
+            for(uint32_t i{start}; i < end; i++){
+                const uint32_t slot = first_slot + i;
+                Vector2f pos = batch.pos[i];
+                applySingleConstraint(pos);
+                const Vector2f velocity = batch.velocity ? batch.velocity[i] : batch.default_velocity;
+                objects.pos[slot] = pos;
+                objects.pos_prev[slot] = pos - velocity * dt;
+                objects.acc[slot] = {0.0f, 0.0f};
+                objects.radius[slot] = batch.radius ? clampRadius(batch.radius[i]) : default_radius;
+                objects.color[slot] = batch.color ? batch.color[i] : batch.default_color;
+                objects.polarity[slot] = 1;
+                objects.rest[slot] = 0;
+                if(i >= reused){
+                    id_to_slot[first_id + i - reused] = slot;
+                    slot_to_id[slot] = first_id + i - reused;
+                }
+                if(ids) ids[i] = slot_to_id[slot];
+            }
+        });
+    }
+
+    // Removes the object at once. Its slot is reclaimed at the start of the
+    // next update, which then hands out its id again, smallest free id first,
+    // so the ids given out after a snapshot is loaded are the same.
+    bool removeObject(uint32_t id){
+        if(!isAlive(id)) return false;
+        const uint32_t slot = id_to_slot[id];
+        slot_to_id[slot] = no_slot;
+        id_to_slot[id] = no_slot;
+        generations[id]++;
+        removed_ids.push_back(id);
+        removed_slots++;
+        return true;
+    }
+
+    bool removeObject(ObjectHandle handle){
+        return isAlive(handle) && removeObject(handle.id);
+    }
+
+    [[nodiscard]]
+    ObjectHandle getHandle(uint32_t id) const{
+        return {id, generations[id]};
+    }
+
+    [[nodiscard]]
+    bool isAlive(uint32_t id) const{
+        return id < id_to_slot.size() && id_to_slot[id] != no_slot;
+    }
+
+    [[nodiscard]]
+    bool isAlive(ObjectHandle handle) const{
+        return isAlive(handle.id) && generations[handle.id] == handle.generation;
+    }
+
+    // Ids handed out so far, alive or not
+    [[nodiscard]]
+    uint32_t getIdCount() const{
+        return static_cast<uint32_t>(id_to_slot.size());
+    }
+
+    // Removed objects keep their slot in objects until the next update
+    [[nodiscard]]
+    uint32_t getObjectCount() const{
+        return static_cast<uint32_t>(objects.size()) - removed_slots;
+    }
+
+    // Clamped like the radius of a new object, false if id is not alive
+    bool setRadius(uint32_t id, float radius){
+        if(!isAlive(id)) return false;
+        objects.radius[id_to_slot[id]] = admitRadius(radius);
+        return true;
+    }
+
+    // Links two objects at their current distance, see Link. Links to a
+    // removed object go away with it. False if either id is not alive or
+    // both are the same.
+    bool addLink(uint32_t a, uint32_t b, float stiffness = 1.0f, float break_strain = 0.0f){
+        if(!isAlive(a) || !isAlive(b) || a == b) return false;
+        const Vector2f d = getObject(a).pos - getObject(b).pos;
+        links.add({getHandle(a), getHandle(b), std::sqrt(d.x * d.x + d.y * d.y), stiffness, break_strain});
+        return true;
+    }
+
+    // Links left, broken ones are dropped at the start of the next update
+    [[nodiscard]]
+    uint32_t getLinkCount() const{
+        return static_cast<uint32_t>(links.size());
+    }
+
+    [[nodiscard]]
+    const LinkStore& getLinks() const{
+        return links;
+    }
+
+    void clearLinks(){
+        links.clear();
+    }
+
+    // Sinks remove the objects inside them at the start of every update
+    uint32_t addSink(const Sink& sink){
+        sinks.push_back(sink);
+        return static_cast<uint32_t>(sinks.size() - 1);
+    }
+
+    Sink& getSink(uint32_t index){
+        return sinks[index];
+    }
+
+    void clearSinks(){
+        sinks.clear();
+    }
+
+    // Open walls no longer hold objects in the world, the ones that leave it
+    // are removed at the start of the next update
+    void setOpenWalls(bool open){
+        open_walls = open;
+    }
+
+    // Emitters run at the start of every substep, in the order they were added
+    uint32_t addEmitter(const Emitter& emitter){
+        emitters.push_back(emitter);
+        return static_cast<uint32_t>(emitters.size() - 1);
+    }
+
+    Emitter& getEmitter(uint32_t index){
+        return emitters[index];
+    }
+
+    void clearEmitters(){
+        emitters.clear();
+    }
+
+    ParticleRef getObject(uint32_t id){
+        return objects[id_to_slot[id]];
+    }
+
+    [[nodiscard]]
+    ConstParticleRef getObject(uint32_t id) const{
+        return objects[id_to_slot[id]];
+    }
+
+    [[nodiscard]]
+    uint32_t getSlot(uint32_t id) const{
+        return id_to_slot[id];
+    }
+
+    // no_slot for a removed object waiting for the next update
+    [[nodiscard]]
+    uint32_t getId(uint32_t slot) const{
+        return slot_to_id[slot];
+    }
+
+    // Worlds bigger than sparse_grid_area default to the sparse grid, this
+    // overrides the choice. The grid is rebuilt on the next update.
+    void setGridStorage(GridStorage storage){
+        resetGrid(grid.base_cell_size, storage);
+    }
+
+    // Fits the grid to the scene: base cells as wide as objects of this
+    // radius, bigger ones go to coarser levels, and sparse storage when they
+    // are expected to cover less than sparse_packing of the world (or it is
+    // bigger than sparse_grid_area). A dense grid pays for every cell each
+    // substep, about 0.8 / packing cells per object.
+    void configureGrid(float radius, float packing){
+        const float cell_size = 2.0f * radius;
+        const bool sparse = packing < sparse_packing || worldSize.x * worldSize.y > sparse_grid_area * cell_size * cell_size;
+        resetGrid(cell_size, sparse ? GridStorage::Sparse : GridStorage::Dense);
+    }
+
+    [[nodiscard]]
+    GridStorage getGridStorage() const{
+        return grid.storage;
+    }
+
+    // Narrows the pipeline to the features the scene uses. Turning gravity,
+    // friction or the long-range force off resets it, and a uniform radius
+    // only holds if every object already has it. Adding an object of another
+    // radius or turning a feature back on widens the pipeline again, so the
+    // result is always the same as with every feature on.
+    void setFeatures(SolverFeatures f){
+        if(f.uniform_radius > 0.0f){
+            for(const float r : objects.radius){
+                if(r != f.uniform_radius){
+                    f.uniform_radius = 0.0f;
+                    break;
+                }
+            }
+        }
+        if(!f.gravity) gravity = {0.0f, 0.0f};
+        if(!f.variable_friction) friction = 1.0f;
+        if(!f.long_range) long_range.strength = 0.0f;
+        features = f;
+        selectPipeline();
+    }
+
+    [[nodiscard]]
+    const SolverFeatures& getFeatures() const{
+        return features;
+    }
+
+    void setGravity(Vector2f g){
+        gravity = g;
+        requireFeatures();
+    }
+
+    // Scales every collision correction, 1 separates overlapping objects fully
+    void setFriction(float f){
+        friction = f;
+        requireFeatures();
+    }
+
+    // Sort the particle arrays by grid cell every `frames` updates, 0 disables it
+    void setReorderInterval(uint32_t frames){
+        reorder_interval = frames;
+    }
+
+    // Objects moving less than threshold per substep for `substeps` substeps
+    // in a row are at rest. Once every object of a sleep region is, the whole
+    // region falls asleep: its objects are no longer integrated and only
+    // collide with awake objects, as if pinned in place. A contact needing a
+    // correction bigger than threshold wakes the sleeper and with it its
+    // region. A threshold of 0 turns sleeping off and wakes everything.
+    void setSleep(float threshold, uint32_t substeps){
+        sleep_threshold = std::max(threshold, 0.0f);
+        sleep_substeps = static_cast<uint8_t>(std::clamp(substeps, 1u, asleep - 1u));
+        if(sleep_threshold == 0.0f) wakeAll();
+    }
+
+    void wake(uint32_t id){
+        objects.rest[id_to_slot[id]] = 0;
+    }
+
+    void wakeAll(){
+        std::fill(objects.rest.begin(), objects.rest.end(), 0);
+    }
+
+    [[nodiscard]]
+    bool isAsleep(uint32_t id) const{
+        return objects.rest[id_to_slot[id]] == asleep;
+    }
+
+    [[nodiscard]]
+    uint32_t getSleepingCount() const{
+        return static_cast<uint32_t>(std::count(objects.rest.begin(), objects.rest.end(), asleep));
     }
 
 //    void addObject(Vector2f pos, float radius, int polarity){
@@ -112,184 +371,904 @@ public:
     }
 
     void update(){
-        for(uint i = 0; i < substep; i++) {
-            applyGravity();
-            applyConstraints();
-            solveCollisions();
-            updateObjects();
+        bool removals = false;
+        if(!sinks.empty() || open_walls || removed_slots){
+            timePhase("removal", timings.removal, [&]{
+                drainObjects();
+                removals = removed_slots > 0;
+                if(removals) compactObjects();
+            });
+        }
+        if(reorder_interval && frame_count % reorder_interval == 0){
+            timePhase("reorder", timings.reorder, [this]{reorderObjects();});
+        }
+        if(!links.empty()){
+            timePhase("links", timings.links, [&]{
+                links.bind(threadPool, id_to_slot.data(), generations.data(), static_cast<uint32_t>(id_to_slot.size()), removals);
+            });
+        }
+        frame_count++;
+        // Objects the emitters add during the frame must not change the
+        // pipeline, the margin or the grid levels under it
+        for(const Emitter& emitter : emitters){
+            if(emitter.enabled && emitter.remaining) admitRadius(emitter.radius);
+        }
+        (this->*pipeline)();
+        if(sleep_threshold > 0.0f){
+            timePhase("sleep", timings.sleep, [this]{updateSleepRegions();});
+        }
+        if(recorder){
+            timePhase("record", timings.record, [this]{
+                recorder->capture(threadPool, objects.pos.data(), id_to_slot.data(),
+                                  static_cast<uint32_t>(id_to_slot.size()), frame_count);
+            });
         }
+        PHYSICS_PROFILE_FRAME(frame_count, substep);
+    }
+
+    // Every update() then hands the positions to the recorder, nullptr stops recording
+    void setRecorder(TrajectoryRecorder* recorder_){
+        recorder = recorder_;
+    }
+
+    // Strength of the polarity force between objects, 0 turns it off. See BarnesHut
+    // for the force law, a negative strength makes like polarities attract
+    void setLongRangeStrength(float strength){
+        long_range.strength = strength;
+        requireFeatures();
+    }
+
+    // Barnes-Hut opening angle, smaller is more accurate and slower
+    void setOpeningAngle(float angle){
+        long_range.opening_angle = angle;
+    }
+
+    // The long-range field is recomputed at the start of every frame and then
+    // every `substeps` substeps, 0 keeps it for the whole frame
+    void setLongRangeInterval(uint32_t substeps){
+        long_range_interval = substeps;
+    }
+
+    void setUpdateMode(UpdateMode mode){
+        update_mode = mode;
     }
 
     [[nodiscard]]
-    const std::vector<VerletObject>& getObjects() const{
+    UpdateMode getUpdateMode() const{
+        return update_mode;
+    }
+
+    [[nodiscard]]
+    const ParticleStore& getObjects() const{
         return objects;
     }
 
+    void setPhaseTimingEnabled(bool enabled){
+        time_phases = enabled;
+    }
+
+    [[nodiscard]]
+    const PhaseTimings& getPhaseTimings() const{
+        return timings;
+    }
+
+    void resetPhaseTimings(){
+        timings.reset();
+    }
+
+    // Frames completed by update()
+    [[nodiscard]]
+    uint64_t getFrameCount() const{
+        return frame_count;
+    }
+
+    void setKernelMode(KernelMode mode){
+        kernels = VerletKernels::select(mode);
+        long_range.kernel_mode = kernels.mode;
+    }
+
+    [[nodiscard]]
+    KernelMode getKernelMode() const{
+        return kernels.mode;
+    }
+
+    [[nodiscard]]
+    const HierarchicalGrid& getGrid() const{
+        return grid;
+    }
+
+    [[nodiscard]]
+    uint getSubstep() const{
+        return substep;
+    }
+
+    // Copies the state into the writer's buffer and returns, the file is
+    // written on the writer's thread while the solver keeps updating
+    void saveSnapshot(SnapshotWriter& writer, const std::string& path) const{
+        captureSnapshot(writer.beginCapture());
+        writer.write(path);
+    }
+
+    // Replaces the whole state with a snapshot file, false leaves the solver untouched
+    bool loadSnapshot(const std::string& path){
+        const MappedFile file{path};
+        SnapshotView view;
+        if(!readSnapshot(file, view)) return false;
+        restoreSnapshot(view);
+        return true;
+    }
+
+    void captureSnapshot(Snapshot& snapshot) const{
+        snapshot.settings = {worldSize, gravity, step, friction, substep, reorder_interval, frame_count, sleep_threshold, sleep_substeps};
+        const auto count = static_cast<uint32_t>(objects.size());
+        snapshot.objects.resize(count);
+        threadPool.dispatch(count, [&](uint32_t start, uint32_t end){
+            snapshot.objects.copy(objects, start, end);
+        });
+        snapshot.id_to_slot = id_to_slot;
+        snapshot.slot_to_id = slot_to_id;
+        snapshot.generations = generations;
+        links.unbroken(snapshot.links);
+    }
+
+    void restoreSnapshot(const SnapshotView& view){
+        const SnapshotSettings& settings = view.settings;
+        worldSize = settings.world_size;
+        gravity = settings.gravity;
+        friction = settings.friction;
+        substep = settings.substep;
+        setStep(settings.step);
+        reorder_interval = settings.reorder_interval;
+        frame_count = settings.frame_count;
+        // Sleepers stay asleep, and the rest counters keep counting toward
+        // the same settings, so a settled pile runs on as if never saved
+        sleep_threshold = settings.sleep_threshold;
+        sleep_substeps = static_cast<uint8_t>(settings.sleep_substeps);
+
+        const auto count = static_cast<uint32_t>(view.object_count);
+        objects.resize(count);
+        threadPool.dispatch(count, [&](uint32_t start, uint32_t end){
+            std::copy(view.pos + start, view.pos + end, objects.pos.begin() + start);
+            std::copy(view.pos_prev + start, view.pos_prev + end, objects.pos_prev.begin() + start);
+            std::copy(view.acc + start, view.acc + end, objects.acc.begin() + start);
+            std::copy(view.radius + start, view.radius + end, objects.radius.begin() + start);
+            std::copy(view.color + start, view.color + end, objects.color.begin() + start);
+            std::copy(view.polarity + start, view.polarity + end, objects.polarity.begin() + start);
+            std::copy(view.rest + start, view.rest + end, objects.rest.begin() + start);
+        });
+        id_to_slot.assign(view.id_to_slot, view.id_to_slot + view.id_count);
+        slot_to_id.assign(view.slot_to_id, view.slot_to_id + count);
+        // Removed objects are saved as is and reclaimed by the next update.
+        // Generations come back too, so handles taken before the save still
+        // tell live objects from reused ids.
+        generations.assign(view.generations, view.generations + view.id_count);
+        // Links to objects removed before the save would be dropped by the
+        // next update anyway
+        links.clear();
+        for(uint64_t k{0}; k < view.link_count; k++){
+            const Link& link = view.links[k];
+            if(isAlive(link.a) && isAlive(link.b)) links.add(link);
+        }
+        free_ids.clear();
+        removed_ids.clear();
+        for(uint32_t id{static_cast<uint32_t>(id_to_slot.size())}; id--;){
+            if(id_to_slot[id] == no_slot) free_ids.push_back(id);
+        }
+        removed_slots = static_cast<uint32_t>(std::count(slot_to_id.begin(), slot_to_id.end(), no_slot));
+
+        max_radius = 0.0f;
+        for(uint32_t slot{0}; slot < count; slot++){
+            if(slot_to_id[slot] == no_slot) continue;
+            const float r = objects.radius[slot];
+            max_radius = std::max(max_radius, r);
+            if(r != features.uniform_radius) features.uniform_radius = 0.0f;
+        }
+        requireFeatures();
+        resetGrid(grid.base_cell_size, grid.storage);
+    }
+
+
+    // id_to_slot entry of a removed id, slot_to_id entry of a removed object
+    static constexpr uint32_t no_slot = UINT32_MAX;
 
 private:
+    using Pipeline = void (Solver::*)();
+
     Vector2f gravity = {0.0f, 20.0f};
     float dt{};
     float step{};
     uint substep = 8;
     float friction = 1.0f;
     ThreadPool& threadPool;
-    CollisionGrid grid;
+    HierarchicalGrid grid;
+    TileScheduler tiles;
+    BarnesHut long_range;
+    uint32_t long_range_interval = 0;
+    TrajectoryRecorder* recorder = nullptr;
+    float max_radius = 0.0f;
+    bool time_phases = false;
+    PhaseTimings timings;
+    // Tile durations of the color being solved, for the imbalance statistic
+    ProfileSpread tile_spread;
+    VerletKernels kernels = VerletKernels::select(KernelMode::Auto);
+    UpdateMode update_mode = UpdateMode::Phased;
+    SolverFeatures features;
+    Pipeline pipeline = &Solver::runSubsteps<GeneralPolicy>;
+    std::vector<Emitter> emitters;
+    std::vector<Vector2f> emitted;
+    std::vector<uint32_t> id_to_slot;
+    std::vector<uint32_t> slot_to_id;
+    std::vector<uint32_t> generations;
+    // Free ids in decreasing order, the smallest is reused first
+    std::vector<uint32_t> free_ids;
+    // Ids removed since the last compaction, not free yet
+    std::vector<uint32_t> removed_ids;
+    // Slots of removed objects not compacted away yet
+    uint32_t removed_slots = 0;
+    std::vector<Sink> sinks;
+    bool open_walls = false;
+    LinkStore links;
+    // Per chunk slots to drain, then per chunk offsets of the compaction
+    std::vector<std::vector<uint32_t>> drained;
+    std::vector<uint32_t> chunk_offsets;
+    uint32_t reorder_interval = 0;
+    uint64_t frame_count = 0;
+    float sleep_threshold = 0.0f;
+    uint8_t sleep_substeps = 60;
+    ParticleStore reorder_buffer;
+    std::vector<uint32_t> reorder_order;
+    std::vector<uint32_t> reorder_ids;
+    static constexpr float min_margin = 2.0f;
+    // Smallest radius an object can have
+    static constexpr float min_radius = 1e-3f;
+    // World area, in base cells, above which the grid defaults to sparse storage
+    static constexpr float sparse_grid_area = 4096.0f * 4096.0f;
+    // Fraction of the world covered by objects below which configureGrid picks sparse storage
+    static constexpr float sparse_packing = 0.05f;
+    // Particles per block in the fused pass, small enough to stay in L1/L2
+    static constexpr uint32_t fused_block = 2048;
+    // ParticleStore::rest of a sleeping object
+    static constexpr uint8_t asleep = 255;
+    // Side of a sleep region in base grid cells
+    static constexpr uint32_t sleep_region = 8;
+    // Speed, in sleep thresholds, at which an awake object wakes a sleeper it hits
+    static constexpr float wake_factor = 4.0f;
 
-    void updateObjects(){
-        threadPool.dispatch(objects.size(), [&](uint32_t start, uint32_t end){
-            for(uint32_t i{start}; i < end; i++){
-                VerletObject& v1 = objects[i];
-                v1.update(dt);
+    // Gives the object in slot a free id, or a new one
+    uint32_t bindId(uint32_t slot){
+        uint32_t id;
+        if(free_ids.empty()){
+            id = static_cast<uint32_t>(id_to_slot.size());
+            id_to_slot.push_back(slot);
+            generations.push_back(0);
+        }else{
+            id = free_ids.back();
+            free_ids.pop_back();
+            id_to_slot[id] = slot;
+        }
+        slot_to_id[slot] = id;
+        return id;
+    }
+
+    // Removes objects inside a sink, and outside the world with open walls
+    void drainObjects(){
+        if(sinks.empty() && !open_walls) return;
+        const auto count = static_cast<uint32_t>(objects.size());
+        drained.resize(threadPool.thread_count);
+        threadPool.dispatchIndexed(count, [&](uint32_t chunk, uint32_t start, uint32_t end){
+            std::vector<uint32_t>& out = drained[chunk];
+            out.clear();
+            for(uint32_t slot{start}; slot < end; slot++){
+                if(slot_to_id[slot] == no_slot) continue;
+                const Vector2f p = objects.pos[slot];
+                // Also true for NaN
+                bool drain = open_walls && !(p.x >= 0.0f && p.x <= worldSize.x && p.y >= 0.0f && p.y <= worldSize.y);
+                for(uint32_t k{0}; k < sinks.size() && !drain; k++) drain = sinks[k].enabled && sinks[k].contains(p);
+                if(drain) out.push_back(slot);
             }
         });
+        for(const std::vector<uint32_t>& chunk : drained){
+            for(const uint32_t slot : chunk) removeObject(slot_to_id[slot]);
+        }
     }
 
-    void applyConstraints(){
-        threadPool.dispatch(objects.size(), [&](uint32_t start, uint32_t end){
-            for(uint32_t i{start}; i < end; i++){
-                VerletObject& v1 = objects[i];
-                applySingleConstraint(v1);
+    // Moves the remaining objects down over the removed ones, keeping their order
+    void compactObjects(){
+        const auto count = static_cast<uint32_t>(objects.size());
+        chunk_offsets.assign(threadPool.thread_count + 1, 0);
+        threadPool.dispatchIndexed(count, [&](uint32_t chunk, uint32_t start, uint32_t end){
+            uint32_t alive = 0;
+            for(uint32_t slot{start}; slot < end; slot++) alive += slot_to_id[slot] != no_slot;
+            chunk_offsets[chunk + 1] = alive;
+        });
+        for(uint32_t chunk{0}; chunk < threadPool.thread_count; chunk++) chunk_offsets[chunk + 1] += chunk_offsets[chunk];
+        reorder_order.resize(chunk_offsets.back());
+        threadPool.dispatchIndexed(count, [&](uint32_t chunk, uint32_t start, uint32_t end){
+            uint32_t out = chunk_offsets[chunk];
+            for(uint32_t slot{start}; slot < end; slot++){
+                if(slot_to_id[slot] != no_slot) reorder_order[out++] = slot;
             }
         });
+        gatherObjects(chunk_offsets.back());
+        removed_slots = 0;
+
+        std::sort(removed_ids.begin(), removed_ids.end(), std::greater<>());
+        const auto middle = static_cast<std::ptrdiff_t>(free_ids.size());
+        free_ids.insert(free_ids.end(), removed_ids.begin(), removed_ids.end());
+        std::inplace_merge(free_ids.begin(), free_ids.begin() + middle, free_ids.end(), std::greater<>());
+        removed_ids.clear();
     }
 
-    void applyGravity(){
+    // Radii the solver can hold: NaN, zero and negative radii become
+    // min_radius, anything wider than the world is cut down to fit in it
+    [[nodiscard]]
+    float clampRadius(float radius) const{
+        if(!(radius > min_radius)) return min_radius;
+        return std::min(radius, 0.5f * std::min(worldSize.x, worldSize.y));
+    }
+
+    // Keeps the pipeline, the wall margin and the grid levels fit for an
+    // object of this radius, returns the clamped radius to store
+    float admitRadius(float radius){
+        radius = clampRadius(radius);
+        if(features.uniform_radius > 0.0f && radius != features.uniform_radius){
+            features.uniform_radius = 0.0f;
+            selectPipeline();
+        }
+        if(radius > max_radius){
+            max_radius = radius;
+            grid.setLevelCount(std::max(grid.levelCount(), grid.levelsFor(max_radius)));
+        }
+        return radius;
+    }
+
+    void emitObjects(){
+        for(Emitter& emitter : emitters){
+            emitted.clear();
+            const uint32_t count = emitter.emit(dt, emitted);
+            if(!count) continue;
+            ParticleBatch batch;
+            batch.pos = emitted.data();
+            batch.count = count;
+            batch.default_velocity = emitter.velocity;
+            batch.default_radius = emitter.radius;
+            batch.default_color = emitter.color;
+            addObjects(batch);
+        }
+    }
+
+    // Turns back on the features the current settings need
+    void requireFeatures(){
+        SolverFeatures f = features;
+        f.gravity = f.gravity || gravity.x != 0.0f || gravity.y != 0.0f;
+        f.variable_friction = f.variable_friction || friction != 1.0f;
+        f.long_range = f.long_range || long_range.strength != 0.0f;
+        features = f;
+        selectPipeline();
+    }
+
+    void selectPipeline(){
+        pipeline = pipelines(std::make_integer_sequence<uint32_t, policy_count>{})[features.index()];
+    }
+
+    template<uint32_t... I>
+    static std::array<Pipeline, sizeof...(I)> pipelines(std::integer_sequence<uint32_t, I...>){
+        return {&Solver::runSubsteps<PolicyOf<I>>...};
+    }
+
+    template<typename Policy>
+    void runSubsteps(){
+        if(update_mode == UpdateMode::Fused){
+            updateFused<Policy>();
+        }else{
+            updatePhased<Policy>();
+        }
+    }
+
+    void resetGrid(float base_cell_size, GridStorage storage){
+        grid = HierarchicalGrid{worldSize.x, worldSize.y, base_cell_size, storage};
+        grid.setLevelCount(grid.levelsFor(max_radius));
+    }
+
+    // name labels the phase in the profiler, when it is compiled in
+    template<typename Phase>
+    void timePhase([[maybe_unused]] const char* name, uint64_t& counter, Phase&& phase){
+        PHYSICS_PROFILE_SCOPE(name);
+        if(!time_phases){
+            phase();
+            return;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        phase();
+        counter += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    template<typename Policy>
+    void updatePhased(){
+        for(uint i = 0; i < substep; i++) {
+            if(!emitters.empty()) timePhase("emit", timings.emit, [this]{emitObjects();});
+            if(longRangeDue<Policy>(i)) timePhase("long range", timings.long_range, [this]{computeLongRange();});
+            if(Policy::gravity || Policy::long_range) timePhase("gravity", timings.gravity, [this]{applyGravity<Policy>();});
+            timePhase("constraints", timings.constraints, [this]{applyConstraints();});
+            solveCollisions<Policy>();
+            if(!links.empty()) timePhase("links", timings.links, [this]{solveLinks<Policy>();});
+            timePhase("integration", timings.integration, [this]{updateObjects();});
+        }
+        timings.substeps += substep;
+    }
+
+    // Same per-particle order as the phased path: the integration of substep
+    // k-1 is fused in front of gravity/constraints/insertion of substep k and
+    // the last one runs on its own after the loop. Objects emitted at the
+    // start of substep k are past the integrated range.
+    template<typename Policy>
+    void updateFused(){
+        const float dt2 = dt * dt;
+        Vector2f min, max;
+        constraintBounds(min, max);
+        for(uint i = 0; i < substep; i++) {
+            bool integrate = i > 0;
+            const auto integrated = static_cast<uint32_t>(objects.size());
+            // The field needs integrated positions, so that pass runs on its own here
+            const bool field_due = longRangeDue<Policy>(i);
+            if(field_due){
+                if(integrate) timePhase("integration", timings.integration, [this]{updateObjects();});
+                integrate = false;
+            }
+            if(!emitters.empty()) timePhase("emit", timings.emit, [this]{emitObjects();});
+            if(field_due) timePhase("long range", timings.long_range, [this]{computeLongRange();});
+            const auto count = static_cast<uint32_t>(objects.size());
+            grid.prepare(count, threadPool.thread_count);
+            timePhase("fused", timings.fused, [&]{
+                threadPool.dispatchIndexed(count, [&](uint32_t chunk, uint32_t start, uint32_t end){
+                    for(uint32_t block{start}; block < end; block += fused_block){
+                        const uint32_t block_count = std::min(fused_block, end - block);
+                        if(integrate && block < integrated) integrateRange(block, std::min(block + block_count, integrated), dt2);
+                        forAwake(block, block + block_count, [&](uint32_t run, uint32_t run_end){
+                            if constexpr(Policy::gravity) kernels.accelerate(objects.acc.data() + run, run_end - run, gravity);
+                            applyLongRange<Policy>(run, run_end);
+                            kernels.constrain(objects.pos.data() + run, run_end - run, min, max);
+                        });
+                        grid.countChunk(chunk, objects.pos.data(), objects.radius.data(), block, block + block_count);
+                    }
+                });
+            });
+            timePhase("grid build", timings.grid_build, [this, count]{grid.finish(threadPool, count);});
+            PHYSICS_PROFILE_COUNT(GridOverflow, grid.overflow_count);
+            timePhase("collisions", timings.collisions, [this]{solveGridCollisions<Policy>();});
+            if(!links.empty()) timePhase("links", timings.links, [this]{solveLinks<Policy>();});
+        }
+        timePhase("integration", timings.integration, [this]{updateObjects();});
+        timings.substeps += substep;
+    }
+
+    void updateObjects(){
+        const float dt2 = dt * dt;
         threadPool.dispatch(objects.size(), [&](uint32_t start, uint32_t end){
-            for(uint32_t i{start}; i < end; i++){
-                VerletObject& v1 = objects[i];
-//                applyMagnetismSingle(v1);
-                v1.accelerate(gravity);
+            integrateRange(start, end, dt2);
+        });
+    }
+
+    void integrateRange(uint32_t start, uint32_t end, float dt2){
+        forAwake(start, end, [&](uint32_t run, uint32_t run_end){
+            kernels.integrate(objects.pos.data() + run, objects.pos_prev.data() + run,
+                              objects.acc.data() + run, run_end - run, dt2);
+        });
+        if(sleep_threshold > 0.0f) settle(start, end);
+    }
+
+    // Counts the substeps each awake object moved less than the sleep
+    // threshold, up to sleep_substeps
+    void settle(uint32_t start, uint32_t end){
+        const float threshold = sleepThreshold();
+        const float threshold2 = threshold * threshold;
+        uint8_t* rest = objects.rest.data();
+        for(uint32_t i{start}; i < end; i++){
+            if(rest[i] == asleep) continue;
+            const Vector2f dis = objects.pos[i] - objects.pos_prev[i];
+            if(dis.x * dis.x + dis.y * dis.y >= threshold2){
+                rest[i] = 0;
+            }else if(rest[i] < sleep_substeps){
+                rest[i]++;
+            }
+        }
+    }
+
+    // Objects fall asleep and wake together with their region, one sleeper
+    // pinned among awake neighbors would hold them up without weighing on them
+    void updateSleepRegions(){
+        const CollisionGrid& base = grid.levels[0];
+        if(!gridCovers()) return;
+        const uint32_t columns = (static_cast<uint32_t>(base.width) - 2 + sleep_region - 1) / sleep_region;
+        const uint32_t rows = (static_cast<uint32_t>(base.height) - 2 + sleep_region - 1) / sleep_region;
+        threadPool.dispatch(columns, [this, rows](uint32_t start, uint32_t end){
+            std::vector<uint32_t> occupied;
+            for(uint32_t x{start}; x < end; x++){
+                if(grid.storage == GridStorage::Dense){
+                    for(uint32_t y{0}; y < rows; y++) settleRegion(x, y);
+                    continue;
+                }
+                occupiedRegions(x, occupied);
+                for(const uint32_t y : occupied) settleRegion(x, y);
             }
         });
     }
 
+    // Rows of the regions in a column holding objects, so a sparse grid
+    // does not visit the empty part of the world
+    void occupiedRegions(uint32_t region_x, std::vector<uint32_t>& rows) const{
+        rows.clear();
+        for(uint32_t l{0}; l < grid.levels.size(); l++){
+            const CollisionGrid& level = grid.levels[l];
+            const uint32_t scale = 1u << l;
+            const uint32_t x_begin = (region_x * sleep_region + scale - 1) / scale;
+            const uint32_t x_end = std::min(((region_x + 1) * sleep_region + scale - 1) / scale, static_cast<uint32_t>(level.width - 2));
+            level.forEachCell(x_begin + 1, x_end + 1, 1, level.height - 1, [&](uint32_t, uint32_t y, uint32_t, const Cell&){
+                const uint32_t row = (y - 1) * scale / sleep_region;
+                if(rows.empty() || rows.back() != row) rows.push_back(row);
+            });
+        }
+        std::sort(rows.begin(), rows.end());
+        rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+    }
+
+    // A coarse cell belongs to the region holding its first base cell
+    void settleRegion(uint32_t region_x, uint32_t region_y){
+        bool at_rest = true, any_asleep = false, any_awake = false;
+        forRegionObjects(region_x, region_y, [&](uint32_t object){
+            const uint8_t rest = objects.rest[object];
+            at_rest = at_rest && rest >= sleep_substeps;
+            any_asleep = any_asleep || rest == asleep;
+            any_awake = any_awake || rest != asleep;
+        });
+        if(at_rest && any_awake){
+            forRegionObjects(region_x, region_y, [this](uint32_t object){
+                objects.rest[object] = asleep;
+                objects.pos_prev[object] = objects.pos[object];
+            });
+        }else if(!at_rest && any_asleep){
+            forRegionObjects(region_x, region_y, [this](uint32_t object){
+                if(objects.rest[object] == asleep) objects.rest[object] = 0;
+            });
+        }
+    }
 
-    void applyMagnetismSingle(VerletObject& v1) {
-        Vector2f forces{0.0f, 0.0f};
-        for (VerletObject &v: objects) {
-            Vector2f pos = v.pos - v1.pos;
-            float dist = pos.x * pos.x + pos.y * pos.y;
-            if (pos.x != 0 && pos.y != 0 && dist*dist < 1000.0f) {
-                dist = sqrt(pos.x * pos.x + pos.y * pos.y);
-                pos = pos / dist;
-                float m1{v1.radius};
-                float m2{v.radius};
-                forces += 1000.0f * m1 * m2 * pos / (dist * dist);
+    template<typename Visit>
+    void forRegionObjects(uint32_t region_x, uint32_t region_y, Visit&& visit) const{
+        for(uint32_t l{0}; l < grid.levels.size(); l++){
+            const CollisionGrid& level = grid.levels[l];
+            const uint32_t scale = 1u << l;
+            const uint32_t x_end = std::min(((region_x + 1) * sleep_region + scale - 1) / scale, static_cast<uint32_t>(level.width - 2));
+            const uint32_t y_begin = (region_y * sleep_region + scale - 1) / scale;
+            const uint32_t y_end = std::min(((region_y + 1) * sleep_region + scale - 1) / scale, static_cast<uint32_t>(level.height - 2));
+            if(y_begin >= y_end) continue;
+            for(uint32_t x{(region_x * sleep_region + scale - 1) / scale}; x < x_end; x++){
+                const Cell run = level.columnRun(x + 1, y_begin + 1, y_end + 1);
+                for(uint32_t k{0}; k < run.objects_count; k++) visit(run.objects[k]);
             }
         }
-        v1.accelerate(forces);
+    }
+
+    // The grid is only usable if its last build saw every current object
+    [[nodiscard]]
+    bool gridCovers() const{
+        return grid.levels[0].objects.size() == objects.size();
+    }
+
+    // Falling from rest takes 2 * threshold / (g * dt^2) substeps to move faster
+    // than threshold, capping the threshold keeps that under sleep_substeps so
+    // nothing falls asleep at the top of a jump
+    [[nodiscard]]
+    float sleepThreshold() const{
+        const float g = std::sqrt(gravity.x * gravity.x + gravity.y * gravity.y);
+        if(g == 0.0f) return sleep_threshold;
+        return std::min(sleep_threshold, 0.25f * static_cast<float>(sleep_substeps) * g * dt * dt);
+    }
 
+    // Calls run(begin, end) on every run of consecutive awake objects in
+    // [start, end). Sleepers keep acc at zero and pos_prev at pos, so the
+    // per-object passes have nothing to do for them.
+    template<typename Run>
+    void forAwake(uint32_t start, uint32_t end, Run&& run){
+        if(sleep_threshold == 0.0f){
+            run(start, end);
+            return;
+        }
+        const uint8_t* rest = objects.rest.data();
+        uint32_t i = start;
+        while(i < end){
+            while(i < end && rest[i] == asleep) i++;
+            const uint32_t begin = i;
+            while(i < end && rest[i] != asleep) i++;
+            if(begin < i) run(begin, i);
+        }
     }
 
+    // Objects bigger than the default margin are kept a radius away from the walls
+    [[nodiscard]]
+    float constraintMargin() const{
+        return std::max(min_margin, max_radius);
+    }
 
-    void applySingleConstraint(VerletObject& v){
-        const float margin = 2.0f;
-        if(v.pos.x > worldSize.x - margin)
-            v.pos.x = worldSize.x - margin;
-        else if(v.pos.x < margin)
-            v.pos.x = margin;
-        if(v.pos.y > worldSize.y - margin)
-            v.pos.y = worldSize.y - margin;
-        else if(v.pos.y < margin)
-            v.pos.y = margin;
+    void constraintBounds(Vector2f& min, Vector2f& max) const{
+        const float margin = open_walls ? -std::numeric_limits<float>::infinity() : constraintMargin();
+        min = {margin, margin};
+        max = {worldSize.x - margin, worldSize.y - margin};
     }
 
+    void applyConstraints(){
+        Vector2f min, max;
+        constraintBounds(min, max);
+        threadPool.dispatch(objects.size(), [&](uint32_t start, uint32_t end){
+            forAwake(start, end, [&](uint32_t run, uint32_t run_end){
+                kernels.constrain(objects.pos.data() + run, run_end - run, min, max);
+            });
+        });
+    }
+
+    template<typename Policy>
+    void applyGravity(){
+        threadPool.dispatch(objects.size(), [&](uint32_t start, uint32_t end){
+            forAwake(start, end, [&](uint32_t run, uint32_t run_end){
+                if constexpr(Policy::gravity) kernels.accelerate(objects.acc.data() + run, run_end - run, gravity);
+                applyLongRange<Policy>(run, run_end);
+            });
+        });
+    }
+
+    template<typename Policy>
+    [[nodiscard]]
+    bool longRangeDue(uint32_t sub) const{
+        return Policy::long_range && long_range.strength != 0.0f && (sub == 0 || (long_range_interval && sub % long_range_interval == 0));
+    }
+
+    void computeLongRange(){
+        long_range.compute(threadPool, objects, worldSize);
+    }
+
+    template<typename Policy>
+    // Objects emitted since the field was computed feel nothing until the next one
+    void applyLongRange(uint32_t start, uint32_t end){
+        if(!Policy::long_range || long_range.strength == 0.0f) return;
+        end = std::min(end, static_cast<uint32_t>(long_range.field.size()));
+        for(uint32_t i{start}; i < end; i++){
+            objects.acc[i] += long_range.field[i];
+        }
+    }
+
+    void applySingleConstraint(Vector2f& pos){
+        const float margin = constraintMargin();
+        if(pos.x > worldSize.x - margin)
+            pos.x = worldSize.x - margin;
+        else if(pos.x < margin)
+            pos.x = margin;
+        if(pos.y > worldSize.y - margin)
+            pos.y = worldSize.y - margin;
+        else if(pos.y < margin)
+            pos.y = margin;
+    }
+
+    template<typename Policy>
     void solveCollisions(){
 //        for(uint i = 0; i < objects.size(); i++){
 //            for(uint j = i+1; j < objects.size(); j++){
-//                solveCollision(objects[i], objects[j]);
+//                solveCollision(i, j);
 //            }
 //        }
 
-        addObjectsToGrid();
-        const uint32_t thread_count = threadPool.thread_count;
-        const uint32_t slice_count = thread_count * 2;
-        const uint32_t slice_size = (grid.width / slice_count) * grid.height;
-
-        for(uint32_t i{0}; i < thread_count; i++){
-            threadPool.addTask([this, i, slice_size]{
-                solveCollisions(2 * i, slice_size);
-            });
-        }
-        threadPool.waitForCompletion();
+        timePhase("grid build", timings.grid_build, [this]{addObjectsToGrid();});
+        PHYSICS_PROFILE_COUNT(GridOverflow, grid.overflow_count);
+        timePhase("collisions", timings.collisions, [this]{solveGridCollisions<Policy>();});
+    }
 
-        for(uint32_t i{0}; i < thread_count; i++){
-            threadPool.addTask([this, i, slice_size]{
-                solveCollisions(2 * i + 1, slice_size);
-            });
+    // Tiles of one color run in parallel, colors one after the other
+    template<typename Policy>
+    void solveGridCollisions(){
+        tiles.build(threadPool, grid);
+        for(const std::vector<Tile>& color : tiles.colors){
+            tile_spread.reset(color.size());
+            for(uint32_t t{0}; t < color.size(); t++){
+                threadPool.addTask([this, tile = color[t], t]{
+                    [[maybe_unused]] const auto timer = tile_spread.time(t);
+                    solveTile<Policy>(tile);
+                });
+            }
+            threadPool.waitForCompletion();
+            tile_spread.report();
         }
-        threadPool.waitForCompletion();
-
+    }
 
+    template<typename Policy>
+    [[nodiscard]]
+    float radiusOf(uint32_t i) const{
+        if constexpr(Policy::uniform_radius) return features.uniform_radius;
+        else return objects.radius[i];
     }
 
-    void solveCollision(VerletObject& v1, VerletObject& v2){
-        Vector2f pos = v1.pos - v2.pos;
+    // Masses scale with area, the lighter object takes the larger share of the correction
+    template<typename Policy>
+    void solveCollision(uint32_t i1, uint32_t i2){
+        Vector2f& p1 = objects.pos[i1];
+        Vector2f& p2 = objects.pos[i2];
+        Vector2f pos = p1 - p2;
         float dist = (pos.x) * (pos.x) + (pos.y) * (pos.y);
-//        float min = v1.radius + v2.radius;
-        if(dist < 1.0f){
+        const float r1 = radiusOf<Policy>(i1);
+        const float r2 = radiusOf<Policy>(i2);
+        const float min = r1 + r2;
+        if(dist < min * min){
+            PHYSICS_PROFILE_COUNT(Contacts, 1);
+            uint8_t* rest = objects.rest.data();
+            if(rest[i1] == asleep && rest[i2] == asleep) return;
             dist = sqrt(dist);
             if(dist != 0) {
                 Vector2f n = pos / dist;
-//                float v1_ratio = v1.radius / (v1.radius + v2.radius);
-//                float v2_ratio = v2.radius / (v1.radius + v2.radius);
-                float offset = 0.5f * friction * (dist - 1.0f);
-                v1.pos -= n * offset;
-                v2.pos += n * offset;
+                const float m1 = r1 * r1;
+                const float m2 = r2 * r2;
+                const float offset = Policy::variable_friction ? friction * (dist - min) / (m1 + m2) : (dist - min) / (m1 + m2);
+                if((rest[i1] == asleep || rest[i2] == asleep) && !wakeOnContact(i1, i2)){
+                    if(rest[i2] == asleep) p1 -= n * (offset * m2);
+                    else p2 += n * (offset * m1);
+                    return;
+                }
+                p1 -= n * (offset * m2);
+                p2 += n * (offset * m1);
             }
         }
     }
 
-    void solveCollisions(uint32_t i, uint32_t slice_size){
-        const uint32_t start = i * slice_size;
-        const uint32_t end = (i+1) * slice_size;
-        for(uint32_t index{start}; index < end; index++){
+    // Colors one after the other, the links of a color share no object so
+    // they need no atomics. The serial batch of overconnected objects comes last.
+    template<typename Policy>
+    void solveLinks(){
+        for(uint32_t c{0}; c < links.colorCount(); c++){
+            const uint32_t first = links.color_start[c];
+            threadPool.dispatch(links.color_start[c + 1] - first, [this, first](uint32_t start, uint32_t end){
+                for(uint32_t k{first + start}; k < first + end; k++) solveLink<Policy>(links.bound[k]);
+            });
+        }
+        for(uint32_t k{links.color_start.back()}; k < links.bound.size(); k++) solveLink<Policy>(links.bound[k]);
+    }
+
+    // Same mass split and sleeper handling as a contact
+    template<typename Policy>
+    void solveLink(BoundLink& link){
+        if(link.broken) return;
+        const uint32_t i1 = link.slot_a;
+        const uint32_t i2 = link.slot_b;
+        Vector2f& p1 = objects.pos[i1];
+        Vector2f& p2 = objects.pos[i2];
+        const Vector2f pos = p1 - p2;
+        const float dist = std::sqrt(pos.x * pos.x + pos.y * pos.y);
+        if(link.break_strain > 0.0f && std::abs(dist - link.rest_length) > link.break_strain * link.rest_length){
+            link.broken = 1;
+            return;
+        }
+        const uint8_t* rest = objects.rest.data();
+        if(dist == 0.0f || (rest[i1] == asleep && rest[i2] == asleep)) return;
+        const Vector2f n = pos / dist;
+        const float r1 = radiusOf<Policy>(i1);
+        const float r2 = radiusOf<Policy>(i2);
+        const float m1 = r1 * r1;
+        const float m2 = r2 * r2;
+        const float offset = link.stiffness * (dist - link.rest_length) / (m1 + m2);
+        if((rest[i1] == asleep || rest[i2] == asleep) && !wakeOnContact(i1, i2)){
+            if(rest[i2] == asleep) p1 -= n * (offset * m2);
+            else p2 += n * (offset * m1);
+            return;
+        }
+        p1 -= n * (offset * m2);
+        p2 += n * (offset * m1);
+    }
+
+    // An awake object resting against a sleeper only takes its own share of
+    // the correction, the sleeper stays pinned. One moving wake_factor times faster than the
+    // sleep threshold wakes the sleeper, and at the end of the frame its
+    // region. The margin keeps the slow creep along the edge of a sleeping
+    // region from waking it over and over. Sleepers keep pos_prev at pos, so
+    // they wake without velocity.
+    bool wakeOnContact(uint32_t i1, uint32_t i2){
+        const bool first_asleep = objects.rest[i1] == asleep;
+        const uint32_t awake = first_asleep ? i2 : i1;
+        const Vector2f dis = objects.pos[awake] - objects.pos_prev[awake];
+        const float wake = wake_factor * sleepThreshold();
+        if(dis.x * dis.x + dis.y * dis.y <= wake * wake) return false;
+        objects.rest[first_asleep ? i1 : i2] = 0;
+        return true;
+    }
 
-            solveCell(grid.data[index], index);
+    template<typename Policy>
+    void solveTile(const Tile& tile){
+        if(grid.storage == GridStorage::Sparse){
+            solveTile<Policy, SparseGridConfig>(tile);
+        }else{
+            solveTile<Policy, DenseGridConfig>(tile);
         }
     }
 
-    void solveCell(Cell &cell, uint32_t index) {
+    // Solves the cells of every level lying inside a tile of the coarsest level
+    template<typename Policy, typename Config>
+    void solveTile(const Tile& tile){
+        const auto top = static_cast<uint32_t>(grid.levels.size() - 1);
+        for(uint32_t l{0}; l <= top; l++){
+            const CollisionGrid& level = grid.levels[l];
+            const uint32_t ratio = 1u << (top - l);
+            const uint32_t x_begin = (tile.x_begin - 1) * ratio + 1;
+            const uint32_t x_end = std::min((tile.x_end - 1) * ratio + 1, static_cast<uint32_t>(level.width - 1));
+            const uint32_t y_begin = (tile.y_begin - 1) * ratio + 1;
+            const uint32_t y_end = std::min((tile.y_end - 1) * ratio + 1, static_cast<uint32_t>(level.height - 1));
+            level.forEachNeighborhood<Config>(x_begin, x_end, y_begin, y_end, [&](uint32_t x, uint32_t y, uint32_t, const Cell& cell, const Cell* neighbors){
+                solveCell<Policy, Config>(cell, neighbors);
+                if(l < top) solveCoarserLevels<Policy, Config>(l, cell, x, y);
+            });
+        }
+    }
+
+    // Every pair in a level is met from both sides, so sleepers need not
+    // look for their awake neighbors themselves
+    template<typename Policy, typename Config>
+    void solveCell(const Cell& cell, const Cell* neighbors) {
+        const uint8_t* rest = objects.rest.data();
         for(uint32_t i{0}; i < cell.objects_count; i++){
             const uint32_t object = cell.objects[i];
-            solveCellCollision(object, grid.data[index - 1]);
-            solveCellCollision(object, grid.data[index]);
-            solveCellCollision(object, grid.data[index + 1]);
-            solveCellCollision(object, grid.data[index + grid.height - 1]);
-            solveCellCollision(object, grid.data[index + grid.height]);
-            solveCellCollision(object, grid.data[index + grid.height + 1]);
-            solveCellCollision(object, grid.data[index - grid.height - 1]);
-            solveCellCollision(object, grid.data[index - grid.height]);
-            solveCellCollision(object, grid.data[index - grid.height + 1]);
+            if(rest[object] == asleep) continue;
+            solveNeighborhood<Policy>(object, neighbors, std::make_integer_sequence<uint32_t, Config::neighborhood>{});
+        }
+    }
+
+    // Contacts with bigger objects are only searched from the smaller side
+    template<typename Policy, typename Config>
+    void solveCoarserLevels(uint32_t l, const Cell& cell, uint32_t x, uint32_t y){
+        Cell neighbors[Config::neighborhood];
+        for(uint32_t coarse{l + 1}; coarse < grid.levels.size(); coarse++){
+            const CollisionGrid& level = grid.levels[coarse];
+            const uint32_t shift = coarse - l;
+            level.getNeighborhood<Config>((((x - 1) >> shift) + 1) * level.height + ((y - 1) >> shift) + 1, neighbors);
+            for(uint32_t i{0}; i < cell.objects_count; i++){
+                solveNeighborhood<Policy>(cell.objects[i], neighbors, std::make_integer_sequence<uint32_t, Config::neighborhood>{});
+            }
         }
     }
 
+    // Unrolled over the neighborhood cells
+    template<typename Policy, uint32_t... K>
+    void solveNeighborhood(uint32_t object, const Cell* neighbors, std::integer_sequence<uint32_t, K...>){
+        (solveCellCollision<Policy>(object, neighbors[K]), ...);
+    }
+
+    template<typename Policy>
     void solveCellCollision(uint32_t index, const Cell& cell){
+        PHYSICS_PROFILE_COUNT(PairTests, cell.objects_count);
         for(uint32_t i{0}; i < cell.objects_count; i++){
-            solveCollision(objects[index], objects[cell.objects[i]]);
+            solveCollision<Policy>(index, cell.objects[i]);
         }
     }
 
     void addObjectsToGrid(){
-        grid.clear();
-        uint32_t i = 0;
-//        for(VerletObject& v : objects){
-//            if(v.pos.x > 1.0f && v.pos.x < worldSize.x - 1.0f && v.pos.y > 1.0f && v.pos.y < worldSize.y - 1.0f){
-//                grid.add(static_cast<int32_t>(v.pos.x), static_cast<int32_t>(v.pos.y), i);
-//            }
-//            else{
-//                std::cout << "problem" << std::endl;
-//            }
-//            i++;
-//        }
+        grid.build(threadPool, objects.pos.data(), objects.radius.data(), static_cast<uint32_t>(objects.size()));
+    }
 
-        threadPool.dispatch(objects.size(), [&](uint32_t start, uint32_t end){
-            for(uint32_t i{start}; i < end; i++){
-                VerletObject& v = objects[i];
-                if(v.pos.x > 1.0f && v.pos.x < worldSize.x - 1.0f && v.pos.y > 1.0f && v.pos.y < worldSize.y - 1.0f){
-                    grid.add(static_cast<int32_t>(v.pos.x), static_cast<int32_t>(v.pos.y), i);
-                }
+    // Moves objects that share a grid cell next to each other in memory so the
+    // neighbor loops in solveCell hit cache instead of random indices
+    void reorderObjects(){
+        const auto count = static_cast<uint32_t>(objects.size());
+        addObjectsToGrid();
+        grid.sortedOrder(reorder_order, count);
+        gatherObjects(count);
+    }
+
+    // Moves the objects of slots reorder_order[0, count) to slots [0, count)
+    void gatherObjects(uint32_t count){
+        reorder_buffer.resize(count);
+        reorder_ids.resize(count);
+        threadPool.dispatch(count, [this](uint32_t start, uint32_t end){
+            reorder_buffer.gather(objects, reorder_order.data(), start, end);
+            for(uint32_t slot{start}; slot < end; slot++){
+                const uint32_t id = slot_to_id[reorder_order[slot]];
+                reorder_ids[slot] = id;
+                id_to_slot[id] = slot;
             }
         });
+        std::swap(objects, reorder_buffer);
+        std::swap(slot_to_id, reorder_ids);
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,40 @@
+//
+// Compile-time feature sets of the solver pipeline. Solver instantiates its
+// substep loop once per policy and runs the one matching the scene, so a
+// feature the scene does not use costs no loads or branches in the hot loops.
+//
+
+#pragma once
+#include <cstdint>
+
+// What a scene needs, picked at run time with Solver::setFeatures
+struct SolverFeatures{
+    // Every object has this radius, 0 for per-particle radii
+    float uniform_radius = 0.0f;
+    bool gravity = true;
+    // Friction other than 1 scaling every collision correction
+    bool variable_friction = true;
+    bool long_range = true;
+
+    // Index of the matching policy, see PolicyOf
+    [[nodiscard]]
+    uint32_t index() const{
+        return (uniform_radius > 0.0f ? 1u : 0u) | (gravity ? 2u : 0u) | (variable_friction ? 4u : 0u) | (long_range ? 8u : 0u);
+    }
+};
+
+template<bool UniformRadius, bool Gravity, bool VariableFriction, bool LongRange>
+struct SolverPolicy{
+    static constexpr bool uniform_radius = UniformRadius;
+    static constexpr bool gravity = Gravity;
+    static constexpr bool variable_friction = VariableFriction;
+    static constexpr bool long_range = LongRange;
+};
+
+constexpr uint32_t policy_count = 16;
+
+template<uint32_t Index>
+using PolicyOf = SolverPolicy<(Index & 1) != 0, (Index & 2) != 0, (Index & 4) != 0, (Index & 8) != 0>;
+
+// Handles any scene, what the solver runs until told otherwise
+using GeneralPolicy = SolverPolicy<false, true, true, true>;
@@ -1,102 +1,164 @@
 #pragma once
 
-#include <queue>
+#include <vector>
+#include <memory>
+#include <new>
+#include <cstddef>
+#include <type_traits>
+#include <condition_variable>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include "Profiler.hpp"
 
-struct TaskQueue{
-    std::queue<std::function<void()>> tasks;
-    std::mutex mutex;
-    std::atomic<uint32_t> tasks_remaining{0};
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-    template<typename CallBack>
-    void addTask(CallBack&& cb){
-        std::lock_guard<std::mutex> lock_guard{mutex};
-        tasks.push(std::forward<CallBack>(cb));
-        tasks_remaining++;
-    }
+inline void cpuRelax(){
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#else
+    std::this_thread::yield();
+#endif
+}
 
-    void getTask(std::function<void()>& cb){
-        std::lock_guard<std::mutex> lock_guard{mutex};
-        if(tasks.empty()) return;
-        cb = std::move(tasks.front());
-        tasks.pop();
-    }
+// Type-erased callable stored inline, pushing a task never allocates.
+// Callables must be trivially copyable (lambdas capturing pointers,
+// references and plain values) and fit in the buffer.
+struct Task{
+    static constexpr size_t storage_size = 48;
 
-    static void wait(){
-        std::this_thread::yield();
-    }
+    void (*invoke)(void*) = nullptr;
+    alignas(std::max_align_t) unsigned char storage[storage_size];
 
-    void waitForCompletion() const {
-        while(tasks_remaining > 0) wait();
+    template<typename CallBack>
+    static Task make(CallBack&& cb){
+        using Fn = std::decay_t<CallBack>;
+        static_assert(sizeof(Fn) <= storage_size, "Task callable too big, capture by reference");
+        static_assert(std::is_trivially_copyable<Fn>::value, "Task callable must be trivially copyable");
+        Task task;
+        new (task.storage) Fn(std::forward<CallBack>(cb));
+        task.invoke = [](void* fn){ (*static_cast<Fn*>(fn))(); };
+        return task;
     }
 
-    void workDone(){
-        tasks_remaining--;
+    void operator()(){
+        invoke(storage);
     }
 };
 
-struct Single{
-    uint32_t id;
-    std::thread thread;
-    std::function<void()> task = nullptr;
-    bool running = true;
-    TaskQueue* queue = nullptr;
+// Per-worker deque: the owner pops from the back, thieves take from the front
+struct TaskQueue{
+    std::mutex mutex;
+    std::vector<Task> ring = std::vector<Task>(64);
+    uint32_t head = 0;
+    uint32_t count = 0;
 
-    Single() = default;
+    void push(const Task& task){
+        std::lock_guard<std::mutex> lock_guard{mutex};
+        if(count == ring.size()) grow();
+        ring[(head + count) & (ring.size() - 1)] = task;
+        count++;
+    }
 
-    Single(TaskQueue& queue_, uint32_t id_):
-    queue{&queue_},
-    id{id_} {
-        thread = std::thread([this](){
-            run();
-        });
+    bool popBack(Task& task){
+        std::lock_guard<std::mutex> lock_guard{mutex};
+        if(!count) return false;
+        count--;
+        task = ring[(head + count) & (ring.size() - 1)];
+        return true;
     }
 
-    void run(){
-        while(running){
-            queue->getTask(task);
-            if(task == nullptr){
-                TaskQueue::wait();
-            }else{
-                task();
-                queue->workDone();
-                task = nullptr;
-            }
-        }
+    bool steal(Task& task){
+        std::lock_guard<std::mutex> lock_guard{mutex};
+        if(!count) return false;
+        task = ring[head];
+        head = (head + 1) & (ring.size() - 1);
+        count--;
+        return true;
     }
 
-    void stop(){
-        running = false;
-        thread.join();
+private:
+    void grow(){
+        std::vector<Task> bigger(ring.size() * 2);
+        for(uint32_t i{0}; i < count; i++) bigger[i] = ring[(head + i) & (ring.size() - 1)];
+        ring.swap(bigger);
+        head = 0;
     }
+};
 
+struct Single{
+    std::thread thread;
+    TaskQueue queue;
 };
 
+// Work-stealing pool. Idle workers spin for a bounded number of rounds and
+// then park on a condition variable, so an idle pool uses no CPU. Threads
+// waiting for completion run queued tasks themselves before parking.
 struct ThreadPool{
+    // Idle rounds spent pausing, then yielding, before a thread parks
+    static constexpr uint32_t pause_limit = 64;
+    static constexpr uint32_t spin_limit = 1024;
+
     uint32_t thread_count = 0;
-    TaskQueue queue;
-    std::vector<Single> threads;
 
     explicit ThreadPool(uint32_t thread_count_):
-    thread_count{thread_count_}{
-        threads.reserve(thread_count);
-        for(uint32_t i{thread_count}; i--;){
-            threads.emplace_back(queue, static_cast<uint32_t>(threads.size()));
+    thread_count{thread_count_},
+    workers{new Single[thread_count_]}{
+        for(uint32_t i{0}; i < thread_count; i++){
+            workers[i].thread = std::thread([this, i](){
+                run(i);
+            });
         }
     }
 
     virtual ~ThreadPool(){
-        for(Single& thread : threads){
-            thread.stop();
+        {
+            std::lock_guard<std::mutex> lock_guard{sleep_mutex};
+            running = false;
+        }
+        sleep_cv.notify_all();
+        for(uint32_t i{0}; i < thread_count; i++){
+            workers[i].thread.join();
         }
     }
 
     template<typename CallBack>
     void addTask(CallBack&& cb){
-        queue.addTask(std::forward<CallBack>(cb));
+        tasks_remaining++;
+        // Counted before the push so a concurrent pop can never take it below zero
+        tasks_queued++;
+        const uint32_t target = next_queue.fetch_add(1, std::memory_order_relaxed) % thread_count;
+        workers[target].queue.push(Task::make(std::forward<CallBack>(cb)));
+        if(sleeping > 0){
+            std::lock_guard<std::mutex> lock_guard{sleep_mutex};
+            sleep_cv.notify_one();
+        }
     }
 
-    void waitForCompletion() const{
-        queue.waitForCompletion();
+    void waitForCompletion(){
+        uint32_t spins = 0;
+        Task task;
+        ProfileIdle waiting;
+        while(tasks_remaining > 0){
+            if(tryTake(next_queue.load(std::memory_order_relaxed) % thread_count, task)){
+                waiting.end(ProfileCounter::BarrierWaitNs);
+                execute(task);
+                spins = 0;
+            }else if(++spins < spin_limit){
+                waiting.begin();
+                backoff(spins);
+            }else{
+                waiting.begin();
+                std::unique_lock<std::mutex> lock{done_mutex};
+                done_cv.wait(lock, [this]{ return tasks_remaining == 0 || tasks_queued > 0; });
+                spins = 0;
+            }
+        }
+        waiting.end(ProfileCounter::BarrierWaitNs);
     }
 
     template<typename CallBack>
@@ -114,4 +176,96 @@ struct ThreadPool{
 
         waitForCompletion();
     }
+
+    // Splits the range into exactly thread_count chunks whose bounds only
+    // depend on element_count, and passes the chunk index along
+    template<typename CallBack>
+    void dispatchIndexed(uint32_t element_count, CallBack&& cb){
+        for(uint32_t i{0}; i < thread_count; i++){
+            const auto start = static_cast<uint32_t>(static_cast<uint64_t>(element_count) * i / thread_count);
+            const auto end = static_cast<uint32_t>(static_cast<uint64_t>(element_count) * (i + 1) / thread_count);
+            addTask([i, start, end, &cb] {cb(i, start, end);});
+        }
+        waitForCompletion();
+    }
+
+private:
+    std::unique_ptr<Single[]> workers;
+    std::atomic<uint32_t> tasks_remaining{0};
+    std::atomic<uint32_t> tasks_queued{0};
+    std::atomic<uint32_t> next_queue{0};
+    std::atomic<uint32_t> sleeping{0};
+    bool running = true;
+    std::mutex sleep_mutex;
+    std::condition_variable sleep_cv;
+    std::mutex done_mutex;
+    std::condition_variable done_cv;
+
+    // Own queue first (LIFO, still warm in cache), then steal from the others
+    bool tryTake(uint32_t id, Task& task){
+        if(tasks_queued == 0) return false;
+        if(workers[id].queue.popBack(task)){
+            tasks_queued--;
+            return true;
+        }
+        for(uint32_t i{1}; i < thread_count; i++){
+            if(workers[(id + i) % thread_count].queue.steal(task)){
+                tasks_queued--;
+                PHYSICS_PROFILE_COUNT(TasksStolen, 1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static void backoff(uint32_t spins){
+        if(spins < pause_limit){
+            cpuRelax();
+        }else{
+            std::this_thread::yield();
+        }
+    }
+
+    void execute(Task& task){
+        task();
+        PHYSICS_PROFILE_COUNT(TasksRun, 1);
+        PHYSICS_PROFILE_FLUSH();
+        if(--tasks_remaining == 0){
+            std::lock_guard<std::mutex> lock_guard{done_mutex};
+            done_cv.notify_all();
+        }
+    }
+
+    void park(){
+        std::unique_lock<std::mutex> lock{sleep_mutex};
+        sleeping++;
+        sleep_cv.wait(lock, [this]{ return tasks_queued > 0 || !running; });
+        sleeping--;
+    }
+
+    void run(uint32_t id){
+        PHYSICS_PROFILE_THREAD("worker");
+        uint32_t spins = 0;
+        Task task;
+        ProfileIdle spinning;
+        ProfileIdle parked;
+        while(true){
+            if(tryTake(id, task)){
+                spinning.end(ProfileCounter::WorkerSpinNs);
+                execute(task);
+                spins = 0;
+            }else if(++spins < spin_limit){
+                spinning.begin();
+                backoff(spins);
+            }else{
+                spinning.end(ProfileCounter::WorkerSpinNs);
+                parked.begin();
+                park();
+                parked.end(ProfileCounter::WorkerParkedNs);
+                spins = 0;
+                std::lock_guard<std::mutex> lock_guard{sleep_mutex};
+                if(!running) return;
+            }
+        }
+    }
 };
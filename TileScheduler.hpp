@@ -0,0 +1,144 @@
+//
+// Occupancy-balanced 2D tiling of the collision grid for the parallel solve.
+//
+
+#pragma once
+
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include "ThreadPool.hpp"
+#include "CollisionGrid.hpp"
+
+// Rectangle of coarsest-level cells, in grid coordinates (the border is
+// column/row 0), end exclusive
+struct Tile {
+    uint32_t x_begin = 0, x_end = 0;
+    uint32_t y_begin = 0, y_end = 0;
+};
+
+// Splits the coarsest level into column bands of roughly equal object count
+// and every band into rows of roughly equal object count. Tiles are then run
+// in 4 colors by (band & 1, row & 1). Every tile except the last one of a
+// band or row is at least 2 coarse cells wide, and an object never touches
+// one more than a coarse cell away, so same-colored tiles never share an
+// object even though row cuts differ from band to band.
+struct TileScheduler {
+    static constexpr uint32_t color_count = 4;
+    // Occupancy is counted on bins of at least 2x2 coarse cells, bounded so
+    // the serial split stays cheap on big worlds
+    static constexpr uint32_t max_bins = 256;
+    // Tiles per color and per thread, more than one lets stealing even out
+    // what the occupancy estimate misses
+    static constexpr uint32_t tiles_per_thread = 2;
+
+    std::array<std::vector<Tile>, color_count> colors;
+
+    void build(ThreadPool& pool, const HierarchicalGrid& grid){
+        const CollisionGrid& top = grid.levels.back();
+        columns = static_cast<uint32_t>(top.width - 2);
+        rows = static_cast<uint32_t>(top.height - 2);
+        bin = std::max(2u, (std::max(columns, rows) + max_bins - 1) / max_bins);
+        bins_x = (columns + bin - 1) / bin;
+        bins_y = (rows + bin - 1) / bin;
+
+        occupancy.resize(static_cast<size_t>(bins_x) * bins_y);
+        pool.dispatchIndexed(bins_x, [&](uint32_t, uint32_t start, uint32_t end){
+            countBins(grid, start, end);
+        });
+
+        const uint32_t threads = pool.thread_count;
+        const uint32_t bands = std::min(bins_x, 2 * threads);
+        const uint32_t tile_rows = std::min(bins_y, (color_count * tiles_per_thread * threads + bands - 1) / bands);
+
+        weights.assign(bins_x, 0);
+        for(uint32_t bx{0}; bx < bins_x; bx++){
+            for(uint32_t by{0}; by < bins_y; by++) weights[bx] += occupancy[bx * bins_y + by];
+        }
+        split(weights, bands, x_cuts);
+
+        for(auto& color : colors) color.clear();
+        for(uint32_t band{0}; band < bands; band++){
+            weights.assign(bins_y, 0);
+            for(uint32_t bx{x_cuts[band]}; bx < x_cuts[band + 1]; bx++){
+                for(uint32_t by{0}; by < bins_y; by++) weights[by] += occupancy[bx * bins_y + by];
+            }
+            split(weights, tile_rows, y_cuts);
+            for(uint32_t row{0}; row < tile_rows; row++){
+                uint32_t objects = 0;
+                for(uint32_t by{y_cuts[row]}; by < y_cuts[row + 1]; by++) objects += weights[by];
+                if(!objects) continue;
+                const Tile tile{
+                    1 + x_cuts[band] * bin, 1 + std::min(x_cuts[band + 1] * bin, columns),
+                    1 + y_cuts[row] * bin, 1 + std::min(y_cuts[row + 1] * bin, rows)
+                };
+                colors[(band & 1) | ((row & 1) << 1)].push_back(tile);
+            }
+        }
+    }
+
+private:
+    uint32_t columns = 0, rows = 0;
+    uint32_t bin = 2;
+    uint32_t bins_x = 0, bins_y = 0;
+    // Objects of every level per bin, column major like the grids
+    std::vector<uint32_t> occupancy;
+    std::vector<uint32_t> weights;
+    std::vector<uint32_t> x_cuts;
+    std::vector<uint32_t> y_cuts;
+
+    // Cells of a grid column are contiguous in objects, so the count of any
+    // run of rows is a difference of two cell_start entries. Sparse levels
+    // add up their occupied cells instead of looking at every bin.
+    void countBins(const HierarchicalGrid& grid, uint32_t bx_begin, uint32_t bx_end){
+        std::fill(occupancy.begin() + bx_begin * bins_y, occupancy.begin() + bx_end * bins_y, 0);
+        const auto top = static_cast<uint32_t>(grid.levels.size() - 1);
+        for(uint32_t l{0}; l <= top; l++){
+            const CollisionGrid& level = grid.levels[l];
+            const uint32_t span = bin << (top - l);
+            const auto level_columns = static_cast<uint32_t>(level.width - 2);
+            const auto level_rows = static_cast<uint32_t>(level.height - 2);
+            if(level.storage == GridStorage::Sparse){
+                const uint32_t x_begin = std::min(bx_begin * span, level_columns);
+                const uint32_t x_end = std::min(bx_end * span, level_columns);
+                level.forEachCell(x_begin + 1, x_end + 1, 1, level_rows + 1, [&](uint32_t x, uint32_t y, uint32_t, const Cell& cell){
+                    occupancy[(x - 1) / span * bins_y + (y - 1) / span] += cell.objects_count;
+                });
+                continue;
+            }
+            for(uint32_t bx{bx_begin}; bx < bx_end; bx++){
+                const uint32_t x_end = std::min((bx + 1) * span, level_columns);
+                for(uint32_t x{bx * span}; x < x_end; x++){
+                    for(uint32_t by{0}; by < bins_y; by++){
+                        const uint32_t y_begin = std::min(by * span, level_rows);
+                        const uint32_t y_end = std::min((by + 1) * span, level_rows);
+                        occupancy[bx * bins_y + by] += level.columnRun(x + 1, y_begin + 1, y_end + 1).objects_count;
+                    }
+                }
+            }
+        }
+    }
+
+    // Cuts weights into parts of at least one bin each, every bin also counts
+    // for one object so empty stretches still get spread out
+    static void split(const std::vector<uint32_t>& weights, uint32_t parts, std::vector<uint32_t>& cuts){
+        const auto n = static_cast<uint32_t>(weights.size());
+        uint64_t total = n;
+        for(const uint32_t w : weights) total += w;
+
+        cuts.assign(parts + 1, n);
+        cuts[0] = 0;
+        uint64_t prefix = 0;
+        uint32_t i = 0;
+        for(uint32_t part{1}; part < parts; part++){
+            const uint64_t target = total * part / parts;
+            const uint32_t last = n - (parts - part);
+            while(i < last && (i < cuts[part - 1] + 1 || prefix < target)){
+                prefix += weights[i] + 1;
+                i++;
+            }
+            cuts[part] = i;
+        }
+    }
+};
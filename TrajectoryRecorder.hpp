@@ -0,0 +1,425 @@
+//
+// Asynchronous compressed recording of particle positions, one frame per
+// Solver::update(), and a reader that can seek to any recorded frame.
+//
+
+#pragma once
+
+#include <cstdio>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include "SFML/Graphics.hpp"
+#include "MappedFile.hpp"
+#include "ThreadPool.hpp"
+
+using sf::Vector2f;
+
+// Layout: TrajectoryHeader, then one chunk per frame, then an index chunk
+// holding the offset of every frame chunk and a TrajectoryTrailer pointing
+// at it. Positions are stored by object id, quantized to precision_bits of
+// fixed point over the world size and written as zigzag varint deltas
+// against the previous frame, keyframes are deltas against zero. A file
+// cut short by a crash has no trailer, the reader then finds the frames by
+// walking the chunk headers.
+struct TrajectoryHeader {
+    static constexpr char magic_value[8] = {'P', 'H', 'Y', 'S', 'T', 'R', 'A', 'J'};
+    static constexpr uint32_t current_version = 1;
+    static constexpr uint32_t byte_order_value = 0x01020304;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t precision_bits;
+    uint32_t keyframe_interval;
+    Vector2f world_size;
+};
+
+struct TrajectoryChunk {
+    static constexpr uint32_t frame_tag = 0x4D415246; // "FRAM"
+    static constexpr uint32_t index_tag = 0x58444E49; // "INDX"
+    static constexpr uint32_t keyframe = 1;
+
+    uint32_t tag;
+    uint32_t flags;
+    // Solver frame counter when the frame was captured
+    uint64_t frame;
+    uint32_t object_count;
+    uint32_t payload_bytes;
+};
+
+struct TrajectoryTrailer {
+    static constexpr char magic_value[8] = {'P', 'H', 'Y', 'S', 'T', 'E', 'N', 'D'};
+
+    uint64_t index_offset;
+    uint64_t frame_count;
+    char magic[8];
+};
+
+struct TrajectoryQuantizer {
+    Vector2f scale;
+    Vector2f inv_scale;
+    uint32_t max_value = 0;
+
+    TrajectoryQuantizer() = default;
+
+    TrajectoryQuantizer(Vector2f world_size, uint32_t precision_bits):
+    max_value{static_cast<uint32_t>((uint64_t{1} << precision_bits) - 1)}{
+        scale = {static_cast<float>(max_value) / world_size.x, static_cast<float>(max_value) / world_size.y};
+        inv_scale = {1.0f / scale.x, 1.0f / scale.y};
+    }
+
+    // Clamps to the world, NaN ends up at 0
+    [[nodiscard]]
+    uint32_t quantize(float v, float s) const {
+        const float q = v * s + 0.5f;
+        return q > 0.0f ? static_cast<uint32_t>(std::min(q, static_cast<float>(max_value))) : 0u;
+    }
+
+    static uint32_t zigzag(int32_t v){
+        return (static_cast<uint32_t>(v) << 1) ^ static_cast<uint32_t>(v >> 31);
+    }
+
+    static int32_t unzigzag(uint32_t v){
+        return static_cast<int32_t>(v >> 1) ^ -static_cast<int32_t>(v & 1);
+    }
+
+    static void putVarint(std::vector<uint8_t>& out, uint32_t v){
+        while(v >= 0x80){
+            out.push_back(static_cast<uint8_t>(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back(static_cast<uint8_t>(v));
+    }
+
+    // Returns false when the varint runs past end
+    static bool getVarint(const uint8_t*& in, const uint8_t* end, uint32_t& v){
+        v = 0;
+        for(uint32_t shift{0}; shift < 35 && in < end; shift += 7){
+            const uint8_t byte = *in++;
+            v |= static_cast<uint32_t>(byte & 0x7F) << shift;
+            if(!(byte & 0x80)) return true;
+        }
+        return false;
+    }
+};
+
+// capture() only gathers the positions into a free buffer of a preallocated
+// ring, a writer thread quantizes, encodes and writes them. capture() blocks
+// when every buffer is still waiting to be written, so no frame is dropped.
+struct TrajectoryRecorder {
+    TrajectoryRecorder() = default;
+    TrajectoryRecorder(const TrajectoryRecorder&) = delete;
+    TrajectoryRecorder& operator=(const TrajectoryRecorder&) = delete;
+
+    ~TrajectoryRecorder(){
+        close();
+    }
+
+    bool open(const std::string& path, Vector2f world_size, uint32_t precision_bits = 16,
+              uint32_t keyframe_interval = 60, uint32_t buffer_count = 4){
+        close();
+        file = std::fopen(path.c_str(), "wb");
+        if(!file) return false;
+        TrajectoryHeader header{};
+        std::memcpy(header.magic, TrajectoryHeader::magic_value, sizeof(header.magic));
+        header.version = TrajectoryHeader::current_version;
+        header.byte_order = TrajectoryHeader::byte_order_value;
+        header.precision_bits = std::clamp(precision_bits, 1u, 31u);
+        header.keyframe_interval = std::max(keyframe_interval, 1u);
+        header.world_size = world_size;
+        quantizer = TrajectoryQuantizer{world_size, header.precision_bits};
+        keyframes = header.keyframe_interval;
+        failed = std::fwrite(&header, sizeof(header), 1, file) != 1;
+        offset = sizeof(header);
+
+        buffers.assign(std::max(buffer_count, 1u), FrameBuffer{});
+        next_fill = next_write = filled = 0;
+        frames_written = 0;
+        frame_offsets.clear();
+        prev_x.clear();
+        prev_y.clear();
+        closing = false;
+        writer = std::thread([this]{ run(); });
+        return true;
+    }
+
+    // pos is indexed by slot, id_to_slot maps the id_count stable ids to slots.
+    // Ids mapped to UINT32_MAX have no object, they are recorded as NaN and
+    // read back as 0.
+    void capture(ThreadPool& pool, const Vector2f* pos, const uint32_t* id_to_slot, uint32_t id_count, uint64_t frame){
+        if(!file) return;
+        {
+            std::unique_lock<std::mutex> lock{mutex};
+            buffer_free.wait(lock, [this]{ return filled < buffers.size(); });
+        }
+        FrameBuffer& buffer = buffers[next_fill];
+        buffer.pos.resize(id_count);
+        buffer.frame = frame;
+        pool.dispatch(id_count, [&](uint32_t start, uint32_t end){
+            for(uint32_t id{start}; id < end; id++){
+                const uint32_t slot = id_to_slot[id];
+                buffer.pos[id] = slot != UINT32_MAX ? pos[slot] : Vector2f{std::nanf(""), std::nanf("")};
+            }
+        });
+        next_fill = (next_fill + 1) % static_cast<uint32_t>(buffers.size());
+        {
+            std::lock_guard<std::mutex> lock_guard{mutex};
+            filled++;
+        }
+        buffer_filled.notify_one();
+    }
+
+    // Writes the pending frames, the index and the trailer
+    void close(){
+        if(!file) return;
+        {
+            std::lock_guard<std::mutex> lock_guard{mutex};
+            closing = true;
+        }
+        buffer_filled.notify_one();
+        writer.join();
+
+        TrajectoryChunk index{TrajectoryChunk::index_tag, 0, frames_written, 0,
+                              static_cast<uint32_t>(frame_offsets.size() * sizeof(uint64_t))};
+        TrajectoryTrailer trailer{offset, frames_written, {}};
+        std::memcpy(trailer.magic, TrajectoryTrailer::magic_value, sizeof(trailer.magic));
+        bool ok = std::fwrite(&index, sizeof(index), 1, file) == 1
+                  && (frame_offsets.empty() || std::fwrite(frame_offsets.data(), sizeof(uint64_t), frame_offsets.size(), file) == frame_offsets.size())
+                  && std::fwrite(&trailer, sizeof(trailer), 1, file) == 1;
+        ok = std::fclose(file) == 0 && ok;
+        failed = failed || !ok;
+        file = nullptr;
+    }
+
+    [[nodiscard]]
+    bool good() const {
+        return !failed;
+    }
+
+    // Frames encoded so far, updated by the writer thread
+    [[nodiscard]]
+    uint64_t framesWritten() const {
+        return frames_written;
+    }
+
+private:
+    struct FrameBuffer {
+        std::vector<Vector2f> pos;
+        uint64_t frame = 0;
+    };
+
+    std::FILE* file = nullptr;
+    TrajectoryQuantizer quantizer;
+    uint32_t keyframes = 60;
+    std::vector<FrameBuffer> buffers;
+    uint32_t next_fill = 0;
+    uint32_t next_write = 0;
+    uint32_t filled = 0;
+    bool closing = false;
+    std::mutex mutex;
+    std::condition_variable buffer_free;
+    std::condition_variable buffer_filled;
+    std::thread writer;
+
+    // Writer thread state
+    std::atomic<uint64_t> frames_written{0};
+    std::atomic<bool> failed{false};
+    uint64_t offset = 0;
+    std::vector<uint64_t> frame_offsets;
+    std::vector<uint32_t> prev_x;
+    std::vector<uint32_t> prev_y;
+    std::vector<uint8_t> payload;
+
+    void run(){
+        while(true){
+            {
+                std::unique_lock<std::mutex> lock{mutex};
+                buffer_filled.wait(lock, [this]{ return filled > 0 || closing; });
+                if(!filled) return;
+            }
+            encode(buffers[next_write]);
+            next_write = (next_write + 1) % static_cast<uint32_t>(buffers.size());
+            {
+                std::lock_guard<std::mutex> lock_guard{mutex};
+                filled--;
+            }
+            buffer_free.notify_one();
+        }
+    }
+
+    void encode(const FrameBuffer& buffer){
+        const auto count = static_cast<uint32_t>(buffer.pos.size());
+        const bool keyframe = frames_written % keyframes == 0;
+        if(keyframe){
+            prev_x.assign(count, 0);
+            prev_y.assign(count, 0);
+        }else{
+            // Objects spawned since the last frame start from zero
+            prev_x.resize(count, 0);
+            prev_y.resize(count, 0);
+        }
+
+        payload.clear();
+        for(uint32_t id{0}; id < count; id++){
+            const uint32_t x = quantizer.quantize(buffer.pos[id].x, quantizer.scale.x);
+            const uint32_t y = quantizer.quantize(buffer.pos[id].y, quantizer.scale.y);
+            TrajectoryQuantizer::putVarint(payload, TrajectoryQuantizer::zigzag(static_cast<int32_t>(x - prev_x[id])));
+            TrajectoryQuantizer::putVarint(payload, TrajectoryQuantizer::zigzag(static_cast<int32_t>(y - prev_y[id])));
+            prev_x[id] = x;
+            prev_y[id] = y;
+        }
+
+        const TrajectoryChunk chunk{TrajectoryChunk::frame_tag, keyframe ? TrajectoryChunk::keyframe : 0u,
+                                    buffer.frame, count, static_cast<uint32_t>(payload.size())};
+        const bool ok = std::fwrite(&chunk, sizeof(chunk), 1, file) == 1
+                        && (payload.empty() || std::fwrite(payload.data(), 1, payload.size(), file) == payload.size());
+        if(!ok) failed = true;
+        frame_offsets.push_back(offset);
+        offset += sizeof(chunk) + payload.size();
+        frames_written++;
+    }
+};
+
+struct TrajectoryReader {
+    bool open(const std::string& path){
+        frame_offsets.clear();
+        decoded_frame = invalid_frame;
+        if(!file.open(path) || file.size() < sizeof(TrajectoryHeader)) return false;
+        std::memcpy(&header, file.data(), sizeof(header));
+        if(std::memcmp(header.magic, TrajectoryHeader::magic_value, sizeof(header.magic)) != 0
+           || header.version != TrajectoryHeader::current_version
+           || header.byte_order != TrajectoryHeader::byte_order_value
+           || !header.precision_bits || header.precision_bits > 31){
+            file.close();
+            return false;
+        }
+        quantizer = TrajectoryQuantizer{header.world_size, header.precision_bits};
+        if(!readIndex()) scanChunks();
+        return true;
+    }
+
+    [[nodiscard]]
+    uint64_t frameCount() const {
+        return frame_offsets.size();
+    }
+
+    [[nodiscard]]
+    Vector2f worldSize() const {
+        return header.world_size;
+    }
+
+    // Solver frame counter of a recorded frame
+    [[nodiscard]]
+    uint64_t solverFrame(uint64_t index) const {
+        return chunkAt(index).frame;
+    }
+
+    // Positions by object id of recorded frame index, decoding forward from
+    // the closest keyframe unless the previous call already got close
+    bool readFrame(uint64_t index, std::vector<Vector2f>& pos){
+        if(index >= frame_offsets.size()) return false;
+        uint64_t start = index;
+        while(!(chunkAt(start).flags & TrajectoryChunk::keyframe) && start > 0) start--;
+        if(decoded_frame != invalid_frame && decoded_frame <= index && decoded_frame >= start){
+            start = decoded_frame + 1;
+        }
+        for(uint64_t f{start}; f <= index; f++){
+            if(!decode(f)){
+                decoded_frame = invalid_frame;
+                return false;
+            }
+            decoded_frame = f;
+        }
+        pos.resize(current_x.size());
+        for(uint32_t id{0}; id < current_x.size(); id++){
+            pos[id] = {static_cast<float>(current_x[id]) * quantizer.inv_scale.x,
+                       static_cast<float>(current_y[id]) * quantizer.inv_scale.y};
+        }
+        return true;
+    }
+
+private:
+    static constexpr uint64_t invalid_frame = ~uint64_t{0};
+
+    MappedFile file;
+    TrajectoryHeader header{};
+    TrajectoryQuantizer quantizer;
+    std::vector<uint64_t> frame_offsets;
+    uint64_t decoded_frame = invalid_frame;
+    std::vector<uint32_t> current_x;
+    std::vector<uint32_t> current_y;
+
+    [[nodiscard]]
+    TrajectoryChunk chunkAt(uint64_t index) const {
+        TrajectoryChunk chunk{};
+        std::memcpy(&chunk, file.data() + frame_offsets[index], sizeof(chunk));
+        return chunk;
+    }
+
+    bool readIndex(){
+        if(file.size() < sizeof(TrajectoryHeader) + sizeof(TrajectoryTrailer)) return false;
+        TrajectoryTrailer trailer{};
+        std::memcpy(&trailer, file.data() + file.size() - sizeof(trailer), sizeof(trailer));
+        if(std::memcmp(trailer.magic, TrajectoryTrailer::magic_value, sizeof(trailer.magic)) != 0
+           || trailer.index_offset > file.size() - sizeof(TrajectoryChunk) - sizeof(trailer)
+           || trailer.frame_count > (file.size() - trailer.index_offset - sizeof(TrajectoryChunk) - sizeof(trailer)) / sizeof(uint64_t)){
+            return false;
+        }
+        frame_offsets.resize(trailer.frame_count);
+        if(trailer.frame_count){
+            std::memcpy(frame_offsets.data(), file.data() + trailer.index_offset + sizeof(TrajectoryChunk),
+                        trailer.frame_count * sizeof(uint64_t));
+        }
+        for(const uint64_t frame_offset : frame_offsets){
+            if(frame_offset > trailer.index_offset - sizeof(TrajectoryChunk)){
+                frame_offsets.clear();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Recovers the frames of a file that was not closed, up to the last complete chunk
+    void scanChunks(){
+        uint64_t at = sizeof(TrajectoryHeader);
+        while(at + sizeof(TrajectoryChunk) <= file.size()){
+            TrajectoryChunk chunk{};
+            std::memcpy(&chunk, file.data() + at, sizeof(chunk));
+            if(chunk.tag != TrajectoryChunk::frame_tag || chunk.payload_bytes > file.size() - at - sizeof(chunk)) break;
+            frame_offsets.push_back(at);
+            at += sizeof(chunk) + chunk.payload_bytes;
+        }
+    }
+
+    bool decode(uint64_t index){
+        const TrajectoryChunk chunk = chunkAt(index);
+        if(chunk.tag != TrajectoryChunk::frame_tag
+           || chunk.payload_bytes > file.size() - frame_offsets[index] - sizeof(chunk)){
+            return false;
+        }
+        if(chunk.flags & TrajectoryChunk::keyframe){
+            current_x.assign(chunk.object_count, 0);
+            current_y.assign(chunk.object_count, 0);
+        }else{
+            current_x.resize(chunk.object_count, 0);
+            current_y.resize(chunk.object_count, 0);
+        }
+        const uint8_t* in = file.data() + frame_offsets[index] + sizeof(chunk);
+        const uint8_t* end = in + chunk.payload_bytes;
+        for(uint32_t id{0}; id < chunk.object_count; id++){
+            uint32_t dx, dy;
+            if(!TrajectoryQuantizer::getVarint(in, end, dx) || !TrajectoryQuantizer::getVarint(in, end, dy)) return false;
+            current_x[id] += static_cast<uint32_t>(TrajectoryQuantizer::unzigzag(dx));
+            current_y[id] += static_cast<uint32_t>(TrajectoryQuantizer::unzigzag(dy));
+        }
+        return true;
+    }
+};
@@ -0,0 +1,69 @@
+//
+// Triple buffer handing whole frames from one producer thread to one
+// consumer thread through a lock-free index swap.
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+
+// The producer fills back(), publish() swaps it with the shared middle slot.
+// The consumer's acquire() swaps the middle slot with front() when it holds a
+// newer frame. The swaps are lock-free and never wait for the other side: a
+// frame published before the consumer got to the previous one replaces it.
+// Only the timed acquire parks on wait_mutex and the condition variable,
+// which publish() briefly locks to notify it. The three values
+// are reused forever, so the producer only allocates when a frame outgrows
+// the capacity a buffer already has.
+template<typename T>
+struct TripleBuffer {
+    // Producer side
+    T& back(){
+        return buffers[back_index];
+    }
+
+    void publish(){
+        back_index = middle.exchange(back_index | fresh_bit, std::memory_order_acq_rel) & index_mask;
+        {
+            // Empty critical section so a consumer between its check and its wait sees the notify
+            std::lock_guard<std::mutex> lock{wait_mutex};
+        }
+        published.notify_one();
+    }
+
+    // Consumer side, true if front() changed
+    bool acquire(){
+        if(!(middle.load(std::memory_order_relaxed) & fresh_bit)) return false;
+        front_index = middle.exchange(front_index, std::memory_order_acq_rel) & index_mask;
+        return true;
+    }
+
+    // acquire() that blocks up to timeout for a new frame
+    template<typename Rep, typename Period>
+    bool acquire(std::chrono::duration<Rep, Period> timeout){
+        if(acquire()) return true;
+        std::unique_lock<std::mutex> lock{wait_mutex};
+        published.wait_for(lock, timeout, [this]{ return (middle.load(std::memory_order_relaxed) & fresh_bit) != 0; });
+        lock.unlock();
+        return acquire();
+    }
+
+    const T& front() const {
+        return buffers[front_index];
+    }
+
+private:
+    static constexpr uint32_t index_mask = 3;
+    static constexpr uint32_t fresh_bit = 4;
+
+    T buffers[3];
+    uint32_t back_index = 0;
+    uint32_t front_index = 1;
+    std::atomic<uint32_t> middle{2};
+    std::mutex wait_mutex;
+    std::condition_variable published;
+};
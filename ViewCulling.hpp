@@ -0,0 +1,214 @@
+//
+// Visibility culling and density splats for drawing, both read the collision
+// grid of the last substep so their cost follows what is on screen instead
+// of the object count.
+//
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <numeric>
+#include <algorithm>
+#include "SFML/Graphics.hpp"
+#include "ParticleStore.hpp"
+#include "CollisionGrid.hpp"
+#include "ThreadPool.hpp"
+
+// Interior cells of one grid level overlapping a world rectangle
+struct CellRange {
+    int32_t x0 = 0, y0 = 0, x1 = -1, y1 = -1;
+
+    // margin extra cells on every side, clamped to the grid
+    CellRange(const CollisionGrid& level, const sf::FloatRect& rect, int32_t margin){
+        const float inv = level.inv_cell_size;
+        x0 = std::max(static_cast<int32_t>(std::floor(rect.left * inv)) - margin, 0);
+        y0 = std::max(static_cast<int32_t>(std::floor(rect.top * inv)) - margin, 0);
+        x1 = std::min(static_cast<int32_t>(std::floor((rect.left + rect.width) * inv)) + margin, level.width - 3);
+        y1 = std::min(static_cast<int32_t>(std::floor((rect.top + rect.height) * inv)) + margin, level.height - 3);
+    }
+
+    [[nodiscard]]
+    bool empty() const {
+        return x0 > x1 || y0 > y1;
+    }
+
+    // Cells are stored column by column, so rows y0..y1 of a column are one
+    // contiguous run of the level's object array
+    [[nodiscard]]
+    Cell column(const CollisionGrid& level, int32_t x) const {
+        return level.columnRun(static_cast<uint32_t>(x + 1), static_cast<uint32_t>(y0 + 1), static_cast<uint32_t>(y1 + 2));
+    }
+};
+
+// The grid is only usable if its last build saw every current object
+inline bool gridCovers(const HierarchicalGrid& grid, uint32_t object_count){
+    return !grid.levels.empty() && grid.levels[0].objects.size() == object_count;
+}
+
+// Slots of the objects whose grid cell overlaps a view rectangle, gathered
+// column by column. Every level's object diameter fits in one of its cells
+// and objects move less than a cell per substep, so a one cell margin keeps
+// every object that can reach into the view.
+struct VisibleObjects {
+    std::vector<uint32_t> slots;
+
+    void collect(ThreadPool& pool, const HierarchicalGrid& grid, const sf::FloatRect& view, uint32_t object_count){
+        // Nothing to cull when the whole world is in view, slot order is also
+        // the cheaper one to read the particle arrays in
+        const bool whole_world = view.left <= 0.0f && view.top <= 0.0f
+                                 && view.left + view.width >= grid.world_width && view.top + view.height >= grid.world_height;
+        if(whole_world || !gridCovers(grid, object_count)){
+            all(object_count);
+            return;
+        }
+        columns.clear();
+        uint32_t total = 0;
+        for(const CollisionGrid& level : grid.levels){
+            const CellRange range{level, view, 1};
+            if(range.empty()) continue;
+            for(int32_t x{range.x0}; x <= range.x1; x++){
+                const Cell cell = range.column(level, x);
+                if(!cell.objects_count) continue;
+                columns.push_back({cell, total});
+                total += cell.objects_count;
+            }
+        }
+        slots.resize(total);
+        pool.dispatch(static_cast<uint32_t>(columns.size()), [this](uint32_t start, uint32_t end){
+            for(uint32_t c{start}; c < end; c++){
+                const Column& column = columns[c];
+                std::copy_n(column.cell.objects, column.cell.objects_count, slots.data() + column.offset);
+            }
+        });
+    }
+
+    // Every object in slot order, for when there is no usable grid
+    void all(uint32_t object_count){
+        slots.resize(object_count);
+        std::iota(slots.begin(), slots.end(), 0u);
+    }
+
+    [[nodiscard]]
+    uint32_t size() const {
+        return static_cast<uint32_t>(slots.size());
+    }
+
+private:
+    struct Column {
+        Cell cell;
+        uint32_t offset;
+    };
+    std::vector<Column> columns;
+};
+
+// Zoomed-out stand-in for per-object quads: the view is cut into square
+// blocks of whole base grid cells and every block holding objects becomes one
+// untextured quad with their average color, its opacity the fraction of the
+// block their discs cover.
+struct DensitySplat {
+    // Writes the quads to vertices, block_size is in world units
+    void build(ThreadPool& pool, const HierarchicalGrid& grid, const ParticleStore& objects, const sf::FloatRect& view,
+               float block_size, std::vector<sf::Vertex>& vertices){
+        vertices.clear();
+        if(!gridCovers(grid, static_cast<uint32_t>(objects.size()))) return;
+        size = block_size;
+        bx0 = std::max(static_cast<int32_t>(std::floor(view.left / size)), 0);
+        by0 = std::max(static_cast<int32_t>(std::floor(view.top / size)), 0);
+        const int32_t bx1 = static_cast<int32_t>(std::ceil(std::min(view.left + view.width, grid.world_width) / size));
+        const int32_t by1 = static_cast<int32_t>(std::ceil(std::min(view.top + view.height, grid.world_height) / size));
+        if(bx1 <= bx0 || by1 <= by0) return;
+        blocks_x = static_cast<uint32_t>(bx1 - bx0);
+        blocks_y = static_cast<uint32_t>(by1 - by0);
+        blocks.resize(static_cast<size_t>(blocks_x) * blocks_y);
+        column_quads.resize(blocks_x + 1);
+
+        // Each task owns a band of block columns and takes the grid columns whose center falls in it
+        pool.dispatch(blocks_x, [&](uint32_t start, uint32_t end){
+            std::fill(blocks.begin() + static_cast<size_t>(start) * blocks_y, blocks.begin() + static_cast<size_t>(end) * blocks_y, Block{});
+            const sf::FloatRect band{static_cast<float>(bx0 + static_cast<int32_t>(start)) * size, view.top,
+                                     static_cast<float>(end - start) * size, view.height};
+            for(const CollisionGrid& level : grid.levels){
+                const CellRange range{level, band, 1};
+                if(range.empty()) continue;
+                for(int32_t x{range.x0}; x <= range.x1; x++){
+                    const int32_t center = static_cast<int32_t>(std::floor((static_cast<float>(x) + 0.5f) * level.cell_size / size)) - bx0;
+                    if(center < static_cast<int32_t>(start) || center >= static_cast<int32_t>(end)) continue;
+                    const Cell cell = range.column(level, x);
+                    for(uint32_t k{0}; k < cell.objects_count; k++){
+                        accumulate(objects, cell.objects[k], start, end);
+                    }
+                }
+            }
+            for(uint32_t bx{start}; bx < end; bx++){
+                uint32_t quads = 0;
+                for(uint32_t by{0}; by < blocks_y; by++){
+                    quads += blocks[bx * blocks_y + by].count != 0;
+                }
+                column_quads[bx] = quads;
+            }
+        });
+
+        uint32_t running = 0;
+        for(uint32_t bx{0}; bx < blocks_x; bx++){
+            const uint32_t quads = column_quads[bx];
+            column_quads[bx] = running;
+            running += quads;
+        }
+        vertices.resize(static_cast<size_t>(running) * 4);
+
+        pool.dispatch(blocks_x, [this, &vertices](uint32_t start, uint32_t end){
+            const float inv_area = 1.0f / (size * size);
+            for(uint32_t bx{start}; bx < end; bx++){
+                sf::Vertex* quad = vertices.data() + static_cast<size_t>(column_quads[bx]) * 4;
+                const float left = static_cast<float>(bx0 + static_cast<int32_t>(bx)) * size;
+                for(uint32_t by{0}; by < blocks_y; by++){
+                    const Block& block = blocks[bx * blocks_y + by];
+                    if(!block.count) continue;
+                    const float top = static_cast<float>(by0 + static_cast<int32_t>(by)) * size;
+                    const float coverage = std::min(block.area * inv_area, 1.0f);
+                    const sf::Color color{static_cast<sf::Uint8>(block.r / block.count), static_cast<sf::Uint8>(block.g / block.count),
+                                          static_cast<sf::Uint8>(block.b / block.count), static_cast<sf::Uint8>(255.0f * coverage)};
+                    quad[0] = sf::Vertex{{left, top}, color};
+                    quad[1] = sf::Vertex{{left + size, top}, color};
+                    quad[2] = sf::Vertex{{left + size, top + size}, color};
+                    quad[3] = sf::Vertex{{left, top + size}, color};
+                    quad += 4;
+                }
+            }
+        });
+    }
+
+private:
+    struct Block {
+        uint32_t count = 0;
+        uint32_t r = 0, g = 0, b = 0;
+        float area = 0.0f;
+    };
+
+    std::vector<Block> blocks;
+    // Quads per block column, then their offset into vertices
+    std::vector<uint32_t> column_quads;
+    float size = 1.0f;
+    int32_t bx0 = 0, by0 = 0;
+    uint32_t blocks_x = 0, blocks_y = 0;
+
+    // Objects are binned by position but kept inside the band of the task
+    // that owns their grid column, so no block is written by two tasks
+    void accumulate(const ParticleStore& objects, uint32_t slot, uint32_t band_start, uint32_t band_end){
+        const Vector2f pos = objects.pos[slot];
+        const int32_t by = static_cast<int32_t>(std::floor(pos.y / size)) - by0;
+        if(!(by >= 0 && by < static_cast<int32_t>(blocks_y))) return;
+        const auto bx = static_cast<uint32_t>(std::clamp(static_cast<int32_t>(std::floor(pos.x / size)) - bx0,
+                                                         static_cast<int32_t>(band_start), static_cast<int32_t>(band_end) - 1));
+        Block& block = blocks[bx * blocks_y + static_cast<uint32_t>(by)];
+        const sf::Color color = objects.color[slot];
+        const float radius = objects.radius[slot];
+        block.count++;
+        block.r += color.r;
+        block.g += color.g;
+        block.b += color.b;
+        block.area += 3.14159265f * radius * radius;
+    }
+};
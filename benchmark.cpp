@@ -0,0 +1,1012 @@
+//
+// Headless solver benchmark: runs scripted scenarios without a window and
+// reports the cost of every solver phase per substep.
+//
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include "Solver.hpp"
+#include "SoftBodies.hpp"
+#include "ThreadPool.hpp"
+
+struct Scenario{
+    std::string name;
+    Vector2f world_size;
+    std::function<void(Solver&)> setup;
+    std::function<void(Solver&)> before_frame;
+    bool needs_warmup;
+    // Narrowest pipeline the scenario runs correctly on
+    SolverFeatures features{};
+};
+
+struct BenchConfig{
+    std::vector<uint32_t> counts{10000, 100000, 1000000};
+    std::vector<uint32_t> threads;
+    std::vector<std::string> scenarios{"dam", "pile", "spout"};
+    uint32_t frames = 60;
+    uint32_t warmup = 120;
+    uint32_t substeps = 8;
+    KernelMode kernels = KernelMode::Auto;
+    std::vector<UpdateMode> modes{UpdateMode::Phased, UpdateMode::Fused};
+    uint32_t reorder = 0;
+    // Sleep threshold per substep and substeps before sleeping, 0 keeps everything awake
+    float sleep = 0.0f;
+    uint32_t sleep_substeps = 60;
+    // Grid storage, by default picked from the world size
+    std::string grid;
+    // Run the scenario's own features instead of the general pipeline
+    bool fitted_features = true;
+    // Saved after setup and warmup, or loaded in place of both
+    std::string save_snapshot;
+    std::string load_snapshot;
+    // Trajectory of the timed frames
+    std::string record;
+    // Chrome trace of the timed frames, needs PHYSICS_ENABLE_PROFILING
+    std::string trace;
+};
+
+static const char* modeName(UpdateMode mode){
+    return mode == UpdateMode::Fused ? "fused" : "phased";
+}
+
+static std::vector<std::string> split(const std::string& s){
+    std::vector<std::string> parts;
+    size_t start = 0;
+    while(start <= s.size()){
+        const size_t end = std::min(s.find(',', start), s.size());
+        if(end > start) parts.push_back(s.substr(start, end - start));
+        start = end + 1;
+    }
+    return parts;
+}
+
+static std::vector<uint32_t> splitNumbers(const std::string& s){
+    std::vector<uint32_t> numbers;
+    for(const std::string& part : split(s)) numbers.push_back(static_cast<uint32_t>(std::stoul(part)));
+    return numbers;
+}
+
+static Scenario damBreak(uint32_t count){
+    const auto side = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<float>(count))));
+    const Vector2f world{3.0f * side + 8.0f, side + 8.0f};
+    return {"dam", world, [count, side, world](Solver& solver){
+        for(uint32_t i{0}; i < count; i++){
+            solver.addObject({2.5f + static_cast<float>(i % side), world.y - 2.5f - static_cast<float>(i / side)}, 0.5f);
+        }
+    }, nullptr, false, {0.5f, true, false, false}};
+}
+
+// Dam break of objects half the usual size, with the grid fitted to them
+static Scenario fineDam(uint32_t count){
+    const auto side = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<float>(count))));
+    const Vector2f world{1.5f * side + 6.0f, 0.5f * side + 6.0f};
+    return {"fine", world, [count, side, world](Solver& solver){
+        solver.configureGrid(0.25f, 0.5f);
+        for(uint32_t i{0}; i < count; i++){
+            solver.addObject({2.5f + 0.5f * static_cast<float>(i % side), world.y - 2.5f - 0.5f * static_cast<float>(i / side)}, 0.25f);
+        }
+    }, nullptr, false, {0.25f, true, false, false}};
+}
+
+static Scenario settledPile(uint32_t count){
+    const auto width = static_cast<uint32_t>(std::ceil(2.0f * std::sqrt(static_cast<float>(count))));
+    const uint32_t per_row = width;
+    const uint32_t rows = count / per_row + 1;
+    const Vector2f world{width + 6.0f, rows * 0.87f + 8.0f};
+    return {"pile", world, [count, per_row, world](Solver& solver){
+        for(uint32_t i{0}; i < count; i++){
+            const uint32_t row = i / per_row;
+            const uint32_t col = i % per_row;
+            solver.addObject({2.5f + static_cast<float>(col) + 0.5f * static_cast<float>(row & 1),
+                              world.y - 2.5f - 0.87f * static_cast<float>(row)}, 0.5f);
+        }
+    }, nullptr, true, {0.5f, true, false, false}};
+}
+
+// Dam break with log-uniform radii over a 10:1 range, laid out in rows
+static Scenario polydisperse(uint32_t count){
+    const float block_width = std::ceil(std::sqrt(static_cast<float>(count)) * 4.0f);
+    std::mt19937 mt{7};
+    std::uniform_real_distribution<float> exponent(0.0f, 1.0f);
+    std::vector<Vector2f> offsets(count);
+    std::vector<float> radii(count);
+    Vector2f cursor{0.0f, 0.0f};
+    float row_height = 0.0f;
+    for(uint32_t i{0}; i < count; i++){
+        const float radius = 0.5f * std::pow(10.0f, exponent(mt));
+        if(cursor.x + 2.0f * radius > block_width){
+            cursor = {0.0f, cursor.y + row_height};
+            row_height = 0.0f;
+        }
+        offsets[i] = {cursor.x + radius, cursor.y + radius};
+        radii[i] = radius;
+        cursor.x += 2.0f * radius;
+        row_height = std::max(row_height, 2.0f * radius);
+    }
+    const Vector2f world{3.0f * block_width + 12.0f, cursor.y + row_height + 12.0f};
+    return {"poly", world, [offsets, radii, world](Solver& solver){
+        for(uint32_t i{0}; i < offsets.size(); i++){
+            solver.addObject({6.0f + offsets[i].x, world.y - 6.0f - offsets[i].y}, radii[i]);
+        }
+    }, nullptr, false, {0.0f, true, false, false}};
+}
+
+// Dam break of alternating polarities with the long-range force on
+static Scenario charged(uint32_t count){
+    Scenario scenario = damBreak(count);
+    const auto setup = scenario.setup;
+    scenario.name = "charged";
+    scenario.setup = [setup](Solver& solver){
+        setup(solver);
+        for(uint32_t i{0}; i < solver.objects.size(); i++){
+            solver.objects.polarity[i] = (i & 1) ? 1 : -1;
+        }
+        solver.setLongRangeStrength(20.0f);
+    };
+    scenario.features.long_range = true;
+    return scenario;
+}
+
+// Same emitter as main.cpp: a spout on the left wall firing to the right,
+// with a lane every 2 units of wall
+static Scenario spout(uint32_t count){
+    const auto side = static_cast<uint32_t>(std::ceil(std::sqrt(1.2f * static_cast<float>(count)))) + 4;
+    const Vector2f world{static_cast<float>(side), static_cast<float>(side)};
+    const auto lanes = static_cast<uint32_t>((world.y - 12.0f) / 2.0f);
+    return {"spout", world, [count, lanes](Solver& solver){
+        Emitter emitter;
+        emitter.position = {2.0f, 10.0f + 0.5f * static_cast<float>(lanes)};
+        emitter.lanes = lanes;
+        emitter.velocity = {96.0f, 0.0f};
+        emitter.rate = 60.0f * static_cast<float>(lanes);
+        emitter.remaining = count;
+        solver.addEmitter(emitter);
+    }, nullptr, false, {0.5f, true, false, false}};
+}
+
+// Open flow: the same spout, but objects leave through a drain on the floor
+// and over the open walls, so the count levels off instead of growing
+static Scenario flow(uint32_t count){
+    Scenario scenario = spout(count);
+    const auto setup = scenario.setup;
+    const Vector2f world = scenario.world_size;
+    scenario.name = "flow";
+    scenario.setup = [setup, world](Solver& solver){
+        setup(solver);
+        solver.getEmitter(0).remaining = UINT32_MAX;
+        Sink drain;
+        drain.shape = SinkShape::Drain;
+        drain.position = {0.5f * world.x, world.y};
+        drain.radius = 0.125f * world.x;
+        solver.addSink(drain);
+        solver.setOpenWalls(true);
+    };
+    return scenario;
+}
+
+// Small dam breaks scattered over a world far too big for a dense grid
+static Scenario islands(uint32_t count){
+    const uint32_t island_count = 64;
+    const uint32_t per_island = (count + island_count - 1) / island_count;
+    const auto side = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<float>(per_island))));
+    const Vector2f world{8000.0f, 8000.0f};
+    return {"islands", world, [count, per_island, side, world](Solver& solver){
+        std::mt19937 mt{11};
+        std::uniform_real_distribution<float> x(10.0f, world.x - 10.0f - side), y(10.0f + side, world.y - 10.0f);
+        Vector2f corner;
+        for(uint32_t i{0}; i < count; i++){
+            const uint32_t k = i % per_island;
+            if(k == 0) corner = {x(mt), y(mt)};
+            solver.addObject({corner.x + static_cast<float>(k % side), corner.y - static_cast<float>(k / side)}, 0.5f);
+        }
+    }, nullptr, false, {0.5f, true, false, false}};
+}
+
+// Dam break of 13 object blobs, 36 links each
+static Scenario softDam(uint32_t count){
+    const uint32_t blob_count = (count + 12) / 13;
+    const auto side = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<float>(blob_count))));
+    const Vector2f world{15.0f * side + 8.0f, 5.0f * side + 8.0f};
+    return {"soft", world, [blob_count, side, world](Solver& solver){
+        for(uint32_t i{0}; i < blob_count; i++){
+            addBlob(solver, {6.5f + 5.0f * static_cast<float>(i % side), world.y - 6.5f - 5.0f * static_cast<float>(i / side)}, 2.0f);
+        }
+    }, nullptr, false, {0.5f, true, false, false}};
+}
+
+static const std::vector<std::string> scenario_names{"dam", "pile", "spout", "poly", "charged", "islands", "fine", "flow", "soft"};
+
+static std::string checkScenarioName(const std::string& name){
+    if(std::find(scenario_names.begin(), scenario_names.end(), name) != scenario_names.end()) return name;
+    std::string names;
+    for(const std::string& known : scenario_names) names += (names.empty() ? "" : ",") + known;
+    throw std::invalid_argument("unknown scenario: " + name + " (expected one of " + names + ")");
+}
+
+static Scenario makeScenario(const std::string& name, uint32_t count){
+    if(name == "dam") return damBreak(count);
+    if(name == "pile") return settledPile(count);
+    if(name == "poly") return polydisperse(count);
+    if(name == "charged") return charged(count);
+    if(name == "islands") return islands(count);
+    if(name == "fine") return fineDam(count);
+    if(name == "flow") return flow(count);
+    if(name == "soft") return softDam(count);
+    if(name == "spout") return spout(count);
+    throw std::invalid_argument("unknown scenario: " + checkScenarioName(name));
+}
+
+static void printHeader(){
+    std::cout << std::left << std::setw(8) << "scene" << std::setw(8) << "mode" << std::right
+              << std::setw(10) << "objects" << std::setw(8) << "threads"
+              << std::setw(12) << "fused" << std::setw(12) << "gravity" << std::setw(12) << "constraint"
+              << std::setw(12) << "grid" << std::setw(12) << "collision"
+              << std::setw(12) << "integrate" << std::setw(12) << "reorder" << std::setw(12) << "longrange" << std::setw(12) << "record" << std::setw(12) << "emit" << std::setw(12) << "removal" << std::setw(12) << "links" << std::setw(12) << "sleep" << std::setw(12) << "substep"
+              << std::setw(12) << "ms/frame" << std::setw(10) << "overflow" << '\n';
+    std::cout << std::left << std::setw(16) << "" << std::right << std::setw(18) << ""
+              << std::setw(168) << "(ns per substep)" << '\n';
+}
+
+static void runScenario(const BenchConfig& config, const std::string& name, uint32_t count, uint32_t thread_count, UpdateMode mode){
+    const Scenario scenario = makeScenario(name, count);
+    ThreadPool pool{thread_count};
+    Solver solver(scenario.world_size, pool);
+    solver.setStep(1.0f / 60.0f);
+    solver.setSubstep(static_cast<int>(config.substeps));
+    solver.setKernelMode(config.kernels);
+    solver.setUpdateMode(mode);
+    solver.setReorderInterval(config.reorder);
+    solver.setSleep(config.sleep, config.sleep_substeps);
+    if(!config.load_snapshot.empty()){
+        const auto load_start = std::chrono::steady_clock::now();
+        if(!solver.loadSnapshot(config.load_snapshot)){
+            std::cout << "could not load snapshot " << config.load_snapshot << '\n';
+            return;
+        }
+        std::cout << "loaded " << solver.objects.size() << " objects in "
+                  << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - load_start).count() << " ms\n";
+        solver.setSubstep(static_cast<int>(config.substeps));
+        solver.setReorderInterval(config.reorder);
+        // The snapshot's sleep settings unless overridden
+        if(config.sleep > 0.0f) solver.setSleep(config.sleep, config.sleep_substeps);
+        if(!config.grid.empty()) solver.setGridStorage(config.grid == "sparse" ? GridStorage::Sparse : GridStorage::Dense);
+    }else{
+        if(scenario.setup) scenario.setup(solver);
+        if(config.fitted_features) solver.setFeatures(scenario.features);
+        // After setup, which may fit the grid to the scenario
+        if(!config.grid.empty()) solver.setGridStorage(config.grid == "sparse" ? GridStorage::Sparse : GridStorage::Dense);
+        if(scenario.needs_warmup){
+            for(uint32_t i{config.warmup}; i--;) solver.update();
+        }
+    }
+
+    SnapshotWriter writer;
+    if(!config.save_snapshot.empty()){
+        const auto save_start = std::chrono::steady_clock::now();
+        solver.saveSnapshot(writer, config.save_snapshot);
+        std::cout << "snapshot copied in "
+                  << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - save_start).count() << " ms\n";
+    }
+
+    TrajectoryRecorder recorder;
+    if(!config.record.empty()){
+        if(!recorder.open(config.record, solver.worldSize)){
+            std::cout << "could not open " << config.record << '\n';
+            return;
+        }
+        solver.setRecorder(&recorder);
+    }
+
+    solver.resetPhaseTimings();
+    solver.setPhaseTimingEnabled(true);
+    Profiler& profiler = Profiler::instance();
+    if(!config.trace.empty()) profiler.beginTrace();
+    const auto start = std::chrono::steady_clock::now();
+    for(uint32_t i{0}; i < config.frames; i++){
+        if(scenario.before_frame) scenario.before_frame(solver);
+        solver.update();
+    }
+    const auto total_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    if(!config.trace.empty() && !profiler.endTrace(config.trace)){
+        std::cout << "could not write " << config.trace << '\n';
+    }
+    writer.wait();
+    solver.setRecorder(nullptr);
+    recorder.close();
+    if(!recorder.good()) std::cout << "could not write " << config.record << '\n';
+    if(!config.save_snapshot.empty() && !writer.lastWriteSucceeded()){
+        std::cout << "could not write snapshot " << config.save_snapshot << '\n';
+    }
+
+    const PhaseTimings& t = solver.getPhaseTimings();
+    const double substeps = static_cast<double>(std::max<uint64_t>(t.substeps, 1));
+    const auto per_substep = [substeps](uint64_t ns){ return static_cast<double>(ns) / substeps; };
+    const uint64_t phases = t.fused + t.gravity + t.constraints + t.grid_build + t.collisions + t.integration + t.reorder + t.long_range + t.record + t.emit + t.removal + t.links + t.sleep;
+
+    std::cout << std::left << std::setw(8) << scenario.name << std::setw(8) << modeName(mode) << std::right
+              << std::setw(10) << solver.objects.size() << std::setw(8) << thread_count
+              << std::fixed << std::setprecision(0)
+              << std::setw(12) << per_substep(t.fused) << std::setw(12) << per_substep(t.gravity) << std::setw(12) << per_substep(t.constraints)
+              << std::setw(12) << per_substep(t.grid_build) << std::setw(12) << per_substep(t.collisions)
+              << std::setw(12) << per_substep(t.integration) << std::setw(12) << per_substep(t.reorder) << std::setw(12) << per_substep(t.long_range) << std::setw(12) << per_substep(t.record) << std::setw(12) << per_substep(t.emit) << std::setw(12) << per_substep(t.removal) << std::setw(12) << per_substep(t.links) << std::setw(12) << per_substep(t.sleep)
+              << std::setw(12) << per_substep(phases)
+              << std::setprecision(3)
+              << std::setw(12) << static_cast<double>(total_ns) / 1e6 / std::max(config.frames, 1u)
+              << std::setw(10) << solver.getGrid().overflow_count << '\n';
+    if(config.sleep > 0.0f) std::cout << solver.getSleepingCount() << " asleep\n";
+    if(Profiler::enabled) std::cout << profiler.report(config.frames);
+}
+
+template<typename T>
+static bool sameBits(const std::vector<T>& a, const std::vector<T>& b){
+    return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0;
+}
+
+// Runs every SIMD kernel set against the scalar one, first on raw arrays with
+// out-of-bounds and NaN values, then on a full simulation, and requires
+// bit-identical output.
+static bool verifyKernels(){
+    const uint32_t count = 1003;
+    std::mt19937 mt{42};
+    std::uniform_real_distribution<float> dist(-10.0f, 110.0f);
+    std::vector<Vector2f> pos(count), pos_prev(count), acc(count);
+    for(uint32_t i{0}; i < count; i++){
+        pos[i] = {dist(mt), dist(mt)};
+        pos_prev[i] = pos[i] + Vector2f{dist(mt), dist(mt)} * 0.001f;
+        acc[i] = {dist(mt), dist(mt)};
+    }
+    pos[7].x = std::nanf("");
+    pos[11].y = std::nanf("");
+
+    const auto run = [&](const VerletKernels& k, std::vector<Vector2f>& p, std::vector<Vector2f>& pp, std::vector<Vector2f>& a){
+        p = pos;
+        pp = pos_prev;
+        a = acc;
+        k.accelerate(a.data(), count, {0.0f, 20.0f});
+        k.constrain(p.data(), count, {2.0f, 2.0f}, {98.0f, 98.0f});
+        k.integrate(p.data(), pp.data(), a.data(), count, 0.0003f);
+    };
+
+    const auto simulate = [](KernelMode mode){
+        ThreadPool pool{1};
+        const Scenario scenario = damBreak(2500);
+        Solver solver(scenario.world_size, pool);
+        solver.setStep(1.0f / 60.0f);
+        solver.setKernelMode(mode);
+        scenario.setup(solver);
+        for(uint32_t i{60}; i--;) solver.update();
+        return solver.objects.pos;
+    };
+
+    std::vector<Vector2f> ref_p, ref_pp, ref_a;
+    run(VerletKernels::select(KernelMode::Scalar), ref_p, ref_pp, ref_a);
+    const std::vector<Vector2f> ref_sim = simulate(KernelMode::Scalar);
+
+    bool ok = true;
+    for(KernelMode mode : {KernelMode::SSE, KernelMode::AVX2}){
+        if(!VerletKernels::supported(mode)){
+            std::cout << VerletKernels::name(mode) << ": not supported on this machine\n";
+            continue;
+        }
+        std::vector<Vector2f> p, pp, a;
+        run(VerletKernels::select(mode), p, pp, a);
+        const bool kernels_ok = sameBits(p, ref_p) && sameBits(pp, ref_pp) && sameBits(a, ref_a);
+        const bool sim_ok = sameBits(simulate(mode), ref_sim);
+        std::cout << VerletKernels::name(mode) << ": kernels " << (kernels_ok ? "identical" : "MISMATCH")
+                  << ", simulation " << (sim_ok ? "identical" : "MISMATCH") << '\n';
+        ok = ok && kernels_ok && sim_ok;
+    }
+    return ok;
+}
+
+// Single-threaded so grid insertion order is deterministic, runs once more
+// with sleeping on and long enough for most of the pile to fall asleep. The
+// sleeping pile also has to run on the same from a snapshot of it.
+static bool verifyFused(){
+    const auto simulate = [](UpdateMode mode, float sleep, uint32_t frames, bool snapshot){
+        ThreadPool pool{1};
+        const Scenario scenario = damBreak(2500);
+        Solver solver(scenario.world_size, pool);
+        solver.setStep(1.0f / 60.0f);
+        solver.setUpdateMode(mode);
+        solver.setSleep(sleep, 30);
+        scenario.setup(solver);
+        for(uint32_t i{frames}; i--;) solver.update();
+        if(!snapshot) return solver.objects.pos;
+        Snapshot saved;
+        solver.captureSnapshot(saved);
+        const std::string path = "verify_fused.snap";
+        Solver loaded(scenario.world_size, pool);
+        loaded.setUpdateMode(mode);
+        const bool ok = writeSnapshot(path, saved) && loaded.loadSnapshot(path);
+        std::remove(path.c_str());
+        if(!ok) return std::vector<Vector2f>{};
+        for(uint32_t i{60}; i--;) loaded.update();
+        return loaded.objects.pos;
+    };
+    bool ok = true;
+    for(const float sleep : {0.0f, 0.002f}){
+        const uint32_t frames = sleep > 0.0f ? 600 : 60;
+        const bool same = sameBits(simulate(UpdateMode::Fused, sleep, frames, false), simulate(UpdateMode::Phased, sleep, frames, false));
+        std::cout << "fused" << (sleep > 0.0f ? " with sleeping" : "") << ": simulation " << (same ? "identical" : "MISMATCH") << " to phased\n";
+        ok = ok && same;
+    }
+    const bool restored = sameBits(simulate(UpdateMode::Phased, 0.002f, 660, false), simulate(UpdateMode::Phased, 0.002f, 600, true));
+    std::cout << "sleeping pile: simulation " << (restored ? "identical" : "MISMATCH") << " across a snapshot\n";
+    return ok && restored;
+}
+
+// The sparse grid has to bin and solve exactly like the dense one, checked
+// with several levels, sleeping and reordering on three threads
+static bool verifySparse(){
+    const auto simulate = [](const Scenario& scenario, GridStorage storage){
+        ThreadPool pool{3};
+        Solver solver(scenario.world_size, pool);
+        solver.setStep(1.0f / 60.0f);
+        solver.setSleep(0.002f, 30);
+        solver.setReorderInterval(7);
+        scenario.setup(solver);
+        solver.setGridStorage(storage);
+        for(uint32_t i{300}; i--;) solver.update();
+        return solver.objects.pos;
+    };
+    bool ok = true;
+    for(const Scenario& scenario : {damBreak(2500), polydisperse(2000), fineDam(2500)}){
+        const bool same = sameBits(simulate(scenario, GridStorage::Sparse), simulate(scenario, GridStorage::Dense));
+        std::cout << "sparse grid, " << scenario.name << ": simulation " << (same ? "identical" : "MISMATCH") << " to dense\n";
+        ok = ok && same;
+    }
+    return ok;
+}
+
+// Every scenario on its own pipeline against the general one, plus a
+// zero-gravity dam break, a non-unit friction and a radius breaking the
+// uniform promise halfway through
+static bool verifyFeatures(){
+    const auto simulate = [](const Scenario& scenario, bool fitted, const std::function<void(Solver&, uint32_t)>& before_frame){
+        ThreadPool pool{1};
+        Solver solver(scenario.world_size, pool);
+        solver.setStep(1.0f / 60.0f);
+        if(scenario.setup) scenario.setup(solver);
+        if(fitted) solver.setFeatures(scenario.features);
+        for(uint32_t i{0}; i < 120; i++){
+            if(scenario.before_frame) scenario.before_frame(solver);
+            if(before_frame) before_frame(solver, i);
+            solver.update();
+        }
+        return solver.objects.pos;
+    };
+
+    Scenario weightless = damBreak(2500);
+    const auto setup = weightless.setup;
+    weightless.name = "weightless dam";
+    weightless.setup = [setup](Solver& solver){
+        setup(solver);
+        solver.setGravity({0.0f, 0.0f});
+        solver.getObject(0).pos_prev.x -= 0.5f;
+    };
+    weightless.features.gravity = false;
+
+    struct Case{
+        Scenario scenario;
+        std::function<void(Solver&, uint32_t)> before_frame;
+    };
+    const std::vector<Case> cases{
+        {damBreak(2500), nullptr}, {polydisperse(2000), nullptr}, {charged(2500), nullptr}, {spout(2000), nullptr}, {weightless, nullptr},
+        {damBreak(2500), [](Solver& solver, uint32_t frame){ if(frame == 30) solver.setFriction(0.75f); }},
+        {damBreak(2500), [](Solver& solver, uint32_t frame){ if(frame == 60) solver.addObject({10.0f, 10.0f}, 1.5f); }}
+    };
+    bool ok = true;
+    for(const Case& c : cases){
+        const bool same = sameBits(simulate(c.scenario, true, c.before_frame), simulate(c.scenario, false, c.before_frame));
+        std::cout << "features, " << c.scenario.name << (c.before_frame ? " (changed midway)" : "") << ": simulation "
+                  << (same ? "identical" : "MISMATCH") << " to general\n";
+        ok = ok && same;
+    }
+    return ok;
+}
+
+// A batch has to add exactly what the same objects added one by one do, and
+// emitters have to run the same in the fused and phased paths, with a spout,
+// a line and an area of another radius and the long-range force on
+static bool verifyEmitters(){
+    const uint32_t count = 2500;
+    const Scenario scenario = damBreak(count);
+    const auto simulate = [&](bool batched){
+        ThreadPool pool{2};
+        Solver solver(scenario.world_size, pool);
+        solver.setStep(1.0f / 60.0f);
+        std::vector<Vector2f> pos(count), velocity(count);
+        std::vector<float> radius(count);
+        const auto side = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<float>(count))));
+        for(uint32_t i{0}; i < count; i++){
+            pos[i] = {2.5f + static_cast<float>(i % side), scenario.world_size.y - 2.5f - static_cast<float>(i / side)};
+            velocity[i] = {static_cast<float>(i % 7), -static_cast<float>(i % 5)};
+            radius[i] = i % 3 ? 0.5f : 0.45f;
+        }
+        if(batched){
+            ParticleBatch batch;
+            batch.pos = pos.data();
+            batch.velocity = velocity.data();
+            batch.radius = radius.data();
+            batch.count = count;
+            solver.addObjects(batch);
+        }else{
+            for(uint32_t i{0}; i < count; i++){
+                const uint32_t id = solver.addObject(pos[i], radius[i]);
+                solver.getObject(id).pos_prev -= velocity[i] * (1.0f / 480.0f);
+            }
+        }
+        for(uint32_t i{60}; i--;) solver.update();
+        return solver.objects.pos;
+    };
+    const bool batch_same = sameBits(simulate(true), simulate(false));
+    std::cout << "batch: simulation " << (batch_same ? "identical" : "MISMATCH") << " to one by one\n";
+
+    const auto emit = [](UpdateMode mode){
+        ThreadPool pool{3};
+        Solver solver({120.0f, 80.0f}, pool);
+        solver.setStep(1.0f / 60.0f);
+        solver.setUpdateMode(mode);
+        solver.setLongRangeStrength(5.0f);
+        solver.setLongRangeInterval(3);
+        Emitter spout;
+        spout.position = {3.0f, 20.0f};
+        spout.lanes = 8;
+        spout.velocity = {60.0f, -10.0f};
+        spout.rate = 500.0f;
+        spout.remaining = 3000;
+        Emitter line;
+        line.shape = EmitterShape::Line;
+        line.position = {40.0f, 5.0f};
+        line.extent = {40.0f, 0.0f};
+        line.rate = 300.0f;
+        line.color = sf::Color::Red;
+        Emitter area;
+        area.shape = EmitterShape::Area;
+        area.position = {90.0f, 10.0f};
+        area.extent = {20.0f, 10.0f};
+        area.radius = 0.75f;
+        area.rate = 150.0f;
+        area.remaining = 600;
+        solver.addEmitter(spout);
+        solver.addEmitter(line);
+        solver.addEmitter(area);
+        for(uint32_t i{120}; i--;) solver.update();
+        return solver.objects.pos;
+    };
+    const std::vector<Vector2f> phased = emit(UpdateMode::Phased);
+    const bool emit_same = sameBits(emit(UpdateMode::Fused), phased);
+    std::cout << "emitters: " << phased.size() << " objects, fused simulation " << (emit_same ? "identical" : "MISMATCH") << " to phased\n";
+    return batch_same && emit_same;
+}
+
+// Handles of removed objects stay invalid when their id is reused, objects
+// removed before the first update leave exactly the simulation of never
+// having been added, and an open flow with drains and removal runs the same
+// fused and phased and across a snapshot taken with removals pending
+static bool verifyRemoval(){
+    ThreadPool small_pool{1};
+    Solver small({20.0f, 20.0f}, small_pool);
+    const uint32_t a = small.addObject({5.0f, 5.0f}, 0.5f);
+    const ObjectHandle b = small.getHandle(small.addObject({7.0f, 5.0f}, 0.5f));
+    small.removeObject(b);
+    small.update();
+    const uint32_t c = small.addObject({9.0f, 5.0f}, 0.5f);
+    const bool handles_ok = c == b.id && !small.isAlive(b) && small.isAlive(small.getHandle(c)) && !small.removeObject(b)
+                            && small.isAlive(a) && small.getObjectCount() == 2 && small.getIdCount() == 2;
+    std::cout << "handles: " << (handles_ok ? "ok" : "MISMATCH") << '\n';
+
+    const Scenario dam = damBreak(2500);
+    const auto simulate = [&](bool with_extra){
+        ThreadPool pool{3};
+        Solver solver(dam.world_size, pool);
+        solver.setStep(1.0f / 60.0f);
+        solver.setReorderInterval(7);
+        solver.setSleep(0.002f, 30);
+        std::mt19937 mt{5};
+        std::uniform_real_distribution<float> x(3.0f, dam.world_size.x - 3.0f), y(3.0f, dam.world_size.y - 3.0f);
+        std::vector<uint32_t> extra;
+        const auto side = static_cast<uint32_t>(std::ceil(std::sqrt(2500.0f)));
+        for(uint32_t i{0}; i < 2500; i++){
+            solver.addObject({2.5f + static_cast<float>(i % side), dam.world_size.y - 2.5f - static_cast<float>(i / side)}, 0.5f);
+            if(with_extra && i % 5 == 0) extra.push_back(solver.addObject({x(mt), y(mt)}, 0.5f));
+        }
+        for(const uint32_t id : extra) solver.removeObject(id);
+        for(uint32_t i{300}; i--;) solver.update();
+        return solver.objects.pos;
+    };
+    const bool compact_ok = sameBits(simulate(true), simulate(false));
+    std::cout << "removed before the first update: simulation " << (compact_ok ? "identical" : "MISMATCH") << " to never added\n";
+
+    const Scenario open = flow(5000);
+    const auto run = [&](Solver& solver, uint32_t frames){
+        for(uint32_t i{0}; i < frames; i++){
+            // Removes every 97th id on top of the drains now and then
+            if(i % 10 == 0){
+                for(uint32_t id{i}; id < solver.getIdCount(); id += 97) solver.removeObject(id);
+            }
+            solver.update();
+        }
+    };
+    bool handles_kept = false;
+    const auto flowing = [&](UpdateMode mode, bool snapshot){
+        ThreadPool pool{3};
+        Solver solver(open.world_size, pool);
+        solver.setStep(1.0f / 60.0f);
+        solver.setUpdateMode(mode);
+        solver.setReorderInterval(5);
+        open.setup(solver);
+        run(solver, 200);
+        for(uint32_t id{1}; id < solver.getIdCount(); id += 13) solver.removeObject(id);
+        if(snapshot){
+            Snapshot saved;
+            solver.captureSnapshot(saved);
+            const std::string path = "verify_removal.snap";
+            Solver loaded(open.world_size, pool);
+            open.setup(loaded);
+            loaded.getEmitter(0) = solver.getEmitter(0);
+            const bool ok = writeSnapshot(path, saved) && loaded.loadSnapshot(path);
+            std::remove(path.c_str());
+            if(!ok) return std::vector<Vector2f>{};
+            // Every handle, live or stale, keeps its answer
+            handles_kept = loaded.getIdCount() == solver.getIdCount();
+            for(uint32_t id{0}; handles_kept && id < solver.getIdCount(); id++){
+                const ObjectHandle handle = solver.getHandle(id);
+                const ObjectHandle stale{id, handle.generation - 1};
+                handles_kept = loaded.isAlive(handle) == solver.isAlive(handle) && loaded.isAlive(stale) == solver.isAlive(stale);
+            }
+            loaded.setUpdateMode(mode);
+            run(loaded, 200);
+            return loaded.objects.pos;
+        }
+        run(solver, 200);
+        return solver.objects.pos;
+    };
+    const std::vector<Vector2f> phased = flowing(UpdateMode::Phased, false);
+    const bool fused_ok = sameBits(flowing(UpdateMode::Fused, false), phased);
+    const bool snapshot_ok = sameBits(flowing(UpdateMode::Phased, true), phased);
+    std::cout << "open flow: " << phased.size() << " objects, fused simulation " << (fused_ok ? "identical" : "MISMATCH")
+              << " to phased, " << (snapshot_ok ? "identical" : "MISMATCH") << " across a snapshot, handles "
+              << (handles_kept ? "kept" : "MISMATCH") << '\n';
+    return handles_ok && compact_ok && fused_ok && snapshot_ok && handles_kept;
+}
+
+// No two links of a color share an object, soft bodies simulate the same
+// fused and phased, a lattice that never makes contact (contacts depend on
+// the thread count) the same on one thread and four, an overloaded
+// breakable rope snaps and links to removed objects go away with them
+static bool verifyLinks(){
+    const Scenario soft = softDam(13 * 400);
+    const auto simulate = [&](UpdateMode mode, bool& colors_ok){
+        ThreadPool pool{1};
+        Solver solver(soft.world_size, pool);
+        solver.setStep(1.0f / 60.0f);
+        solver.setUpdateMode(mode);
+        solver.setReorderInterval(7);
+        soft.setup(solver);
+        // A cloth tied to the first blob
+        const std::vector<uint32_t> cloth = addCloth(solver, {8.0f, 4.0f}, 20, 6);
+        solver.addLink(cloth[0], 0);
+        for(uint32_t i{0}; i < 240; i++){
+            solver.update();
+            if(i != 0) continue;
+            const LinkStore& links = solver.getLinks();
+            std::vector<uint32_t> seen(solver.objects.size(), UINT32_MAX);
+            colors_ok = links.colorCount() > 0 && links.color_start.back() == links.bound.size();
+            for(uint32_t c{0}; c < links.colorCount(); c++){
+                for(uint32_t k{links.color_start[c]}; k < links.color_start[c + 1]; k++){
+                    for(const uint32_t slot : {links.bound[k].slot_a, links.bound[k].slot_b}){
+                        colors_ok = colors_ok && seen[slot] != c;
+                        seen[slot] = c;
+                    }
+                }
+            }
+        }
+        return solver.objects.pos;
+    };
+    bool colors_ok = false, unused = false;
+    const std::vector<Vector2f> reference = simulate(UpdateMode::Phased, colors_ok);
+    const bool fused_ok = sameBits(simulate(UpdateMode::Fused, unused), reference);
+    std::cout << "links: colors " << (colors_ok ? "disjoint" : "MISMATCH") << ", fused simulation " << (fused_ok ? "identical" : "MISMATCH") << " to phased\n";
+
+    // Every pair of a blob is linked once: 3 segments give 6 links, 4 give 10, more give 3 per segment
+    bool blobs_ok = true;
+    for(const uint32_t segments : {3u, 4u, 5u, 12u}){
+        ThreadPool blob_pool{1};
+        Solver solver({40.0f, 40.0f}, blob_pool);
+        addBlob(solver, {20.0f, 20.0f}, 3.0f, segments);
+        const uint32_t expected = segments == 3 ? 6 : segments == 4 ? 10 : 3 * segments;
+        std::vector<std::pair<uint32_t, uint32_t>> pairs;
+        for(const Link& link : solver.getLinks().links) pairs.emplace_back(std::min(link.a.id, link.b.id), std::max(link.a.id, link.b.id));
+        std::sort(pairs.begin(), pairs.end());
+        blobs_ok = blobs_ok && solver.getLinkCount() == expected && std::adjacent_find(pairs.begin(), pairs.end()) == pairs.end();
+    }
+    std::cout << "blob links: " << (blobs_ok ? "one per pair" : "MISMATCH") << '\n';
+
+    // Objects 3 apart, linked to their 8 neighbors and jiggling
+    const auto lattice = [](uint32_t thread_count){
+        const uint32_t side = 60;
+        ThreadPool pool{thread_count};
+        Solver solver({3.0f * side + 10.0f, 3.0f * side + 10.0f}, pool);
+        solver.setStep(1.0f / 60.0f);
+        solver.setGravity({0.0f, 0.0f});
+        std::mt19937 mt{13};
+        std::uniform_real_distribution<float> v(-2.0f, 2.0f);
+        std::vector<Vector2f> pos(side * side), velocity(side * side);
+        for(uint32_t i{0}; i < pos.size(); i++){
+            pos[i] = {6.0f + 3.0f * static_cast<float>(i % side), 6.0f + 3.0f * static_cast<float>(i / side)};
+            velocity[i] = {v(mt), v(mt)};
+        }
+        std::vector<uint32_t> ids(pos.size());
+        ParticleBatch batch;
+        batch.pos = pos.data();
+        batch.velocity = velocity.data();
+        batch.count = static_cast<uint32_t>(pos.size());
+        solver.addObjects(batch, ids.data());
+        for(uint32_t y{0}; y < side; y++){
+            for(uint32_t x{0}; x < side; x++){
+                const uint32_t i = ids[y * side + x];
+                if(x + 1 < side) solver.addLink(i, ids[y * side + x + 1], 0.5f);
+                if(y + 1 < side) solver.addLink(i, ids[(y + 1) * side + x], 0.5f);
+                if(x + 1 < side && y + 1 < side){
+                    solver.addLink(i, ids[(y + 1) * side + x + 1], 0.5f);
+                    solver.addLink(ids[y * side + x + 1], ids[(y + 1) * side + x], 0.5f);
+                }
+            }
+        }
+        for(uint32_t i{120}; i--;) solver.update();
+        return solver.objects.pos;
+    };
+    const bool threads_ok = sameBits(lattice(4), lattice(1));
+    std::cout << "link lattice: 4 threads " << (threads_ok ? "identical" : "MISMATCH") << " to 1\n";
+
+    ThreadPool pool{1};
+    Solver solver({60.0f, 60.0f}, pool);
+    solver.setStep(1.0f / 60.0f);
+    SoftBodyStyle style;
+    style.break_strain = 0.05f;
+    const std::vector<uint32_t> rope = addRope(solver, {10.0f, 20.0f}, {1.0f, 0.0f}, 40, style);
+    const uint32_t added = solver.getLinkCount();
+    // Holds both ends of the rope and hangs a weight from its middle
+    const auto hold = [&](Solver& held){
+        held.getObject(rope.front()).pos = held.getObject(rope.front()).pos_prev = {10.0f, 20.0f};
+        held.getObject(rope.back()).pos = held.getObject(rope.back()).pos_prev = {49.0f, 20.0f};
+    };
+    const uint32_t weight = solver.addObject({29.5f, 24.0f}, 3.0f);
+    solver.addLink(rope[20], weight);
+    for(uint32_t i{120}; i--;){
+        hold(solver);
+        solver.update();
+    }
+    const bool broke = solver.getLinkCount() < added + 1;
+    const uint32_t before = solver.getLinkCount();
+    solver.removeObject(rope[5]);
+    solver.removeObject(rope[6]);
+    const bool refused = !solver.addLink(rope[5], rope[7]) && !solver.addLink(rope[7], rope[7]) && !solver.addLink(rope[7], UINT32_MAX);
+    // Saved with links broken and objects removed since the last update
+    Snapshot saved;
+    solver.captureSnapshot(saved);
+    const std::string path = "verify_links.snap";
+    Solver loaded({60.0f, 60.0f}, pool);
+    const bool loaded_ok = writeSnapshot(path, saved) && loaded.loadSnapshot(path);
+    std::remove(path.c_str());
+    solver.update();
+    const uint32_t gone = before - solver.getLinkCount();
+    // Whatever rope links next to them have not broken
+    const bool removed_ok = gone > 0 && gone <= 3;
+    std::cout << "breakable rope: " << added + 1 - solver.getLinkCount() - gone << " of " << added + 1 << " links broke, "
+              << gone << " dropped with removed objects\n";
+    std::cout << "links to removed, missing or the same object: " << (refused ? "refused" : "MISMATCH") << '\n';
+
+    bool snapshot_ok = loaded_ok;
+    if(loaded_ok){
+        loaded.update();
+        for(uint32_t i{60}; i--;){
+            hold(solver);
+            solver.update();
+            hold(loaded);
+            loaded.update();
+        }
+        snapshot_ok = loaded.getLinkCount() == solver.getLinkCount() && sameBits(loaded.objects.pos, solver.objects.pos);
+    }
+    std::cout << "rope: simulation " << (snapshot_ok ? "identical" : "MISMATCH") << " across a snapshot, " << solver.getLinkCount() << " links left\n";
+    return colors_ok && blobs_ok && threads_ok && fused_ok && broke && removed_ok && refused && snapshot_ok;
+}
+
+// Barnes-Hut field against the direct O(N^2) sum on a random charged cloud
+static bool verifyLongRange(){
+    const uint32_t count = 4000;
+    const Vector2f world{200.0f, 100.0f};
+    std::mt19937 mt{3};
+    std::uniform_real_distribution<float> x(0.0f, world.x), y(0.0f, world.y), r(0.3f, 1.5f);
+    ParticleStore objects;
+    for(uint32_t i{0}; i < count; i++){
+        objects.push_back(VerletObject{{x(mt), y(mt)}, r(mt), static_cast<int>(i % 3) - 1});
+    }
+
+    ThreadPool pool{4};
+    BarnesHut tree;
+    tree.strength = 1.0f;
+    const float soft2 = tree.softening * tree.softening;
+    bool ok = true;
+    for(float angle : {0.0f, 0.3f, 0.5f, 0.8f}){
+        tree.opening_angle = angle;
+        tree.compute(pool, objects, world);
+        double error = 0.0, norm = 0.0;
+        for(uint32_t i{0}; i < count; i++){
+            double ax = 0.0, ay = 0.0;
+            for(uint32_t j{0}; j < count; j++){
+                if(i == j) continue;
+                const double dx = objects.pos[i].x - objects.pos[j].x;
+                const double dy = objects.pos[i].y - objects.pos[j].y;
+                const double d2 = dx * dx + dy * dy + soft2;
+                const double q = objects.polarity[j] * objects.radius[j] * objects.radius[j] / (d2 * std::sqrt(d2));
+                ax += q * dx;
+                ay += q * dy;
+            }
+            ax *= objects.polarity[i];
+            ay *= objects.polarity[i];
+            error += (ax - tree.field[i].x) * (ax - tree.field[i].x) + (ay - tree.field[i].y) * (ay - tree.field[i].y);
+            norm += ax * ax + ay * ay;
+        }
+        const double relative = std::sqrt(error / norm);
+        std::cout << "opening angle " << angle << ": rms relative error " << relative << '\n';
+        ok = ok && relative < (angle == 0.0f ? 1e-5 : 0.05);
+    }
+    return ok;
+}
+
+// Records a dam break, then reads the frames back in a scrambled order and
+// checks every position lands within half a quantization step (plus float rounding)
+static bool verifyTrajectory(){
+    const std::string path = "verify_trajectory.traj";
+    ThreadPool pool{2};
+    const Scenario scenario = damBreak(2500);
+    Solver solver(scenario.world_size, pool);
+    solver.setStep(1.0f / 60.0f);
+    solver.setReorderInterval(7);
+    scenario.setup(solver);
+
+    TrajectoryRecorder recorder;
+    if(!recorder.open(path, solver.worldSize, 16, 10)) return false;
+    solver.setRecorder(&recorder);
+    std::vector<std::vector<Vector2f>> expected;
+    for(uint32_t f{0}; f < 45; f++){
+        // Spawns mid-recording grow the frames
+        if(f == 20) solver.addObject({5.0f, 5.0f}, 0.5f);
+        solver.update();
+        std::vector<Vector2f>& pos = expected.emplace_back(solver.objects.size());
+        for(uint32_t id{0}; id < pos.size(); id++) pos[id] = solver.getObject(id).pos;
+    }
+    solver.setRecorder(nullptr);
+    recorder.close();
+
+    TrajectoryReader reader;
+    bool ok = recorder.good() && reader.open(path) && reader.frameCount() == expected.size();
+    const Vector2f tolerance{0.51f * solver.worldSize.x / 65535.0f, 0.51f * solver.worldSize.y / 65535.0f};
+    std::vector<Vector2f> pos;
+    for(uint32_t i{0}; ok && i < expected.size(); i++){
+        const uint32_t frame = (i * 17) % static_cast<uint32_t>(expected.size());
+        ok = reader.readFrame(frame, pos) && pos.size() == expected[frame].size();
+        for(uint32_t id{0}; ok && id < pos.size(); id++){
+            ok = std::abs(pos[id].x - expected[frame][id].x) <= tolerance.x && std::abs(pos[id].y - expected[frame][id].y) <= tolerance.y;
+        }
+    }
+    std::remove(path.c_str());
+    std::cout << "trajectory: " << (ok ? "frames match" : "MISMATCH") << '\n';
+    return ok;
+}
+
+static std::vector<UpdateMode> parseModes(const std::string& s){
+    std::vector<UpdateMode> modes;
+    for(const std::string& part : split(s)){
+        if(part == "phased") modes.push_back(UpdateMode::Phased);
+        else if(part == "fused") modes.push_back(UpdateMode::Fused);
+        else throw std::invalid_argument("unknown update mode: " + part);
+    }
+    return modes;
+}
+
+static KernelMode parseKernelMode(const std::string& s){
+    for(KernelMode mode : {KernelMode::Auto, KernelMode::Scalar, KernelMode::SSE, KernelMode::AVX2}){
+        if(s == VerletKernels::name(mode)) return mode;
+    }
+    throw std::invalid_argument("unknown kernel mode: " + s);
+}
+
+static void printUsage(){
+    std::cout << "usage: PhysicsBenchmark [--scenario=dam,pile,spout,poly,charged,islands,fine,flow,soft] [--counts=10000,100000,1000000]\n"
+                 "                        [--threads=1,2,4] [--frames=60] [--warmup=120] [--substeps=8]\n"
+                 "                        [--kernels=auto|scalar|sse|avx2] [--mode=phased,fused]\n"
+                 "                        [--reorder=frames] [--verify-kernels] [--verify-fused]\n"
+                 "                        [--verify-long-range] [--save-snapshot=path] [--load-snapshot=path]\n"
+                 "                        [--record=path] [--verify-trajectory] [--trace=path]\n"
+                 "                        [--sleep=threshold[,substeps]] [--grid=dense|sparse] [--verify-sparse]\n"
+                 "                        [--features=fitted|general] [--verify-features] [--verify-emitters]\n"
+                 "                        [--verify-removal] [--verify-links]\n";
+}
+
+int main(int argc, char** argv){
+    BenchConfig config;
+    for(uint32_t t{1}; t <= std::max(std::thread::hardware_concurrency(), 1u); t *= 2){
+        config.threads.push_back(t);
+    }
+
+    for(int i{1}; i < argc; i++){
+        const std::string arg{argv[i]};
+        const size_t eq = arg.find('=');
+        const std::string key = arg.substr(0, eq);
+        const std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        if(key == "--scenario"){
+            config.scenarios = split(value);
+            for(const std::string& name : config.scenarios) checkScenarioName(name);
+        }
+        else if(key == "--counts") config.counts = splitNumbers(value);
+        else if(key == "--threads"){
+            config.threads = splitNumbers(value);
+            if(std::count(config.threads.begin(), config.threads.end(), 0u)) throw std::invalid_argument("thread counts start at 1: " + value);
+        }
+        else if(key == "--frames") config.frames = static_cast<uint32_t>(std::stoul(value));
+        else if(key == "--warmup") config.warmup = static_cast<uint32_t>(std::stoul(value));
+        else if(key == "--substeps") config.substeps = static_cast<uint32_t>(std::stoul(value));
+        else if(key == "--kernels") config.kernels = parseKernelMode(value);
+        else if(key == "--mode") config.modes = parseModes(value);
+        else if(key == "--reorder") config.reorder = static_cast<uint32_t>(std::stoul(value));
+        else if(key == "--save-snapshot") config.save_snapshot = value;
+        else if(key == "--load-snapshot") config.load_snapshot = value;
+        else if(key == "--record") config.record = value;
+        else if(key == "--trace") config.trace = value;
+        else if(key == "--sleep"){
+            const size_t comma = value.find(',');
+            config.sleep = std::stof(value.substr(0, comma));
+            if(comma != std::string::npos) config.sleep_substeps = static_cast<uint32_t>(std::stoul(value.substr(comma + 1)));
+        }
+        else if(key == "--grid"){
+            if(value != "dense" && value != "sparse") throw std::invalid_argument("unknown grid storage: " + value);
+            config.grid = value;
+        }
+        else if(key == "--features"){
+            if(value != "fitted" && value != "general") throw std::invalid_argument("unknown features: " + value);
+            config.fitted_features = value == "fitted";
+        }
+        else if(key == "--verify-trajectory") return verifyTrajectory() ? 0 : 1;
+        else if(key == "--verify-kernels") return verifyKernels() ? 0 : 1;
+        else if(key == "--verify-fused") return verifyFused() ? 0 : 1;
+        else if(key == "--verify-sparse") return verifySparse() ? 0 : 1;
+        else if(key == "--verify-features") return verifyFeatures() ? 0 : 1;
+        else if(key == "--verify-emitters") return verifyEmitters() ? 0 : 1;
+        else if(key == "--verify-removal") return verifyRemoval() ? 0 : 1;
+        else if(key == "--verify-links") return verifyLinks() ? 0 : 1;
+        else if(key == "--verify-long-range") return verifyLongRange() ? 0 : 1;
+        else{
+            printUsage();
+            return key == "--help" ? 0 : 1;
+        }
+    }
+
+    if(!config.trace.empty() && !Profiler::enabled){
+        std::cout << "--trace needs a build with PHYSICS_ENABLE_PROFILING\n";
+        return 1;
+    }
+    std::cout << "kernels: " << VerletKernels::name(VerletKernels::select(config.kernels).mode) << '\n';
+    printHeader();
+    for(const std::string& scenario : config.scenarios){
+        for(uint32_t count : config.counts){
+            for(uint32_t threads : config.threads){
+                for(UpdateMode mode : config.modes){
+                    runScenario(config, scenario, count, threads, mode);
+                }
+            }
+        }
+    }
+    return 0;
+}
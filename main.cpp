@@ -1,15 +1,28 @@
 #include <iostream>
 #include <random>
+#include <thread>
+#include <mutex>
+#include <atomic>
 #include "SFML/Graphics.hpp"
 #include "Solver.hpp"
 #include "ThreadPool.hpp"
-#include <fstream>
+#include "ColorMap.hpp"
+#include "renderer.hpp"
+#include "TripleBuffer.hpp"
+#include "viewport_handler.hpp"
 
-int main() {
+int main(int argc, char** argv) {
+    // By default the solver runs on its own thread while this one draws the
+    // previous frame, --serial updates and draws one after the other here
+    bool pipelined = true;
+    std::string snapshot_path;
+    for(int i{1}; i < argc; i++){
+        const std::string arg{argv[i]};
+        if(arg == "--serial") pipelined = false;
+        else snapshot_path = arg;
+    }
 
     sf::Image image;
-    sf::Texture t;
-    t.loadFromFile("/Users/cameron/Desktop/CProjects/Physics/turtle.jpg");
     if(!image.loadFromFile("/Users/cameron/Desktop/CProjects/Physics/turtle.jpg")){
         std::cout << "image not found\n";
         return 1;
@@ -23,6 +36,28 @@ int main() {
     float dt = 1.0f/framerate;
     solver.setStep(dt);
     solver.setSubstep(8);
+    // The fill settles once spawning stops, let it fall asleep
+    solver.setSleep(0.002f, 60);
+    // Every object spawned here has radius 0.5 and there are no charges, so
+    // the solver can run without per-object radii, friction or the long-range force
+    solver.setFeatures({0.5f, true, false, false});
+    // Ten lanes on the left wall firing to the right until the world holds 10000 objects
+    Emitter spout;
+    spout.position = {2.0f, 19.0f};
+    spout.lanes = 10;
+    spout.velocity = {96.0f, 0.0f};
+    spout.rate = 600.0f;
+    spout.remaining = 10000;
+    solver.addEmitter(spout);
+    // Start from a saved state instead of an empty world, S saves the current one
+    if(!snapshot_path.empty() && !solver.loadSnapshot(snapshot_path)){
+        std::cout << "could not load snapshot " << snapshot_path << "\n";
+        return 1;
+    }
+    // A loaded world only gets topped up to 10000
+    solver.getEmitter(0).remaining = 10000 - std::min(10000u, solver.getObjectCount());
+    worldSize = solver.worldSize;
+    SnapshotWriter snapshot_writer;
 
     float scale = image.getSize().x / worldSize.x;
     std::cout << scale;
@@ -30,12 +65,17 @@ int main() {
     const uint32_t window_width  = 1500;
     const uint32_t window_height = 1500;
     sf::RenderWindow window(sf::VideoMode(window_width, window_height), "Verlet Simulation");
-    sf::CircleShape shape;
+    Renderer renderer{solver, pool};
+    // Starts framing the whole world, the wheel zooms and a middle drag pans
+    ViewportHandler viewport{{static_cast<float>(window_width), static_cast<float>(window_height)}};
+    viewport.setZoom(std::min(window_width / worldSize.x, window_height / worldSize.y));
+    viewport.setFocus(worldSize * 0.5f);
     const float margin = 20.0f;
 //    const auto  zoom   = static_cast<float>(window_height - margin) / static_cast<float>(worldSize.y);
 //    render_context.setZoom(zoom);
 //    render_context.setFocus({worldSize.x * 0.5f, worldSize.y * 0.5f});
-    window.setFramerateLimit(framerate);
+    // Pipelined frames are paced by the simulation thread instead
+    if(!pipelined) window.setFramerateLimit(framerate);
 
 //    solver.addObject({100.0f, 200.0f}, 1.0f, 1);
     float input_size = 10.0f;
@@ -55,66 +95,133 @@ int main() {
     double timer = 0;
 
 
-    std::ifstream fileStream;
-    fileStream.open("/Users/cameron/Desktop/CProjects/Physics/ImagePixels.txt");
-    while (window.isOpen())
-    {
-        time = std::chrono::steady_clock::now();
-        uint size = solver.objects.size();
-        if(size < 10000){
-            for(uint32_t i{size/1000 + 1}; i--;){
-                uint32_t color;
-//                if(!fileStream.eof())
-                fileStream >> color;
-                uint32_t id = solver.addObject({2.0f, 10.0f + i * 2.0f}, 1.0f, sf::Color(color));
-                solver.objects[id].pos_prev.x -= 0.2f;
-//                solver.objects[id].pos_prev.y -= .02f;
+    const std::string color_map_path = "/Users/cameron/Desktop/CProjects/Physics/ImagePixels.bin";
+    ColorMap color_map;
+    if(color_map.open(color_map_path) && !color_map.matches(image.getSize(), worldSize)){
+        std::cout << "color map was written for another image or world, ignoring it\n";
+        color_map.close();
+    }
+    // Input gathered on this thread, applied by whichever thread runs the solver
+    std::mutex input_mutex;
+    std::vector<Vector2f> clicked_spawns;
+    bool save_requested = false;
+    bool trace_toggled = false;
+    sf::FloatRect camera_view = Renderer::viewOf(viewport.getTransform(), window.getSize());
+    float camera_zoom = viewport.state.zoom;
+
+    const auto simulateFrame = [&](RenderFrame& out){
+        const auto start = std::chrono::steady_clock::now();
+        sf::FloatRect view;
+        float zoom;
+        // The clicked and the spouted objects of this frame get their colors
+        // from the map, nothing is removed here so they get new ids
+        const uint32_t first_id = solver.getIdCount();
+        {
+            std::lock_guard<std::mutex> lock{input_mutex};
+            view = camera_view;
+            zoom = camera_zoom;
+            for(const Vector2f position : clicked_spawns){
+                solver.addObject(position, 0.5f);
+            }
+            clicked_spawns.clear();
+            if(save_requested && !snapshot_writer.busy()){
+                solver.saveSnapshot(snapshot_writer, "snapshot.bin");
             }
-        }else {
-//            for(VerletObject& v : solver.objects) {
-//                v.color = image.getPixel(int(v.pos.x * scale), int(v.pos.y * scale));
-//            }
+            save_requested = false;
+            // Between updates, the only time a trace may start or be written
+            if(trace_toggled && Profiler::enabled){
+                Profiler& profiler = Profiler::instance();
+                if(!profiler.isTracing()){
+                    profiler.beginTrace();
+                    std::cout << "tracing, press T again to write trace.json\n";
+                }else{
+                    std::cout << (profiler.endTrace("trace.json") ? "wrote trace.json\n" : "could not write trace.json\n");
+                }
+            }
+            trace_toggled = false;
         }
 
         solver.update();
+        color_map.apply(solver, first_id, solver.getIdCount() - first_id);
+        renderer.buildFrame(out, view, zoom);
+        out.sleeping_count = solver.getSleepingCount();
+        out.update_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
 
+    // The simulation thread fills one frame while this thread draws another,
+    // and keeps to dt per frame on its own clock
+    TripleBuffer<RenderFrame> frames;
+    std::atomic<bool> simulating{pipelined};
+    std::thread simulation;
+    if(pipelined){
+        simulation = std::thread([&]{
+            const auto frame_duration = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(dt));
+            auto next_frame = std::chrono::steady_clock::now();
+            while(simulating){
+                simulateFrame(frames.back());
+                frames.publish();
+                next_frame += frame_duration;
+                const auto now = std::chrono::steady_clock::now();
+                // A frame that ran long delays the following ones instead of being caught up on
+                if(next_frame < now) next_frame = now;
+                else std::this_thread::sleep_until(next_frame);
+            }
+        });
+    }
 
+    while (window.isOpen())
+    {
+        const auto frame_start = std::chrono::steady_clock::now();
+        const float frame_ms = std::chrono::duration<float, std::milli>(frame_start - time).count();
+        time = frame_start;
+        {
+            std::lock_guard<std::mutex> lock{input_mutex};
+            camera_view = Renderer::viewOf(viewport.getTransform(), window.getSize());
+            camera_zoom = viewport.state.zoom;
+        }
+        if(pipelined){
+            // Keeps handling events when no new frame arrives
+            frames.acquire(std::chrono::milliseconds(100));
+        }else{
+            simulateFrame(frames.back());
+            frames.publish();
+            frames.acquire();
+        }
+        const RenderFrame& frame = frames.front();
 
         window.clear();
-//        shape.setPointCount(1000);
-//        window.draw(shape);
-//        pool.dispatch(size, [&](uint32_t start, uint32_t end) {
-//        for(uint32_t i{start}; i < end; i++) {
-//            shape.setRadius(window_width/worldSize.x/2);
-//            VerletObject& v = solver.objects[i];
-//            shape.setPosition((v.pos.x- v.radius)*window_width/worldSize.x, (v.pos.y - v.radius)*window_height/worldSize.y);
-//            shape.setFillColor(v.color);
-//            window.draw(shape);
-//        }
-//        });
-
-        for(uint32_t i{0}; i < size; i++) {
-            shape.setRadius(window_width/worldSize.x/2);
-            VerletObject& v = solver.objects[i];
-            shape.setPosition((v.pos.x- v.radius)*window_width/worldSize.x, (v.pos.y - v.radius)*window_height/worldSize.y);
-            shape.setFillColor(v.color);
-            shape.setTexture(&t);
-            window.draw(shape);
-        }
+        renderer.draw(window, viewport.getTransform(), frame);
 
         sf::Event event{};
         if(window.pollEvent(event)) {
-            if (event.type == sf::Event::Closed)
-                window.close();
+            // Every pending event is handled so panning does not lag behind the mouse
+            do {
+                if (event.type == sf::Event::MouseWheelScrolled) {
+                    viewport.wheelZoom(event.mouseWheelScroll.delta);
+                } else if (event.type == sf::Event::MouseButtonPressed && event.mouseButton.button == sf::Mouse::Middle) {
+                    viewport.click({float(event.mouseButton.x), float(event.mouseButton.y)});
+                } else if (event.type == sf::Event::MouseButtonReleased && event.mouseButton.button == sf::Mouse::Middle) {
+                    viewport.unclick();
+                } else if (event.type == sf::Event::MouseMoved) {
+                    viewport.setMousePosition({float(event.mouseMove.x), float(event.mouseMove.y)});
+                } else if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::T) {
+                    std::lock_guard<std::mutex> lock{input_mutex};
+                    trace_toggled = true;
+                } else if (event.type == sf::Event::Closed) {
+                    window.close();
+                }
+            } while (window.pollEvent(event));
             if (timer == 0 && sf::Mouse::isButtonPressed(sf::Mouse::Left)){
-                auto mouse_pos = sf::Mouse::getPosition(window);
-                solver.addObject({float(mouse_pos.x)/window_width*worldSize.x, float(mouse_pos.y)/window_height*worldSize.y}, 1.0f);
-                std::cout << event.mouseButton.x << " " << event.mouseButton.y << std::endl;
+                const Vector2f mouse_world = viewport.getMouseWorldPosition();
+                std::lock_guard<std::mutex> lock{input_mutex};
+                clicked_spawns.push_back(mouse_world);
+                std::cout << mouse_world.x << " " << mouse_world.y << std::endl;
                 timer = 15;
             }else if(timer == 0 && sf::Mouse::isButtonPressed(sf::Mouse::Right)){
-                auto mouse_pos = sf::Mouse::getPosition(window);
-                solver.addObject({float(mouse_pos.x)/window_width*worldSize.x, float(mouse_pos.y)/window_height*worldSize.y}, 1.0f);
-                std::cout << float(event.mouseButton.x)/window_width*worldSize.x << " " << float(event.mouseButton.y)/window_height*worldSize.y << std::endl;
+                const Vector2f mouse_world = viewport.getMouseWorldPosition();
+                std::lock_guard<std::mutex> lock{input_mutex};
+                clicked_spawns.push_back(mouse_world);
+                std::cout << mouse_world.x << " " << mouse_world.y << std::endl;
                 timer = 15;
             }
             if(sf::Keyboard::isKeyPressed(sf::Keyboard::Num1)){
@@ -124,35 +231,42 @@ int main() {
             }else if(sf::Keyboard::isKeyPressed(sf::Keyboard::Num3)){
                 input_size = 30.0f;
             }
+            if(sf::Keyboard::isKeyPressed(sf::Keyboard::S)){
+                std::lock_guard<std::mutex> lock{input_mutex};
+                save_requested = true;
+            }
             if(timer > 0) timer--;
         }
 
-        std::string s = std::to_string((std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - time)).count());
         sf::Text time_text;
         sf::Text objects_text;
         time_text.setFont(font);
         objects_text.setFont(font);
         objects_text.setPosition(time_text.getPosition().x, time_text.getPosition().y + 30);
-        std::string stime = std::to_string(((std::chrono::steady_clock::now() - time)/1000000.0).count());
-        time_text.setString("Delay: " + stime + "ms");
-        objects_text.setString("Objects: " + std::to_string(size));
-        std::chrono::steady_clock::now();
+        time_text.setString("Update: " + std::to_string(frame.update_ms) + "ms  Frame: " + std::to_string(frame_ms) + "ms");
+        objects_text.setString("Objects: " + std::to_string(frame.object_count) + "  Asleep: " + std::to_string(frame.sleeping_count)
+                               + "  Drawn: " + std::to_string(frame.visible_count));
 
         window.draw(time_text);
         window.draw(objects_text);
+        if(Profiler::enabled){
+            // Rolling averages over the last second of updates
+            sf::Text profile_text;
+            profile_text.setFont(font);
+            profile_text.setCharacterSize(14);
+            profile_text.setPosition(time_text.getPosition().x, time_text.getPosition().y + 60);
+            profile_text.setString(Profiler::instance().report(60));
+            window.draw(profile_text);
+        }
         window.display();
     }
 
-    std::ofstream s;
-    s.open("/Users/cameron/Desktop/CProjects/Physics/ImagePixels.txt");
-    if(!s.good()){
-        std::cout << "imagePixels not open\n";
+    simulating = false;
+    if(simulation.joinable()) simulation.join();
+
+    if(!ColorMap::write(color_map_path, pool, solver, image)){
+        std::cout << "color map not written\n";
         return 1;
     }
-    for(VerletObject& v : solver.objects){
-        s << image.getPixel(int(v.pos.x * scale), int(v.pos.y * scale)).toInteger() << " ";
-    }
-    fileStream.close();
-    s.close();
     return 0;
 }
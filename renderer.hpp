@@ -2,57 +2,133 @@
 // Created by Cameron Day on 3/23/23.
 //
 #pragma once
+#include <vector>
+#include <cmath>
+#include <algorithm>
 #include <SFML/Graphics.hpp>
 #include "Solver.hpp"
-#include "WindowContextHandler.hpp"
+#include "ViewCulling.hpp"
 
 
+// Everything needed to draw one simulated frame, detached from the solver
+// so it can be drawn while the solver already runs the next one
+struct RenderFrame
+{
+    // Textured quads of the visible objects
+    std::vector<sf::Vertex> vertices;
+    // Untextured density quads, used instead when zoomed far out
+    std::vector<sf::Vertex> splat_vertices;
+    uint64_t frame = 0;
+    uint32_t object_count = 0;
+    uint32_t sleeping_count = 0;
+    // Objects drawn, or density quads when zoomed out
+    uint32_t visible_count = 0;
+    // Time the solver took for this frame
+    float update_ms = 0.0f;
+};
+
+
+// Draws every visible object as one textured quad, all of them in a single
+// draw call. Visible objects come from the collision grid cells under the
+// view. Once a grid cell shrinks below a few pixels the objects are replaced
+// by density splats over blocks of cells. The quads are built on the thread
+// pool into a RenderFrame and streamed into vertex buffers that only grow.
 struct Renderer
 {
+    static constexpr uint32_t texture_size = 256;
+    // Base grid cells narrower than this on screen switch to density splats
+    static constexpr float lod_cell_pixels = 2.0f;
+    // Minimum splat block width on screen
+    static constexpr float splat_block_pixels = 3.0f;
+
     Solver& solver;
 
-    sf::VertexArray world_va;
-    sf::VertexArray objects_va;
-    sf::Texture     object_texture;
+    sf::VertexArray           world_va;
+    RenderFrame               frame;
+    sf::VertexBuffer          objects_vb;
+    sf::VertexBuffer          splat_vb;
+    sf::Texture               object_texture;
+    VisibleObjects            visible;
+    DensitySplat              splat;
 
     ThreadPool& thread_pool;
 
     explicit
     Renderer(Solver& solver_, ThreadPool& tp);
 
-    void render(RenderContext& context);
+    // Builds the current state and draws it, transform maps world
+    // coordinates to target pixels
+    void render(sf::RenderTarget& target, const sf::Transform& transform);
 
-    void initializeWorldVA();
+    // Solver side, only reads the solver and only writes out. view is the
+    // world rectangle on screen, pixels_per_unit its zoom
+    void buildFrame(RenderFrame& out, const sf::FloatRect& view, float pixels_per_unit);
+
+    // Drawing side, only reads the frame, needs the target's GL context
+    void draw(sf::RenderTarget& target, const sf::Transform& transform, const RenderFrame& in);
 
-    void updateParticlesVA();
+    // World rectangle a transform shows on a target of this size
+    static sf::FloatRect viewOf(const sf::Transform& transform, sf::Vector2u target_size);
 
-    void renderHUD(RenderContext& context);
+    // Streams vertices into buffer and draws them, from client memory where
+    // vertex buffers are unavailable
+    static void drawQuads(sf::RenderTarget& target, sf::VertexBuffer& buffer, const std::vector<sf::Vertex>& vertices,
+                          const sf::RenderStates& states);
+
+    void initializeWorldVA();
+
+    void initializeObjectTexture();
 };
 
 Renderer::Renderer(Solver& solver_, ThreadPool& tp)
         : solver{solver_}
         , world_va{sf::Quads, 4}
-        , objects_va{sf::Quads}
+        , objects_vb{sf::Quads, sf::VertexBuffer::Stream}
+        , splat_vb{sf::Quads, sf::VertexBuffer::Stream}
         , thread_pool{tp}
 {
     initializeWorldVA();
+    initializeObjectTexture();
+}
 
-    object_texture.loadFromFile("res/circle.png");
-    object_texture.generateMipmap();
-    object_texture.setSmooth(true);
+void Renderer::render(sf::RenderTarget& target, const sf::Transform& transform)
+{
+    // Transforms here only scale and translate, the first matrix entry is the zoom
+    buildFrame(frame, viewOf(transform, target.getSize()), transform.getMatrix()[0]);
+    draw(target, transform, frame);
 }
 
-void Renderer::render(RenderContext& context)
+sf::FloatRect Renderer::viewOf(const sf::Transform& transform, sf::Vector2u target_size)
 {
-    renderHUD(context);
-    context.draw(world_va);
+    return transform.getInverse().transformRect({0.0f, 0.0f, static_cast<float>(target_size.x), static_cast<float>(target_size.y)});
+}
+
+void Renderer::drawQuads(sf::RenderTarget& target, sf::VertexBuffer& buffer, const std::vector<sf::Vertex>& vertices,
+                         const sf::RenderStates& states)
+{
+    const auto vertex_count = vertices.size();
+    if (!vertex_count) {
+        return;
+    }
+    if (sf::VertexBuffer::isAvailable()) {
+        if (buffer.getVertexCount() < vertex_count) {
+            buffer.create(std::max(vertex_count, 2 * buffer.getVertexCount()));
+        }
+        buffer.update(vertices.data(), vertex_count, 0);
+        target.draw(buffer, 0, vertex_count, states);
+    } else {
+        target.draw(vertices.data(), vertex_count, sf::Quads, states);
+    }
+}
+
+void Renderer::draw(sf::RenderTarget& target, const sf::Transform& transform, const RenderFrame& in)
+{
+    target.draw(world_va, transform);
 
-    sf::RenderStates states;
+    drawQuads(target, splat_vb, in.splat_vertices, sf::RenderStates{transform});
+    sf::RenderStates states{transform};
     states.texture = &object_texture;
-    context.draw(world_va, states);
-    // Particles
-    updateParticlesVA();
-    context.draw(objects_va, states);
+    drawQuads(target, objects_vb, in.vertices, states);
 }
 
 void Renderer::initializeWorldVA()
@@ -70,46 +146,70 @@ void Renderer::initializeWorldVA()
     world_va[3].color = background_color;
 }
 
-void Renderer::updateParticlesVA()
+// White disc with an anti-aliased edge, the vertex color tints it
+void Renderer::initializeObjectTexture()
 {
-    objects_va.resize(solver.objects.size() * 4);
-
-    const float texture_size = 1024.0f;
-    const float radius       = 0.5f;
-    thread_pool.dispatch(static_cast<uint32_t>(solver.objects.size()), [&](uint32_t start, uint32_t end) {
-        for (uint32_t i{start}; i < end; ++i) {
-            const VerletObject& object = solver.objects[i];
-            const uint32_t idx = i << 2;
-            objects_va[idx + 0].position = object.pos + Vector2f{-radius, -radius};
-            objects_va[idx + 1].position = object.pos + Vector2f { radius, -radius};
-            objects_va[idx + 2].position = object.pos + Vector2f { radius,  radius};
-            objects_va[idx + 3].position = object.pos + Vector2f {-radius,  radius};
-            objects_va[idx + 0].texCoords = {0.0f        , 0.0f};
-            objects_va[idx + 1].texCoords = {texture_size, 0.0f};
-            objects_va[idx + 2].texCoords = {texture_size, texture_size};
-            objects_va[idx + 3].texCoords = {0.0f        , texture_size};
-
-            const sf::Color color = object.color;
-            objects_va[idx + 0].color = color;
-            objects_va[idx + 1].color = color;
-            objects_va[idx + 2].color = color;
-            objects_va[idx + 3].color = color;
+    sf::Image image;
+    image.create(texture_size, texture_size, sf::Color::Transparent);
+    const float center = 0.5f * texture_size;
+    for (uint32_t y{0}; y < texture_size; ++y) {
+        for (uint32_t x{0}; x < texture_size; ++x) {
+            const float dx = static_cast<float>(x) + 0.5f - center;
+            const float dy = static_cast<float>(y) + 0.5f - center;
+            const float coverage = std::clamp(center - std::sqrt(dx * dx + dy * dy), 0.0f, 1.0f);
+            image.setPixel(x, y, sf::Color{255, 255, 255, static_cast<sf::Uint8>(255.0f * coverage)});
         }
-    });
+    }
+    object_texture.loadFromImage(image);
+    object_texture.generateMipmap();
+    object_texture.setSmooth(true);
 }
 
-void Renderer::renderHUD(RenderContext&)
+void Renderer::buildFrame(RenderFrame& out, const sf::FloatRect& view, float pixels_per_unit)
 {
-    // HUD
-    /*const float margin    = 20.0f;
-    float       current_y = margin;
-    text_time.setString("Simulation time: " + toString(phys_time.get()) + "ms");
-    text_time.setPosition({margin, current_y});
-    current_y += text_time.getBounds().y + 0.5f * margin;
-    context.renderToHUD(text_time, RenderContext::Mode::Normal);
-
-    text_objects.setString("Objects: " + toString(simulation.solver.objects.size()));
-    text_objects.setPosition({margin, current_y});
-    current_y += text_objects.getBounds().y + 0.5f * margin;
-    context.renderToHUD(text_objects, RenderContext::Mode::Normal);*/
-}
\ No newline at end of file
+    const auto object_count = static_cast<uint32_t>(solver.objects.size());
+    const HierarchicalGrid& grid = solver.getGrid();
+    out.frame = solver.getFrameCount();
+    out.object_count = object_count;
+
+    const float cell_pixels = grid.base_cell_size * pixels_per_unit;
+    if (cell_pixels < lod_cell_pixels && gridCovers(grid, object_count)) {
+        const float cells_per_block = std::ceil(splat_block_pixels / cell_pixels);
+        splat.build(thread_pool, grid, solver.objects, view, cells_per_block * grid.base_cell_size, out.splat_vertices);
+        out.vertices.clear();
+        out.visible_count = static_cast<uint32_t>(out.splat_vertices.size() / 4);
+        return;
+    }
+    out.splat_vertices.clear();
+
+    visible.collect(thread_pool, grid, view, object_count);
+    const uint32_t visible_count = visible.size();
+    out.visible_count = visible_count;
+    out.vertices.resize(visible_count * 4);
+    std::vector<sf::Vertex>& object_vertices = out.vertices;
+    const uint32_t* slots = visible.slots.data();
+
+    const float size = static_cast<float>(texture_size);
+    thread_pool.dispatch(visible_count, [&](uint32_t start, uint32_t end) {
+        for (uint32_t v{start}; v < end; ++v) {
+            const uint32_t i = slots[v];
+            const Vector2f pos    = solver.objects.pos[i];
+            const float    radius = solver.objects.radius[i];
+            const uint32_t idx    = v << 2;
+            object_vertices[idx + 0].position = pos + Vector2f{-radius, -radius};
+            object_vertices[idx + 1].position = pos + Vector2f { radius, -radius};
+            object_vertices[idx + 2].position = pos + Vector2f { radius,  radius};
+            object_vertices[idx + 3].position = pos + Vector2f {-radius,  radius};
+            object_vertices[idx + 0].texCoords = {0.0f, 0.0f};
+            object_vertices[idx + 1].texCoords = {size, 0.0f};
+            object_vertices[idx + 2].texCoords = {size, size};
+            object_vertices[idx + 3].texCoords = {0.0f, size};
+
+            const sf::Color color = solver.objects.color[i];
+            object_vertices[idx + 0].color = color;
+            object_vertices[idx + 1].color = color;
+            object_vertices[idx + 2].color = color;
+            object_vertices[idx + 3].color = color;
+        }
+    });
+}